@@ -0,0 +1,214 @@
+#include "SyntheticPlan.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+// Deterministic values without <random>'s per-platform differences
+struct Lcg
+{
+    uint64_t state;
+
+    double next()   // [0, 1)
+    {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        return double(state >> 11) * (1.0 / 9007199254740992.0);
+    }
+};
+
+void appendDS(std::string& s, double v)
+{
+    char buf[32];
+    const int n = std::snprintf(buf, sizeof(buf), "%.2f", v);
+    if(!s.empty()) s += '\\';
+    s.append(buf, static_cast<size_t>(n));
+}
+
+std::string toDS(double v)
+{
+    std::string s;
+    appendDS(s, v);
+    return s;
+}
+
+void putDevice(DcmItem* cp, const char* type, const std::string& positions)
+{
+    DcmItem* dev = nullptr;
+    if(cp->findOrCreateSequenceItem(DCM_BeamLimitingDevicePositionSequence, dev, -2).good() && dev)
+    {
+        dev->putAndInsertString(DCM_RTBeamLimitingDeviceType, type);
+        dev->putAndInsertString(DCM_LeafJawPositions, positions.c_str());
+    }
+}
+
+std::string randomAperture(Lcg& rng, int leafPairs)
+{
+    std::string s;
+    s.reserve(static_cast<size_t>(leafPairs) * 2 * 8);
+
+    std::vector<double> gap(static_cast<size_t>(leafPairs));
+    for(auto& g : gap) g = 5.0 + 50.0 * rng.next();
+    for(int i = 0; i < leafPairs; ++i) appendDS(s, -gap[i] + 10.0 * rng.next());   // bank A
+    for(int i = 0; i < leafPairs; ++i) appendDS(s,  gap[i] + 10.0 * rng.next());   // bank B
+    return s;
+}
+
+void addBeam(DcmDataset& ds, const PlanShape& shape, int number, Lcg& rng)
+{
+    DcmItem* beam = nullptr;
+    if(ds.findOrCreateSequenceItem(DCM_BeamSequence, beam, -2).bad() || !beam) return;
+
+    const int cps = shape.controlPointsPerBeam;
+
+    beam->putAndInsertString(DCM_TreatmentMachineName, "TrueBeam");
+    beam->putAndInsertString(DCM_PrimaryDosimeterUnit, "MU");
+    beam->putAndInsertString(DCM_SourceAxisDistance, "1000");
+    beam->putAndInsertString(DCM_BeamNumber, std::to_string(number).c_str());
+    beam->putAndInsertString(DCM_BeamName, ((shape.arc ? "ARC" : "FLD") + std::to_string(number)).c_str());
+    beam->putAndInsertString(DCM_BeamType, shape.arc ? "DYNAMIC" : "STATIC");
+    beam->putAndInsertString(DCM_RadiationType, "PHOTON");
+    beam->putAndInsertString(DCM_TreatmentDeliveryType, "TREATMENT");
+    beam->putAndInsertString(DCM_FinalCumulativeMetersetWeight, "1");
+    beam->putAndInsertString(DCM_NumberOfControlPoints, std::to_string(cps).c_str());
+
+    // MLC geometry: 10 x 10 mm, 40 x 5 mm, 10 x 10 mm leaves
+    std::string boundaries;
+    double edge = -200.0;
+    appendDS(boundaries, edge);
+    for(int i = 0; i < shape.leafPairs; ++i)
+    {
+        edge += (i < 10 || i >= shape.leafPairs - 10) ? 10.0 : 5.0;
+        appendDS(boundaries, edge);
+    }
+    const struct { const char* type; int pairs; } devices[] = { { "ASYMX", 1 }, { "ASYMY", 1 }, { "MLCX", shape.leafPairs } };
+    for(const auto& d : devices)
+    {
+        DcmItem* dev = nullptr;
+        if(beam->findOrCreateSequenceItem(DCM_BeamLimitingDeviceSequence, dev, -2).bad() || !dev) continue;
+        dev->putAndInsertString(DCM_RTBeamLimitingDeviceType, d.type);
+        dev->putAndInsertString(DCM_NumberOfLeafJawPairs, std::to_string(d.pairs).c_str());
+        if(d.pairs > 1)
+            dev->putAndInsertString(DCM_LeafPositionBoundaries, boundaries.c_str());
+    }
+
+    const double fieldGantry = 360.0 / 7.0 * (number - 1);
+    const bool clockwise = number % 2 == 1;
+    std::string aperture;
+
+    for(int i = 0; i < cps; ++i)
+    {
+        DcmItem* cp = nullptr;
+        if(beam->findOrCreateSequenceItem(DCM_ControlPointSequence, cp, -2).bad() || !cp) return;
+
+        const double t = cps > 1 ? double(i) / (cps - 1) : 0.0;
+        cp->putAndInsertString(DCM_ControlPointIndex, std::to_string(i).c_str());
+
+        // step-and-shoot: segment k is CP pair (2k, 2k+1) with one aperture
+        const double weight = shape.arc ? t : double((i + 1) / 2) / (cps / 2);
+        cp->putAndInsertString(DCM_CumulativeMetersetWeight, toDS(weight).c_str());
+
+        if(shape.arc || i % 2 == 0)
+            aperture = randomAperture(rng, shape.leafPairs);
+
+        if(i == 0)
+        {
+            const double g = shape.arc ? (clockwise ? 181.0 : 179.0) : fieldGantry;
+            cp->putAndInsertString(DCM_NominalBeamEnergy, "6");
+            cp->putAndInsertString(DCM_DoseRateSet, "600");
+            cp->putAndInsertString(DCM_GantryAngle, toDS(g).c_str());
+            cp->putAndInsertString(DCM_GantryRotationDirection, shape.arc ? (clockwise ? "CW" : "CC") : "NONE");
+            cp->putAndInsertString(DCM_BeamLimitingDeviceAngle, shape.arc ? "30" : "0");
+            cp->putAndInsertString(DCM_BeamLimitingDeviceRotationDirection, "NONE");
+            cp->putAndInsertString(DCM_PatientSupportAngle, "0");
+            cp->putAndInsertString(DCM_PatientSupportRotationDirection, "NONE");
+            cp->putAndInsertString(DCM_IsocenterPosition, "1.5\\-20.25\\3.75");
+            cp->putAndInsertString(DCM_SourceToSurfaceDistance, "912.4");
+
+            putDevice(cp, "ASYMX", "-60\\60");
+            putDevice(cp, "ASYMY", "-80\\80");
+            putDevice(cp, "MLCX", aperture);
+        }
+        else
+        {
+            if(shape.arc)
+            {
+                // one full turn away from the start, wrapping through 0
+                double g = clockwise ? 181.0 + 358.0 * t : 179.0 - 358.0 * t;
+                if(g >= 360.0) g -= 360.0;
+                if(g < 0.0) g += 360.0;
+                cp->putAndInsertString(DCM_GantryAngle, toDS(g).c_str());
+            }
+            putDevice(cp, "MLCX", aperture);
+        }
+    }
+}
+
+void addFractionGroup(DcmDataset& ds, const PlanShape& shape)
+{
+    DcmItem* fg = nullptr;
+    if(ds.findOrCreateSequenceItem(DCM_FractionGroupSequence, fg, -2).bad() || !fg) return;
+
+    fg->putAndInsertString(DCM_FractionGroupNumber, "1");
+    fg->putAndInsertString(DCM_NumberOfFractionsPlanned, "30");
+    fg->putAndInsertString(DCM_NumberOfBeams, std::to_string(shape.beams).c_str());
+
+    for(int b = 1; b <= shape.beams; ++b)
+    {
+        DcmItem* ref = nullptr;
+        if(fg->findOrCreateSequenceItem(DCM_ReferencedBeamSequence, ref, -2).bad() || !ref) return;
+
+        ref->putAndInsertString(DCM_BeamDoseSpecificationPoint, "1.5\\-20.25\\3.75");
+        ref->putAndInsertString(DCM_BeamDose, "0.6");
+        ref->putAndInsertString(DCM_BeamMeterset, "123.4");
+        ref->putAndInsertString(DCM_ReferencedBeamNumber, std::to_string(b).c_str());
+    }
+}
+
+}
+
+std::vector<PlanShape> standardShapes()
+{
+    return {
+        { "imrt_7field",  7, 30,    60, false },
+        { "vmat_2arc",    2, 178,   60, true  },
+        { "vmat_4arc",    4, 178,   60, true  },
+        { "huge_10k",     1, 10000, 60, true  },
+    };
+}
+
+std::unique_ptr<DcmDataset> makeSyntheticPlan(const PlanShape& shape)
+{
+    auto ds = std::make_unique<DcmDataset>();
+    Lcg rng{ 0x5eed0000u + static_cast<uint64_t>(shape.beams * 100003 + shape.controlPointsPerBeam) };
+
+    ds->putAndInsertString(DCM_SOPClassUID, UID_RTPlanStorage);
+    ds->putAndInsertString(DCM_SOPInstanceUID, ("1.2.826.0.1.3680043.2.1125.9." + std::to_string(shape.controlPointsPerBeam)).c_str());
+    ds->putAndInsertString(DCM_StudyInstanceUID, "1.2.826.0.1.3680043.2.1125.1");
+    ds->putAndInsertString(DCM_SeriesInstanceUID, "1.2.826.0.1.3680043.2.1125.2");
+    ds->putAndInsertString(DCM_FrameOfReferenceUID, "1.2.826.0.1.3680043.2.1125.3");
+    ds->putAndInsertString(DCM_Modality, "RTPLAN");
+    ds->putAndInsertString(DCM_PatientName, "Bench^Synthetic");
+    ds->putAndInsertString(DCM_PatientID, "BENCH001");
+    ds->putAndInsertString(DCM_RTPlanLabel, shape.name.c_str());
+    ds->putAndInsertString(DCM_RTPlanName, shape.name.c_str());
+    ds->putAndInsertString(DCM_RTPlanGeometry, "PATIENT");
+    ds->putAndInsertString(DCM_ApprovalStatus, "UNAPPROVED");
+
+    DcmItem* ss = nullptr;
+    if(ds->findOrCreateSequenceItem(DCM_ReferencedStructureSetSequence, ss, -2).good() && ss)
+    {
+        ss->putAndInsertString(DCM_ReferencedSOPClassUID, UID_RTStructureSetStorage);
+        ss->putAndInsertString(DCM_ReferencedSOPInstanceUID, "1.2.826.0.1.3680043.2.1125.4");
+    }
+
+    addFractionGroup(*ds, shape);
+
+    for(int b = 1; b <= shape.beams; ++b)
+        addBeam(*ds, shape, b, rng);
+
+    return ds;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <dcmtk/dcmdata/dctk.h>
+
+// Shape of a generated RTPLAN.
+struct PlanShape
+{
+    std::string name;
+    int beams = 1;
+    int controlPointsPerBeam = 2;
+    int leafPairs = 60;
+    bool arc = false;               // VMAT: gantry moves, new aperture every CP
+};
+
+// Representative corpus: static step-and-shoot IMRT, 2- and 4-arc VMAT
+// (178 CPs per arc) and a pathological 10k-CP single beam.
+std::vector<PlanShape> standardShapes();
+
+// Builds the dataset in memory with DCMTK, laid out the way treatment
+// planning systems write it: the first CP of a beam carries every
+// attribute, later CPs only what changes. Values come from a fixed seed so
+// runs are comparable.
+std::unique_ptr<DcmDataset> makeSyntheticPlan(const PlanShape& shape);
@@ -0,0 +1,578 @@
+// dicom_reader_bench: parse throughput on a synthetic RTPLAN corpus.
+//
+// Every benchmark runs on the same in-memory datasets and reports, per
+// plan shape, the median/min ns per control point, heap allocations and
+// bytes per run (global operator new is counted) and the process peak RSS.
+// Output is one JSON document on stdout. The exit status is 1 when the
+// fast DS decoder disagrees with DCMTK on any value (see stderr).
+
+#include <dcmtk/dcmdata/dctk.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <memory_resource>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "Beam.h"
+#include "ControlPoint.h"
+#include "Fluence.h"
+#include "Metrics.h"
+#include "PlanDiff.h"
+#include "Plan.h"
+#include "PlanExport.h"
+#include "SyntheticPlan.h"
+#include "dicom/DicomUtils.h"
+
+namespace fs = std::filesystem;
+
+// ---- allocation counting ----
+
+static std::atomic<uint64_t> gAllocs{0};
+static std::atomic<uint64_t> gAllocBytes{0};
+
+static void* countedAlloc(size_t n)
+{
+    gAllocs.fetch_add(1, std::memory_order_relaxed);
+    gAllocBytes.fetch_add(n, std::memory_order_relaxed);
+    if(void* p = std::malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void* operator new(size_t n) { return countedAlloc(n); }
+void* operator new[](size_t n) { return countedAlloc(n); }
+void* operator new(size_t n, const std::nothrow_t&) noexcept
+{
+    try { return countedAlloc(n); } catch(...) { return nullptr; }
+}
+void* operator new[](size_t n, const std::nothrow_t&) noexcept
+{
+    try { return countedAlloc(n); } catch(...) { return nullptr; }
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+
+// ---- measurement ----
+
+namespace
+{
+
+// keeps results observable so the work is not optimized away
+volatile size_t gSink = 0;
+
+struct Result
+{
+    std::string bench;
+    double nsPerCpMedian = 0.0;
+    double nsPerCpMin = 0.0;
+    double allocsPerRun = 0.0;
+    double bytesPerRun = 0.0;
+};
+
+template<class F>
+Result measure(const char* bench, size_t cps, int reps, F&& body)
+{
+    Result r;
+    r.bench = bench;
+
+    std::vector<double> ns;
+    ns.reserve(static_cast<size_t>(reps));
+
+    for(int i = 0; i < reps; ++i)
+    {
+        const uint64_t a0 = gAllocs.load(std::memory_order_relaxed);
+        const uint64_t b0 = gAllocBytes.load(std::memory_order_relaxed);
+        const auto t0 = std::chrono::steady_clock::now();
+
+        body();
+
+        const auto t1 = std::chrono::steady_clock::now();
+        ns.push_back(std::chrono::duration<double, std::nano>(t1 - t0).count());
+
+        // every run does the same work; keep the first run's numbers
+        if(i == 0)
+        {
+            r.allocsPerRun = double(gAllocs.load(std::memory_order_relaxed) - a0);
+            r.bytesPerRun = double(gAllocBytes.load(std::memory_order_relaxed) - b0);
+        }
+    }
+
+    std::sort(ns.begin(), ns.end());
+    const double perCp = cps ? 1.0 / double(cps) : 0.0;
+    r.nsPerCpMedian = ns[ns.size() / 2] * perCp;
+    r.nsPerCpMin = ns.front() * perCp;
+    return r;
+}
+
+long peakRssKb()
+{
+    struct rusage ru;
+    return ::getrusage(RUSAGE_SELF, &ru) == 0 ? ru.ru_maxrss : -1;
+}
+
+std::vector<DcmItem*> itemsOf(DcmItem* parent, const DcmTagKey& seqTag)
+{
+    std::vector<DcmItem*> items;
+    if(DcmSequenceOfItems* seq = dicom::getSequence(parent, seqTag))
+    {
+        items.reserve(seq->card());
+        for(unsigned long i = 0; i < seq->card(); ++i)
+            if(DcmItem* it = seq->getItem(i)) items.push_back(it);
+    }
+    return items;
+}
+
+struct Corpus
+{
+    std::vector<DcmItem*> beams;
+    std::vector<std::vector<DcmItem*>> controlPoints;   // per beam
+    std::vector<DcmItem*> devices;                      // every device item of every CP
+    size_t totalCps = 0;
+};
+
+Corpus index(DcmDataset* ds)
+{
+    Corpus c;
+    c.beams = itemsOf(ds, DCM_BeamSequence);
+    for(DcmItem* beam : c.beams)
+    {
+        c.controlPoints.push_back(itemsOf(beam, DCM_ControlPointSequence));
+        c.totalCps += c.controlPoints.back().size();
+        for(DcmItem* cp : c.controlPoints.back())
+            for(DcmItem* dev : itemsOf(cp, DCM_BeamLimitingDevicePositionSequence))
+                c.devices.push_back(dev);
+    }
+    return c;
+}
+
+// Per-tag lookups the way ControlPoint parsing worked before the
+// single-pass item reader; kept as the reference point for append().
+void perTagControlPoint(DcmItem* cp, std::vector<double>& scratch)
+{
+    Float64 d;
+    Sint32 i;
+    OFString s;
+    cp->findAndGetSint32(DCM_ControlPointIndex, i);
+    cp->findAndGetFloat64(DCM_CumulativeMetersetWeight, d);
+    cp->findAndGetFloat64(DCM_GantryAngle, d);
+    cp->findAndGetOFString(DCM_GantryRotationDirection, s);
+    cp->findAndGetFloat64(DCM_BeamLimitingDeviceAngle, d);
+    cp->findAndGetFloat64(DCM_PatientSupportAngle, d);
+    cp->findAndGetFloat64(DCM_NominalBeamEnergy, d);
+    cp->findAndGetFloat64(DCM_DoseRateSet, d);
+    cp->findAndGetFloat64(DCM_SourceToSurfaceDistance, d);
+    for(unsigned long k = 0; k < 3; ++k)
+        cp->findAndGetFloat64(DCM_IsocenterPosition, d, k);
+
+    for(DcmItem* dev : itemsOf(cp, DCM_BeamLimitingDevicePositionSequence))
+    {
+        dev->findAndGetOFString(DCM_RTBeamLimitingDeviceType, s);
+        dicom::getDoubleVector(dev, DCM_LeafJawPositions, scratch);
+    }
+}
+
+// Value-by-value DS decoding, the baseline for the bulk getDoubles()
+size_t perValueDoubles(DcmItem* dev, double* out, size_t capacity)
+{
+    DcmElement* elem = nullptr;
+    if(dev->findAndGetElement(DCM_LeafJawPositions, elem).bad() || !elem) return 0;
+
+    const unsigned long vm = elem->getVM();
+    size_t n = 0;
+    for(unsigned long k = 0; k < vm && n < capacity; ++k)
+    {
+        Float64 v;
+        if(dev->findAndGetFloat64(DCM_LeafJawPositions, v, k).bad()) break;
+        out[n++] = v;
+    }
+    return n;
+}
+
+// ---- DS decoding must match DCMTK ----
+
+// Every value decodeDecimalString() accepts is compared bit for bit with
+// DCMTK's getFloat64(); values it declines go to DCMTK anyway. Returns
+// the number of mismatching elements, each reported on stderr.
+size_t checkDecimalElement(DcmElement* elem)
+{
+    char* raw = nullptr;
+    if(!elem || elem->getString(raw).bad() || !raw) return 0;
+    const size_t len = std::strlen(raw);
+
+    size_t count = 0;
+    if(!dicom::decodeDecimalString(raw, len, nullptr, 0, count)) return 0;
+    std::vector<double> fast(count);
+    dicom::decodeDecimalString(raw, len, fast.data(), fast.size(), count);
+
+    bool same = count == elem->getVM();
+    for(size_t k = 0; same && k < count; ++k)
+    {
+        Float64 v;
+        same = elem->getFloat64(v, static_cast<unsigned long>(k)).good() &&
+               std::memcmp(&v, &fast[k], sizeof(double)) == 0;
+    }
+    if(!same)
+        std::cerr << "bench: DS \"" << std::string(raw, std::min<size_t>(len, 80))
+                  << "\" decodes differently from DCMTK\n";
+    return same ? 0 : 1;
+}
+
+// LeafJawPositions and IsocenterPosition of the whole corpus
+size_t checkDecimalCorpus(const Corpus& c)
+{
+    size_t bad = 0;
+    DcmElement* elem = nullptr;
+    for(DcmItem* dev : c.devices)
+        if(dev->findAndGetElement(DCM_LeafJawPositions, elem).good())
+            bad += checkDecimalElement(elem);
+    for(const auto& cps : c.controlPoints)
+        for(DcmItem* cp : cps)
+            if(cp->findAndGetElement(DCM_IsocenterPosition, elem).good())
+                bad += checkDecimalElement(elem);
+    return bad;
+}
+
+// spellings the synthetic corpus never produces
+size_t checkDecimalSpellings()
+{
+    static const char* const kSpellings[] = {
+        "+1", "1e3", "1E-3", "+2.5e+2", "-0", "-0.0", " 12.5", "12.5 ", "  -7  ",
+        "5.", ".5", "-.5", "007", "0.1000000000000000055511151231257827",
+        "3.14159265358979323846264338327950288", "123456789012345678901234",
+        "2.2250738585072011e-308", "4.9406564584124654e-324", "1.7976931348623157e308",
+        "1e-400", "1\\-0\\+2.5e+2\\ 3 ",
+    };
+    size_t bad = 0;
+    for(const char* spelling : kSpellings)
+    {
+        DcmDecimalString elem(DCM_LeafJawPositions);
+        if(elem.putString(spelling).good())
+            bad += checkDecimalElement(&elem);
+    }
+    return bad;
+}
+
+std::vector<Result> runShape(DcmDataset* ds, const PlanShape& shape, int reps,
+                             const fs::path* fileDir, const std::string& filter)
+{
+    const Corpus c = index(ds);
+    const size_t cps = c.totalCps;
+    std::vector<Result> out;
+
+    auto wanted = [&](const char* bench){
+        return filter.empty() || shape.name.find(filter) != std::string::npos ||
+               std::string(bench).find(filter) != std::string::npos;
+    };
+
+    if(wanted("plan"))
+        out.push_back(measure("plan", cps, reps, [&]{
+            Plan p(ds);
+            gSink = gSink + p.beams().size();
+        }));
+
+    // the same parse into one preallocated arena: what remains in
+    // allocsPerRun is DCMTK's own work and the plan's strings
+    if(wanted("plan.arena"))
+    {
+        const uint64_t b0 = gAllocBytes.load(std::memory_order_relaxed);
+        { Plan p(ds); gSink = gSink + p.beams().size(); }
+        std::vector<std::byte> buffer(2 * (gAllocBytes.load(std::memory_order_relaxed) - b0) + 4096);
+
+        out.push_back(measure("plan.arena", cps, reps, [&]{
+            std::pmr::monotonic_buffer_resource arena(buffer.data(), buffer.size());
+            Plan p(ds, &arena);
+            gSink = gSink + p.beams().size();
+        }));
+    }
+
+    if(wanted("beam"))
+        out.push_back(measure("beam", cps, reps, [&]{
+            for(DcmItem* item : c.beams)
+            {
+                Beam b(item);
+                gSink = gSink + b.controlPoints().size();
+            }
+        }));
+
+    if(wanted("controlPoint"))
+        out.push_back(measure("controlPoint", cps, reps, [&]{
+            for(const auto& items : c.controlPoints)
+            {
+                ControlPointTable t(shape.leafPairs);
+                t.reserve(items.size());
+                for(DcmItem* cp : items)
+                    t.append(cp);
+                gSink = gSink + t.apertureCount();
+            }
+        }));
+
+    if(wanted("controlPoint.perTag"))
+        out.push_back(measure("controlPoint.perTag", cps, reps, [&]{
+            std::vector<double> scratch;
+            for(const auto& items : c.controlPoints)
+                for(DcmItem* cp : items)
+                    perTagControlPoint(cp, scratch);
+            gSink = gSink + scratch.size();
+        }));
+
+    if(wanted("get.getDouble"))
+        out.push_back(measure("get.getDouble", cps, reps, [&]{
+            double v = 0.0;
+            for(const auto& items : c.controlPoints)
+                for(DcmItem* cp : items)
+                    dicom::getDouble(cp, DCM_CumulativeMetersetWeight, v);
+            gSink = gSink + static_cast<size_t>(v);
+        }));
+
+    if(wanted("get.getInt"))
+        out.push_back(measure("get.getInt", cps, reps, [&]{
+            int v = 0;
+            for(const auto& items : c.controlPoints)
+                for(DcmItem* cp : items)
+                    dicom::getInt(cp, DCM_ControlPointIndex, v);
+            gSink = gSink + static_cast<size_t>(v);
+        }));
+
+    if(wanted("get.getString"))
+        out.push_back(measure("get.getString", cps, reps, [&]{
+            std::string v;
+            for(DcmItem* dev : c.devices)
+                dicom::getString(dev, DCM_RTBeamLimitingDeviceType, v);
+            gSink = gSink + v.size();
+        }));
+
+    if(wanted("metrics"))
+    {
+        const Plan plan(ds);
+        out.push_back(measure("metrics", cps, reps, [&]{
+            const PlanMetrics pm = computePlanMetrics(plan);
+            gSink = gSink + pm.controlPoints;
+        }));
+    }
+
+    // every CP as an NDJSON record, written to /dev/null
+    if(wanted("export.ndjson"))
+    {
+        const Plan plan(ds);
+        JsonWriter sink;
+        if(sink.open("/dev/null"))
+            out.push_back(measure("export.ndjson", cps, reps, [&]{
+                gSink = gSink + writePlanNdjson(plan, sink, { true });
+                sink.flush();
+            }));
+    }
+
+    if(wanted("fluence"))
+    {
+        const Plan plan(ds);
+        out.push_back(measure("fluence", cps, reps, [&]{
+            for(const Beam& b : plan.beams())
+                gSink = gSink + computeFluence(b).values.size();
+        }));
+    }
+
+    // delivery-simulation sampling: 100 states per stored CP
+    if(wanted("interpolate"))
+    {
+        const Plan plan(ds);
+        constexpr size_t kDensity = 100;
+        std::vector<double> queries, gantry, mlc;
+        out.push_back(measure("interpolate", cps, reps, [&]{
+            for(const Beam& b : plan.beams())
+            {
+                const size_t q = b.controlPoints().size() * kDensity;
+                queries.resize(q);
+                gantry.resize(q);
+                mlc.resize(q * 2 * static_cast<size_t>(b.leafPairs));
+                for(size_t i = 0; i < q; ++i)
+                    queries[i] = double(i) / double(q);
+
+                InterpolationBuffers buf;
+                buf.gantryAngleDeg = gantry.data();
+                buf.mlc = mlc.data();
+                b.interpolate(queries.data(), q, buf);
+                gSink = gSink + q;
+            }
+        }));
+    }
+
+    // worst case for the diff: identical plans, every column scanned in full
+    if(wanted("diff"))
+    {
+        const Plan a(ds), b(ds);
+        out.push_back(measure("diff", cps, reps, [&]{
+            gSink = gSink + diffPlans(a, b).differences.size() + 1;
+        }));
+    }
+
+    const size_t capacity = 2 * static_cast<size_t>(shape.leafPairs);
+    std::vector<double> buf(capacity);
+
+    if(wanted("get.getDoubles"))
+        out.push_back(measure("get.getDoubles", cps, reps, [&]{
+            size_t n = 0;
+            for(DcmItem* dev : c.devices)
+                dicom::getDoubles(dev, DCM_LeafJawPositions, buf.data(), capacity, n);
+            gSink = gSink + n;
+        }));
+
+    if(wanted("get.perValueFloat64"))
+        out.push_back(measure("get.perValueFloat64", cps, reps, [&]{
+            size_t n = 0;
+            for(DcmItem* dev : c.devices)
+                n += perValueDoubles(dev, buf.data(), capacity);
+            gSink = gSink + n;
+        }));
+
+    // full path including file I/O and DCMTK's own parse
+    if(fileDir && (wanted("file") || wanted("file.lazy") || wanted("file.stream")))
+    {
+        const fs::path file = *fileDir / (shape.name + ".dcm");
+        DcmFileFormat ff(ds, OFTrue);   // deep copy: the shape keeps owning ds
+        if(ff.saveFile(file.c_str(), EXS_LittleEndianExplicit).good())
+        {
+            if(wanted("file"))
+                out.push_back(measure("file", cps, reps, [&]{
+                    DcmFileFormat in;
+                    if(in.loadFile(file.c_str()).good())
+                    {
+                        Plan p(in.getDataset());
+                        gSink = gSink + p.beams().size();
+                    }
+                }));
+
+            // what a listing pays: no beam is decoded
+            if(wanted("file.lazy"))
+                out.push_back(measure("file.lazy", cps, reps, [&]{
+                    std::string error;
+                    if(auto p = Plan::openLazy(file.string(), error))
+                        gSink = gSink + p->beamCount();
+                }));
+
+            // a fold over every CP without building the tree
+            if(wanted("file.stream"))
+                out.push_back(measure("file.stream", cps, reps, [&]{
+                    std::string error;
+                    double sum = 0.0;
+                    forEachControlPoint(file.string(), [&](const Beam&, const ControlPoint& cp){
+                        sum += cp.gantryAngleDeg();
+                        return true;
+                    }, error);
+                    gSink = gSink + static_cast<size_t>(sum);
+                }));
+        }
+        else
+        {
+            std::cerr << "bench: could not write " << file << "\n";
+        }
+    }
+
+    return out;
+}
+
+void printUsage()
+{
+    std::cerr << "Usage: dicom_reader_bench [--reps N] [--filter SUBSTR] [--no-file]\n"
+              << "  --reps N         timed runs per benchmark (default 5)\n"
+              << "  --filter SUBSTR  only plan shapes or benchmarks whose name contains SUBSTR\n"
+              << "  --no-file        skip the save/load round trip through a temp directory\n";
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    int reps = 5;
+    std::string filter;
+    bool withFiles = true;
+
+    for(int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if(arg == "--reps" && i + 1 < argc)
+            reps = std::max(1, std::atoi(argv[++i]));
+        else if(arg == "--filter" && i + 1 < argc)
+            filter = argv[++i];
+        else if(arg == "--no-file")
+            withFiles = false;
+        else
+        {
+            printUsage();
+            return 1;
+        }
+    }
+
+    fs::path tmpDir;
+    if(withFiles)
+    {
+        std::error_code ec;
+        tmpDir = fs::temp_directory_path(ec) / ("dicom_reader_bench." + std::to_string(::getpid()));
+        fs::create_directories(tmpDir, ec);
+        if(ec)
+        {
+            std::cerr << "bench: no temp directory, skipping file benchmarks\n";
+            withFiles = false;
+        }
+    }
+
+    size_t decodeMismatches = checkDecimalSpellings();
+
+    std::cout << "{\n  \"reps\": " << reps << ",\n  \"shapes\": [";
+
+    bool firstShape = true;
+    for(const PlanShape& shape : standardShapes())
+    {
+        const auto ds = makeSyntheticPlan(shape);
+        decodeMismatches += checkDecimalCorpus(index(ds.get()));
+        const auto results = runShape(ds.get(), shape, reps, withFiles ? &tmpDir : nullptr, filter);
+        if(results.empty()) continue;
+
+        std::cout << (firstShape ? "\n" : ",\n")
+                  << "    {\"name\": \"" << shape.name << "\", \"beams\": " << shape.beams
+                  << ", \"controlPoints\": " << shape.beams * shape.controlPointsPerBeam
+                  << ", \"leafPairs\": " << shape.leafPairs
+                  << ", \"peakRssKb\": " << peakRssKb() << ",\n     \"results\": [";
+        firstShape = false;
+
+        for(size_t i = 0; i < results.size(); ++i)
+        {
+            const Result& r = results[i];
+            char line[256];
+            std::snprintf(line, sizeof(line),
+                          "%s\n       {\"bench\": \"%s\", \"nsPerCp\": %.1f, \"nsPerCpMin\": %.1f, "
+                          "\"allocsPerRun\": %.0f, \"bytesPerRun\": %.0f}",
+                          i ? "," : "", r.bench.c_str(), r.nsPerCpMedian, r.nsPerCpMin,
+                          r.allocsPerRun, r.bytesPerRun);
+            std::cout << line;
+        }
+        std::cout << "]}";
+    }
+
+    std::cout << "\n  ],\n  \"peakRssKb\": " << peakRssKb() << "\n}\n";
+
+    if(withFiles)
+    {
+        std::error_code ec;
+        fs::remove_all(tmpDir, ec);
+    }
+
+    if(decodeMismatches > 0)
+    {
+        std::cerr << "bench: " << decodeMismatches << " DS values differ from DCMTK's getFloat64()\n";
+        return 1;
+    }
+    return 0;
+}
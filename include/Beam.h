@@ -1,15 +1,35 @@
 #pragma once
 
 #include <array>
+#include <cstddef>
 #include <optional>
 #include <string>
 #include <vector>
 #include <iostream>
+#include <memory>
+#include <memory_resource>
 
 #include <dcmtk/dcmdata/dctk.h>
 #include <dcmtk/dcmdata/dcdeftag.h>
 
+#include "Categorical.h"
 #include "ControlPoint.h"
+#include "StringInterner.h"
+
+// Caller-owned output columns for Beam::interpolate(). Each buffer holds
+// one value per query (mlc: 2 * leafPairs per query, bank A then B);
+// null buffers are skipped. Values missing from the plan come back as NaN.
+struct InterpolationBuffers
+{
+    double* gantryAngleDeg = nullptr;
+    double* collimatorAngleDeg = nullptr;
+    double* couchAngleDeg = nullptr;
+    double* jawX1 = nullptr;
+    double* jawX2 = nullptr;
+    double* jawY1 = nullptr;
+    double* jawY2 = nullptr;
+    double* mlc = nullptr;
+};
 
 struct Beam
 {
@@ -18,34 +38,74 @@ struct Beam
     std::optional<std::string> beamName;
 
     // Classification
-    std::optional<std::string> beamType;               // STATIC / DYNAMIC
-    std::optional<std::string> radiationType;          // PHOTON / ELECTRON
-    std::optional<std::string> treatmentDeliveryType;  // TREATMENT / SETUP
+    BeamType beamType = BeamType::Absent;                   // STATIC / DYNAMIC
+    RadiationType radiationType = RadiationType::Absent;    // PHOTON / ELECTRON
+    DeliveryType treatmentDeliveryType = DeliveryType::Absent;  // TREATMENT / SETUP
 
     // Machine / geometry meta
-    std::optional<std::string> treatmentMachineName;   // (300A,00B2)
-    std::optional<std::string> primaryDosimeterUnit;   // (300A,00B3) MU
+    InternedString treatmentMachineName;               // (300A,00B2)
+    InternedString primaryDosimeterUnit;               // (300A,00B3) MU
     std::optional<double> sourceAxisDistanceMm;        // (300A,00B4)
 
     // Control point metadata
     std::optional<double> finalCumulativeMetersetWeight; // (300A,010E)
     int numberOfControlPoints = 0;                       // (300A,0110)
 
-    int leafPairs = 60;                                  // pass in from machine model
-    std::vector<ControlPoint> controlPoints;
+    // MLCX from BeamLimitingDeviceSequence (300A,00B6); 60 pairs when absent
+    int leafPairs = 60;                                  // (300A,00BC)
+    std::pmr::vector<double> leafBoundariesMm;           // (300A,00BE) leafPairs + 1 edges, may be empty
 
     // Populated from FractionGroupSequence/ReferencedBeamSequence (later)
-    double beamMetersetMU;                // (300A,0086)
-    double beamDoseGy;                    // (300A,0084)
-    std::array<double,3> beamDoseSpecPointMm; // (300A,0082)
+    double beamMetersetMU = 0.0;          // (300A,0086)
+    double beamDoseGy = 0.0;              // (300A,0084)
+    std::array<double,3> beamDoseSpecPointMm{}; // (300A,0082)
 
+    // The vectors (leaf boundaries, every CP column) allocate from `mr`
     Beam() = default;
-    explicit Beam(DcmItem* beamItem);
+    explicit Beam(std::pmr::memory_resource* mr);
+    explicit Beam(DcmItem* beamItem, std::pmr::memory_resource* mr = std::pmr::get_default_resource());
+    // Lazy: the ControlPointSequence is decoded on the first controlPoints()
+    // call; `owner` keeps beamItem alive until then.
+    Beam(DcmItem* beamItem, std::shared_ptr<DcmItem> owner, std::pmr::memory_resource* mr);
+
+    // Decoding on first access mutates the beam: not thread-safe until
+    // controlPointsDecoded()
+    const ControlPointTable& controlPoints() const
+    {
+        if(pendingControlPoints) decodeControlPoints();
+        return table;
+    }
+    ControlPointTable& controlPoints()
+    {
+        if(pendingControlPoints) decodeControlPoints();
+        return table;
+    }
+    bool controlPointsDecoded() const { return !pendingControlPoints; }
 
     void print(std::ostream& os = std::cout) const;
 
+    // leafBoundariesMm, or when the plan has none the common 120-leaf
+    // layout (10 x 10 mm, 40 x 5 mm, 10 x 10 mm) for 60 pairs and 5 mm
+    // leaves centred on the axis otherwise
+    std::vector<double> leafBoundariesOrDefault() const;
+
+    // Machine state at `count` cumulative meterset weights, which must be
+    // sorted ascending. One forward merge over the CPs: linear between the
+    // enclosing CPs, clamped outside the beam; angles follow the CP's
+    // rotation direction across 0/360 (shortest way when NONE/absent).
+    // Where several CPs share a weight the last of them wins.
+    // Returns false, possibly after writing a prefix, if the queries are not
+    // sorted or the beam has no control points.
+    bool interpolate(const double* cmw, size_t count, const InterpolationBuffers& out) const;
+
     // TODO: store MU, Beam dose and dose spec point
     void storeFractionSequence(DcmItem* item); 
     
+private:
+    void decodeControlPoints() const;
+
+    mutable ControlPointTable table;
+    // aliases the owner of the sequence; null once decoded
+    mutable std::shared_ptr<DcmSequenceOfItems> pendingControlPoints;
 };
 
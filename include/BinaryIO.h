@@ -0,0 +1,152 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// Little helpers for the compact on-disk formats (plan cache, UID index).
+// Values are written in host byte order; the formats carry a magic number so
+// a file from a foreign-endian host is rejected rather than misread.
+
+class BinaryWriter
+{
+public:
+    std::string& buffer() { return buf; }
+
+    template<class T>
+    void pod(const T& v)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "pod() needs a trivially copyable type");
+        buf.append(reinterpret_cast<const char*>(&v), sizeof(T));
+    }
+
+    void str(std::string_view s)
+    {
+        pod(static_cast<uint32_t>(s.size()));
+        buf.append(s.data(), s.size());
+    }
+
+    template<class T>
+    void opt(const std::optional<T>& v)
+    {
+        pod(static_cast<uint8_t>(v.has_value()));
+        if(v) field(*v);
+    }
+
+    template<class T, class A>
+    void vec(const std::vector<T, A>& v)
+    {
+        pod(static_cast<uint64_t>(v.size()));
+        if constexpr(std::is_trivially_copyable<T>::value)
+            buf.append(reinterpret_cast<const char*>(v.data()), v.size() * sizeof(T));
+        else
+            for(const auto& e : v) field(e);
+    }
+
+    // picks str / opt / vec / pod by type, so one field list can drive
+    // both BinaryWriter and BinaryReader
+    void field(const std::string& s) { str(s); }
+    template<class T> void field(const std::optional<T>& v) { opt(v); }
+    template<class T, class A> void field(const std::vector<T, A>& v) { vec(v); }
+    template<class T> void field(const T& v) { pod(v); }
+
+private:
+    std::string buf;
+};
+
+// Bounds-checked reader over a byte range (typically an mmapped file).
+// Any overrun flips ok() to false and makes every later read a no-op.
+class BinaryReader
+{
+public:
+    BinaryReader(const unsigned char* data, size_t size) : p(data), end(data + size) {}
+
+    bool ok() const { return good; }
+    size_t remaining() const { return static_cast<size_t>(end - p); }
+
+    template<class T>
+    bool pod(T& v)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "pod() needs a trivially copyable type");
+        if(!take(sizeof(T))) return false;
+        std::memcpy(&v, p - sizeof(T), sizeof(T));
+        return true;
+    }
+
+    bool str(std::string& s)
+    {
+        std::string_view v;
+        if(!view(v)) return false;
+        s.assign(v.data(), v.size());
+        return true;
+    }
+
+    // zero-copy string: points into the underlying bytes
+    bool view(std::string_view& s)
+    {
+        uint32_t n = 0;
+        if(!pod(n) || !take(n)) return false;
+        s = std::string_view(reinterpret_cast<const char*>(p - n), n);
+        return true;
+    }
+
+    template<class T>
+    bool opt(std::optional<T>& v)
+    {
+        uint8_t has = 0;
+        if(!pod(has)) return false;
+        if(!has) { v.reset(); return true; }
+        T tmp{};
+        if(!field(tmp)) return false;
+        v = std::move(tmp);
+        return true;
+    }
+
+    // resize() keeps the vector's allocator, so pmr columns read into their arena
+    template<class T, class A>
+    bool vec(std::vector<T, A>& v)
+    {
+        uint64_t n = 0;
+        if(!pod(n)) return false;
+        if constexpr(std::is_trivially_copyable<T>::value)
+        {
+            if(n > remaining() / sizeof(T)) return fail();
+            v.resize(static_cast<size_t>(n));
+            if(n) std::memcpy(v.data(), p, v.size() * sizeof(T));
+            p += v.size() * sizeof(T);
+        }
+        else
+        {
+            if(n > remaining()) return fail();   // every element takes at least one byte
+            v.resize(static_cast<size_t>(n));
+            for(auto& e : v)
+                if(!field(e)) return false;
+        }
+        return true;
+    }
+
+    bool field(std::string& s) { return str(s); }
+    template<class T> bool field(std::optional<T>& v) { return opt(v); }
+    template<class T, class A> bool field(std::vector<T, A>& v) { return vec(v); }
+    template<class T> bool field(T& v) { return pod(v); }
+
+private:
+    bool fail() { good = false; p = end; return false; }
+
+    bool take(size_t n)
+    {
+        if(!good || n > remaining()) return fail();
+        p += n;
+        return true;
+    }
+
+    const unsigned char* p;
+    const unsigned char* end;
+    bool good = true;
+};
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+// Blocking multi-producer/multi-consumer FIFO with a fixed capacity.
+// Producers wait while it is full, consumers while it is empty; close()
+// wakes everyone and lets consumers drain what is left.
+template<class T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity ? capacity : 1) {}
+
+    // false if the queue was closed
+    bool push(T value)
+    {
+        std::unique_lock<std::mutex> lk(m);
+        notFull.wait(lk, [&]{ return closed || items.size() < capacity; });
+        if(closed) return false;
+
+        items.push_back(std::move(value));
+        lk.unlock();
+        notEmpty.notify_one();
+        return true;
+    }
+
+    // nullopt once closed and drained
+    std::optional<T> pop()
+    {
+        std::unique_lock<std::mutex> lk(m);
+        notEmpty.wait(lk, [&]{ return closed || !items.empty(); });
+        if(items.empty()) return std::nullopt;
+
+        T value = std::move(items.front());
+        items.pop_front();
+        lk.unlock();
+        notFull.notify_one();
+        return value;
+    }
+
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lk(m);
+            closed = true;
+        }
+        notFull.notify_all();
+        notEmpty.notify_all();
+    }
+
+private:
+    const size_t capacity;
+    std::mutex m;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+    std::deque<T> items;
+    bool closed = false;
+};
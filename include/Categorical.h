@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+
+// Enumerated RT code strings stored in one byte each.
+// Absent: the element was not in the item. Other: present, but not one of
+// the standard's values (the original text is not kept).
+
+enum class RotationDirection : uint8_t { Absent, None, CW, CC, Other };        // (300A,011F/0121/0123)
+enum class BeamType : uint8_t { Absent, Static, Dynamic, Other };               // (300A,00C4)
+enum class RadiationType : uint8_t { Absent, Photon, Electron, Neutron, Proton, Ion, Other };  // (300A,00C6)
+enum class DeliveryType : uint8_t { Absent, Treatment, OpenPortfilm, TrmtPortfilm,
+                                    Continuation, Setup, Other };              // (300A,00CE)
+
+RotationDirection parseRotationDirection(std::string_view s);
+BeamType parseBeamType(std::string_view s);
+RadiationType parseRadiationType(std::string_view s);
+DeliveryType parseDeliveryType(std::string_view s);
+
+// DICOM spelling ("CW", "STATIC", ...); "" for Absent, "OTHER" for Other
+const char* toString(RotationDirection v);
+const char* toString(BeamType v);
+const char* toString(RadiationType v);
+const char* toString(DeliveryType v);
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "Plan.h"
+
+// Control points of many plans as one column store: a directory with one
+// file per column and plans.tsv (planId, SOP Instance UID, PatientID,
+// source file). Each column file is a 64-byte ColumnHeader followed by
+// rows x width little-endian values, so a reader maps the file and uses
+// the data at offset 64 as a plain array; the row count is
+// (file size - 64) / (width * value size). One row per control point:
+//
+//   planId                     u32   index into plans.tsv
+//   beamNumber, cpIndex        i32
+//   cumulativeMetersetWeight   f64
+//   gantryAngleDeg, collimatorAngleDeg, couchAngleDeg,
+//   jawX1, jawX2, jawY1, jawY2 f64   NaN when absent (after fill-forward)
+//   mlcA, mlcB                 f64 x leafWidth, NaN-padded past the
+//                                    beam's leaf pairs; all NaN without MLC
+//
+// Opening an existing directory appends to it. Columns left at different
+// lengths by an interrupted run are cut back to the shortest one.
+// Single writer; readers see whole rows once every column is written.
+
+enum class ColumnType : uint32_t { U32 = 1, I32 = 2, F64 = 3 };
+
+struct ColumnHeader
+{
+    char magic[8];          // "DRCOLS\0\0"
+    uint32_t version;
+    uint32_t type;          // ColumnType
+    uint32_t width;         // values per row
+    uint32_t reserved;
+    char name[40];          // column name, NUL-padded
+};
+static_assert(sizeof(ColumnHeader) == 64, "ColumnHeader is part of the file format");
+
+class ColumnWriter
+{
+public:
+    static constexpr uint32_t kFormatVersion = 1;
+    static constexpr int kDefaultLeafWidth = 80;
+
+    ColumnWriter() = default;
+    ~ColumnWriter();
+
+    ColumnWriter(const ColumnWriter&) = delete;
+    ColumnWriter& operator=(const ColumnWriter&) = delete;
+
+    // Creates `dir` with MLC rows of leafWidth pairs, or appends to it.
+    // leafWidth 0 takes the width of an existing store (kDefaultLeafWidth
+    // for a new one); any other value must match it. False with error() set.
+    bool open(const std::filesystem::path& dir, int leafWidth = 0);
+
+    // One block write per column and beam, straight from the beam's
+    // ControlPointTable. Beams with more leaf pairs than the store are
+    // skipped and counted. False once a write has failed.
+    bool append(const Plan& plan);
+
+    const std::string& error() const { return err; }
+    uint64_t rows() const { return rowCount; }
+    uint64_t bytes() const { return byteCount; }
+    size_t skippedBeams() const { return skipped; }
+
+private:
+    struct Column
+    {
+        int fd = -1;
+        uint32_t width = 1;
+        size_t valueSize = 0;
+    };
+
+    bool write(Column& c, const void* data, size_t rows);
+    void close();
+
+    std::vector<Column> columns;
+    int plansFd = -1;
+    int leafWidth = 0;
+    uint32_t nextPlanId = 0;
+
+    std::vector<double> scratch;
+    std::vector<int32_t> scratchInt;
+    std::vector<uint32_t> scratchId;
+
+    uint64_t rowCount = 0;      // appended by this writer
+    uint64_t byteCount = 0;
+    size_t skipped = 0;
+    std::string err;
+};
@@ -1,49 +1,204 @@
 #pragma once
 
 #include <array>
+#include <cstddef>
+#include <cstdint>
 #include <optional>
 #include <string>
 #include <vector>
 #include <iostream>
 #include <iomanip>
+#include <memory_resource>
 
 #include <dcmtk/dcmdata/dctk.h>
 
-struct ControlPoint
+#include "Categorical.h"
+
+// Non-owning run of leaf positions (one bank of one control point).
+struct LeafSpan
 {
+    const double* ptr = nullptr;
+    size_t count = 0;
+
+    const double* data() const { return ptr; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    double operator[](size_t i) const { return ptr[i]; }
+    const double* begin() const { return ptr; }
+    const double* end() const { return ptr + count; }
+};
+
+struct ControlPoint;
+
+// Columnar storage for the control points of one beam.
+// Every column has one entry per control point. Leaf positions live in a
+// contiguous pool of distinct apertures (2 * leafPairs values per row, bank A
+// followed by bank B); each CP refers to its pool row through mlcRef, so CPs
+// that inherit or repeat the previous aperture share it instead of copying.
+// Every column allocates from one memory_resource (the default heap unless
+// one is given), so a whole beam can live in an arena.
+struct ControlPointTable
+{
+    // Per-row presence bits. After Beam's fill-forward they mean "resolved",
+    // i.e. either present in the item or inherited from an earlier CP.
+    enum Flag : uint16_t
+    {
+        HasGantry       = 1 << 0,
+        HasCollimator   = 1 << 1,
+        HasCouch        = 1 << 2,
+        HasIsocenter    = 1 << 3,
+        HasSsd          = 1 << 4,
+        HasJawX         = 1 << 5,
+        HasJawY         = 1 << 6,
+        HasMLC          = 1 << 7,
+    };
+
+    int leafPairs = 0;                                  // Typically 60
+
+    std::pmr::vector<uint16_t> flags;
+
     // Identity/Weighting
-    int cpIndex = -1;
-    double cumulativeMetersetWeight = 0.0;
+    std::pmr::vector<int> cpIndex;
+    std::pmr::vector<double> cumulativeMetersetWeight;
 
     // Geometry
-    double gantryAngleDeg;
-    std::optional<std::string> gantryRotationDirection;         // NONE/CW/CC
+    std::pmr::vector<double> gantryAngleDeg;
+    std::pmr::vector<double> collimatorAngleDeg;        // BeamLimitingDeviceAngle
+    std::pmr::vector<double> couchAngleDeg;
+    std::pmr::vector<RotationDirection> gantryRotationDirection;     // NONE/CW/CC
+    std::pmr::vector<RotationDirection> collimatorRotationDirection;
+    std::pmr::vector<RotationDirection> couchRotationDirection;
 
-    double collimatorAngleDeg;                   // BeamLimitingDeviceAngle
-    std::optional<std::string> collimatorRotationDirection;     // Maybe not needed
+    std::pmr::vector<std::array<double,3>> isocenterMm;
+    std::pmr::vector<double> ssdMm;
 
-    double couchAngleDeg;
-    std::optional<std::string> couchRotationDirection;          // Maybe not needed
+    // optional metadata
+    std::pmr::vector<double> nominalEnergyMV;
+    std::pmr::vector<double> doseRate;
 
-    std::optional<std::array<double,3>> isocenterMm;
-    std::optional<double> ssdMm;
+    // Aperture state
+    std::pmr::vector<double> jawX1, jawX2;              // ASYMX
+    std::pmr::vector<double> jawY1, jawY2;              // ASYMY
+    std::pmr::vector<uint32_t> mlcRef;                  // per CP: pool row, kNoAperture if none
+    std::pmr::vector<double> leafPositions;             // pool rows x (A[leafPairs] | B[leafPairs])
 
-    //optional metadata
-    double nominalEnergyMV;
-    double doseRate;
+    static constexpr uint32_t kNoAperture = 0xFFFFFFFFu;
 
-    // Aperture state
-    std::optional<std::array<double,2>> jawX;                   // ASYMX [x1, x2]
-    std::optional<std::array<double,2>> jawY;                   // ASYMY[y1, y2]
+    ControlPointTable() = default;
+    explicit ControlPointTable(int leafPairs,
+                               std::pmr::memory_resource* mr = std::pmr::get_default_resource());
+
+    std::pmr::memory_resource* resource() const { return flags.get_allocator().resource(); }
+
+    size_t size() const { return cpIndex.size(); }
+    bool empty() const { return cpIndex.empty(); }
+
+    void reserve(size_t rows);
+    void clear();
+
+    // Parses one ControlPointSequence item into a new row. MLCX positions
+    // are kept only with exactly 2 * leafPairs values.
+    void append(DcmItem* cpItem);
+
+    // Copies what `row` lacks (jaws, MLC, isocenter, SSD, angles) from
+    // row - 1. Applied in order over a beam this is Beam's fill-forward.
+    void fillForward(size_t row);
+
+    // Drops every row but the last and every aperture it does not use:
+    // a one-row window for streaming.
+    void keepLast();
 
-    int leafPairs = 0;                                          // Typically 60
-    std::vector<double> mlcA;
-    std::vector<double> mlcB;
+    bool has(size_t row, Flag f) const { return (flags[row] & f) != 0; }
 
-    ControlPoint(DcmItem* cpItem);
+    // number of distinct apertures actually stored
+    size_t apertureCount() const { return leafPairs > 0 ? leafPositions.size() / (2 * static_cast<size_t>(leafPairs)) : 0; }
+    const double* aperture(size_t k) const { return leafPositions.data() + k * 2 * static_cast<size_t>(leafPairs); }
 
-    bool hasMLC() const { return leafPairs > 0 && (int)mlcA.size()==leafPairs && (int)mlcB.size()==leafPairs; }
+    // leaf positions of CP `row`; only valid when has(row, HasMLC)
+    const double* mlcRow(size_t row) const { return aperture(mlcRef[row]); }
+
+    ControlPoint operator[](size_t row) const;
+    ControlPoint front() const;
+    ControlPoint back() const;
+
+    struct const_iterator;
+    const_iterator begin() const;
+    const_iterator end() const;
+};
+
+// Lightweight view over one row of a ControlPointTable.
+// Valid as long as the table is alive and not appended to.
+struct ControlPoint
+{
+    const ControlPointTable* table = nullptr;
+    size_t row = 0;
+
+    int cpIndex() const { return table->cpIndex[row]; }
+    double cumulativeMetersetWeight() const { return table->cumulativeMetersetWeight[row]; }
+
+    double gantryAngleDeg() const { return table->gantryAngleDeg[row]; }
+    RotationDirection gantryRotationDirection() const { return table->gantryRotationDirection[row]; }
+    double collimatorAngleDeg() const { return table->collimatorAngleDeg[row]; }
+    RotationDirection collimatorRotationDirection() const { return table->collimatorRotationDirection[row]; }
+    double couchAngleDeg() const { return table->couchAngleDeg[row]; }
+    RotationDirection couchRotationDirection() const { return table->couchRotationDirection[row]; }
+
+    std::optional<std::array<double,3>> isocenterMm() const
+    {
+        if(!table->has(row, ControlPointTable::HasIsocenter)) return std::nullopt;
+        return table->isocenterMm[row];
+    }
+    std::optional<double> ssdMm() const
+    {
+        if(!table->has(row, ControlPointTable::HasSsd)) return std::nullopt;
+        return table->ssdMm[row];
+    }
+
+    double nominalEnergyMV() const { return table->nominalEnergyMV[row]; }
+    double doseRate() const { return table->doseRate[row]; }
+
+    std::optional<std::array<double,2>> jawX() const
+    {
+        if(!table->has(row, ControlPointTable::HasJawX)) return std::nullopt;
+        return std::array<double,2>{ table->jawX1[row], table->jawX2[row] };
+    }
+    std::optional<std::array<double,2>> jawY() const
+    {
+        if(!table->has(row, ControlPointTable::HasJawY)) return std::nullopt;
+        return std::array<double,2>{ table->jawY1[row], table->jawY2[row] };
+    }
+
+    int leafPairs() const { return table->leafPairs; }
+    bool hasMLC() const { return leafPairs() > 0 && table->has(row, ControlPointTable::HasMLC); }
+
+    // empty when the CP carries no MLC positions
+    LeafSpan mlcA() const
+    {
+        if(!hasMLC()) return {};
+        return { table->mlcRow(row), static_cast<size_t>(leafPairs()) };
+    }
+    LeafSpan mlcB() const
+    {
+        if(!hasMLC()) return {};
+        return { table->mlcRow(row) + leafPairs(), static_cast<size_t>(leafPairs()) };
+    }
 
     void print(std::ostream& os = std::cout) const;
 };
 
+struct ControlPointTable::const_iterator
+{
+    const ControlPointTable* table = nullptr;
+    size_t row = 0;
+
+    ControlPoint operator*() const { return { table, row }; }
+    const_iterator& operator++() { ++row; return *this; }
+    bool operator==(const const_iterator& o) const { return row == o.row && table == o.table; }
+    bool operator!=(const const_iterator& o) const { return !(*this == o); }
+};
+
+inline ControlPoint ControlPointTable::operator[](size_t row) const { return { this, row }; }
+inline ControlPoint ControlPointTable::front() const { return { this, 0 }; }
+inline ControlPoint ControlPointTable::back() const { return { this, size() - 1 }; }
+inline ControlPointTable::const_iterator ControlPointTable::begin() const { return { this, 0 }; }
+inline ControlPointTable::const_iterator ControlPointTable::end() const { return { this, size() }; }
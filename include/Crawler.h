@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "BoundedQueue.h"
+
+enum class SymlinkPolicy
+{
+    None,   // skip every symlink
+    Files,  // follow links to regular files, not to directories (default)
+    All,    // follow links to directories too (cycles are detected)
+};
+
+struct CrawlOptions
+{
+    int maxDepth = -1;                      // -1: unlimited, 0: only the top directory
+    SymlinkPolicy symlinks = SymlinkPolicy::Files;
+    std::vector<std::string> include;       // fnmatch globs on the file name; empty = all
+    std::vector<std::string> exclude;       // fnmatch globs on file and directory names
+    // Final filter, optional. Called with the files of one directory that
+    // passed the globs (in batches of at most kAcceptBatch) and sets
+    // keep[i]; batching lets content sniffing overlap the reads.
+    std::function<void(const std::vector<std::filesystem::path>& files, std::vector<bool>& keep)> accept;
+
+    static constexpr size_t kAcceptBatch = 64;
+};
+
+// Glob filters of CrawlOptions, shared with the Watcher
+bool crawlExcluded(const CrawlOptions& opts, const std::string& name);
+bool crawlWanted(const CrawlOptions& opts, const std::filesystem::path& file);
+
+struct CrawlStats
+{
+    size_t directories = 0;
+    size_t filesSeen = 0;
+    size_t filesQueued = 0;
+    double seconds = 0.0;
+};
+
+// Recursive directory walk on a background thread. Matching files are
+// pushed into `out` as they are found, so parsing can start immediately;
+// `out` is closed when the walk ends. A file given as root is queued as is
+// (subject to the filters).
+class Crawler
+{
+public:
+    Crawler(std::filesystem::path root, CrawlOptions opts, BoundedQueue<std::filesystem::path>& out);
+    ~Crawler();
+
+    Crawler(const Crawler&) = delete;
+    Crawler& operator=(const Crawler&) = delete;
+
+    void join();
+
+    // valid after join()
+    const CrawlStats& stats() const { return result; }
+
+private:
+    void run();
+    bool flush(std::vector<std::filesystem::path>& batch);
+
+    std::filesystem::path root;
+    CrawlOptions opts;
+    BoundedQueue<std::filesystem::path>& out;
+    CrawlStats result;
+    std::thread worker;
+};
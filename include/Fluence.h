@@ -0,0 +1,39 @@
+#pragma once
+
+#include <filesystem>
+#include <vector>
+
+#include "Beam.h"
+
+class ThreadPool;
+
+struct FluenceOptions
+{
+    double pixelMm = 1.0;
+    double fieldSizeMm = 400.0;         // square grid centred on the beam axis
+};
+
+// Planned fluence of one beam in the isocentre plane (IEC beam limiting
+// device coordinates: x along leaf travel, y across the leaves).
+struct FluenceMap
+{
+    int width = 0;
+    int height = 0;
+    double pixelMm = 1.0;
+    double originXmm = 0.0;             // outer corner of pixel (0, 0)
+    double originYmm = 0.0;
+    bool relative = false;              // meterset weight fractions: the beam MU was unknown
+    std::vector<float> values;          // row-major, row 0 at the most negative y
+
+    float at(int x, int y) const { return values[static_cast<size_t>(y) * width + x]; }
+};
+
+// Every CP aperture (MLC clipped by the jaws) is rasterized with
+// fractional edge coverage and weighted by half the meterset of each
+// adjacent CP interval, scaled to beamMetersetMU. With a pool, bands of
+// rows are rasterized in parallel.
+FluenceMap computeFluence(const Beam& beam, const FluenceOptions& opts = {}, ThreadPool* pool = nullptr);
+
+// Writes `<base>.raw` (float32, row-major, host byte order) and a MetaImage
+// header `<base>.mhd` that ITK, 3D Slicer and ImageJ open directly.
+bool writeFluence(const FluenceMap& map, const std::filesystem::path& base);
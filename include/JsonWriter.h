@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+// Streaming JSON writer over one preallocated buffer, written out to a
+// file descriptor in large blocks. Numbers go through std::to_chars
+// (shortest text that round-trips; NaN and infinities become null) and
+// commas are inserted automatically. No nesting check: callers write
+// well-formed documents. Strings are escaped; their bytes are otherwise
+// copied as they are, so non-UTF-8 DICOM text stays non-UTF-8.
+class JsonWriter
+{
+public:
+    static constexpr size_t kDefaultCapacity = size_t(1) << 20;
+
+    // writes to stdout until open() is called
+    explicit JsonWriter(size_t capacity = kDefaultCapacity);
+    ~JsonWriter();
+
+    JsonWriter(const JsonWriter&) = delete;
+    JsonWriter& operator=(const JsonWriter&) = delete;
+
+    // Truncates or creates `path`; false with error() set on failure
+    bool open(const std::string& path);
+
+    void beginObject() { separate(); put('{'); comma = false; }
+    void endObject() { put('}'); comma = true; }
+    void beginArray() { separate(); put('['); comma = false; }
+    void endArray() { put(']'); comma = true; }
+
+    void key(std::string_view k);
+
+    void value(std::string_view s);
+    void value(const char* s) { value(std::string_view(s)); }
+    void value(const std::string& s) { value(std::string_view(s)); }
+    void value(double v);
+    void value(int v) { integer(v); }
+    void value(int64_t v) { integer(v); }
+    void value(uint64_t v);
+    void value(bool v) { separate(); append(v ? "true" : "false"); comma = true; }
+    void null() { separate(); append("null"); comma = true; }
+
+    template<class T>
+    void value(const std::optional<T>& v)
+    {
+        if(v) value(*v); else null();
+    }
+
+    template<class T>
+    void field(std::string_view k, const T& v)
+    {
+        key(k);
+        value(v);
+    }
+
+    // ends one NDJSON record
+    void newline() { put('\n'); comma = false; }
+
+    // Writes the buffer out; false once any write has failed
+    bool flush();
+
+    bool ok() const { return err.empty(); }
+    const std::string& error() const { return err; }
+
+    // flushed plus buffered
+    uint64_t bytes() const { return flushed + len; }
+
+private:
+    void separate() { if(comma) put(','); }
+    void integer(int64_t v);
+
+    void put(char c)
+    {
+        if(len == cap) flush();
+        buf[len++] = c;
+    }
+    void append(std::string_view s);
+    // room for n more bytes, n <= capacity
+    char* reserve(size_t n)
+    {
+        if(cap - len < n) flush();
+        return buf.get() + len;
+    }
+
+    std::unique_ptr<char[]> buf;
+    size_t cap;
+    size_t len = 0;
+    uint64_t flushed = 0;
+    bool comma = false;
+
+    int fd = 1;
+    bool ownsFd = false;
+    std::string err;
+};
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "Plan.h"
+
+class ThreadPool;
+
+struct MetricsOptions
+{
+    double smallApertureMm = 10.0;      // leaf gaps below this count as small
+};
+
+// Modulation complexity of one beam. Per-CP quantities are averaged over
+// the delivery, weighted by the meterset delivered between consecutive CPs
+// (the mean of the two end apertures is used for each interval), so
+// step-and-shoot segments and VMAT arcs are treated the same way.
+struct BeamMetrics
+{
+    int beamNumber = -1;
+    std::optional<std::string> beamName;
+    size_t controlPoints = 0;
+    double beamMetersetMU = 0.0;
+
+    double areaMm2 = 0.0;               // MU-weighted aperture area inside the jaws
+    double perimeterMm = 0.0;           // MU-weighted aperture outline
+    double lsv = 0.0;                   // leaf sequence variability (McNiven 2010)
+    double aav = 0.0;                   // aperture area variability
+    double mcs = 0.0;                   // modulation complexity score, sum of LSV * AAV * weight
+    double leafTravelMm = 0.0;          // summed |displacement| of every leaf over all CPs
+    double smallApertureFraction = 0.0; // MU-weighted share of open pairs narrower than smallApertureMm
+};
+
+struct PlanMetrics
+{
+    std::string filePath;
+    std::string sopInstanceUid;
+    std::string rtPlanLabel;
+    std::vector<BeamMetrics> beams;
+
+    size_t controlPoints = 0;
+    double mcs = 0.0;                   // beams weighted by beamMetersetMU (equal weights if unknown)
+
+    void print(std::ostream& os = std::cout) const;
+};
+
+BeamMetrics computeBeamMetrics(const Beam& beam, const MetricsOptions& opts = {});
+PlanMetrics computePlanMetrics(const Plan& plan, const MetricsOptions& opts = {});
+
+// Metrics for many plans; with a pool every beam of every plan is its own task.
+std::vector<PlanMetrics> computeMetrics(const std::vector<const Plan*>& plans,
+                                        ThreadPool* pool,
+                                        const MetricsOptions& opts = {});
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+class ThreadPool;
+
+// The header tags batch mode checks, read from one file
+struct PatientRecord
+{
+    std::string patientId;
+    std::string patientName;
+    std::string studyInstanceUid;
+    std::string frameOfReferenceUid;
+    std::string sopClassUid;
+    std::string modality;
+};
+
+// mmap tag scan, or DCMTK up to (0020,0052) when the scanner cannot walk
+// the file. Only header tags are read. False with `error` set if the file
+// cannot be read.
+bool readPatientRecord(const std::filesystem::path& path, PatientRecord& r, std::string& error);
+
+// Groups the files of an archive by PatientID as they are read. Each file
+// is folded into its patient's running totals and dropped, so memory grows
+// with patients and distinct UIDs, not files. Patients are spread over
+// shards by a hash of the ID, each with its own lock, so concurrent add()
+// calls rarely wait on each other, and the checks run shard by shard.
+class PatientBatch
+{
+public:
+    struct Summary
+    {
+        std::string patientId;
+        std::string patientName;            // the most frequent spelling
+        size_t files = 0;
+        size_t plans = 0;
+        size_t studies = 0;
+        size_t framesOfReference = 0;
+        std::vector<std::string> issues;    // empty: consistent
+    };
+
+    explicit PatientBatch(size_t shards = 64);
+
+    // Thread-safe. Files without a PatientID are only counted.
+    void add(const PatientRecord& r);
+    // Thread-safe. Keeps the first few paths for the report.
+    void addFailure(const std::filesystem::path& path, const std::string& error);
+
+    // Per patient, in PatientID order:
+    //  - more than one PatientName for the ID (trailing empty PN
+    //    components ignored), or files without one among named files
+    //  - a Study or Frame of Reference UID also used by another PatientID
+    //  - an RT object whose Frame of Reference matches none of the
+    //    patient's images (only checked when the patient has images)
+    // With a pool the shards are checked concurrently. Call after the
+    // last add().
+    std::vector<Summary> summarize(ThreadPool* pool) const;
+
+    size_t filesWithoutPatientId() const;
+    size_t failures() const;
+    // at most kKeptFailures "path: error" lines
+    std::vector<std::string> failureSamples() const;
+
+    static constexpr size_t kKeptFailures = 20;
+
+private:
+    struct Patient
+    {
+        std::map<std::string, size_t> names;            // spelling -> files
+        size_t unnamed = 0;                             // files without a PatientName
+        size_t files = 0;
+        size_t plans = 0;
+        std::unordered_set<std::string> studies;
+        std::unordered_map<std::string, unsigned> frames;   // FoR -> kImage | kRtObject
+    };
+
+    struct Shard
+    {
+        mutable std::mutex mutex;
+        std::unordered_map<std::string, Patient> patients;
+    };
+
+    static constexpr unsigned kImage = 1;
+    static constexpr unsigned kRtObject = 2;
+
+    static void check(const std::string& id, const Patient& p, Summary& out);
+
+    std::vector<std::unique_ptr<Shard>> shards;
+
+    mutable std::mutex failureMutex;
+    size_t withoutId = 0;
+    size_t failed = 0;
+    std::vector<std::string> failureList;
+};
@@ -4,15 +4,39 @@
 #include <optional>
 #include <vector>
 #include <array>
+#include <functional>
+#include <memory>
+#include <memory_resource>
 
 #include <dcmtk/dcmdata/dctk.h>
 
 #include "Beam.h"
 
+// Called once per control point, in beam order; return false to stop.
+// `cp` is only valid during the call.
+using ControlPointVisitor = std::function<bool(const Beam& beam, const ControlPoint& cp)>;
+
 struct Plan
 {
+    // Beams and their CP columns allocate from `mr`, e.g. a per-file
+    // monotonic arena; such a plan must not outlive the resource. Copies
+    // allocate from the default resource. Strings stay on the heap (a
+    // handful per plan, mostly within the small-string buffer).
     Plan() = default;
-    explicit Plan(DcmDataset* ds);
+    explicit Plan(std::pmr::memory_resource* mr);
+    explicit Plan(DcmDataset* ds, std::pmr::memory_resource* mr = std::pmr::get_default_resource());
+
+    // Lazy load for listing and triage. The mmap scanner finds the
+    // BeamSequence and DCMTK decodes everything but it; the plan keeps the
+    // path and the sequence's byte range (not the mapping), maps the file
+    // again to decode the beam summaries on the first beams() call, and
+    // decodes each beam's control points on its first controlPoints() call.
+    // totalPlannedMetersetMU matches a full load. A BeamSequence DCMTK
+    // cannot decode, or a file rewritten since (size or mtime changed),
+    // leaves beams() empty. Files the scanner cannot walk are loaded in
+    // full. nullopt with `error` set when the file cannot be read.
+    static std::optional<Plan> openLazy(const std::string& path, std::string& error,
+                                        std::pmr::memory_resource* mr = std::pmr::get_default_resource());
 
     // Provenance
     std::string filePath;
@@ -51,13 +75,43 @@ struct Plan
     // Convenience / sanity
     std::optional<std::array<double,3>> primaryIsocenterMm;
 
-    // Delivery content
-    std::vector<Beam> beams;
+    // Delivery content. Decoding on first access mutates the plan: not
+    // thread-safe until beamsDecoded()
+    const std::pmr::vector<Beam>& beams() const
+    {
+        if(pendingBeams) decodeBeams();
+        return beamList;
+    }
+    std::pmr::vector<Beam>& beams()
+    {
+        if(pendingBeams) decodeBeams();
+        return beamList;
+    }
+    bool beamsDecoded() const { return !pendingBeams; }
+    // without decoding anything
+    size_t beamCount() const;
 
     // Convenience totals
     std::optional<double> totalPlannedMetersetMU; // sum of beamMetersetMU
     
     void print(std::ostream& os = std::cout) const;
 
+    // Every control point, fill-forward applied as in Beam. A lazy plan
+    // whose beams are not decoded yet streams them from the mapped file:
+    // each beam header and then each CP is decoded on its own into reused
+    // buffers, so memory stays at one beam header plus one CP whatever
+    // the plan size, and `beam` comes with an empty controlPoints().
+    // False if part of the BeamSequence cannot be decoded.
+    bool forEachControlPoint(const ControlPointVisitor& visit) const;
+
+private:
+    struct PendingBeams;
+
+    void decodeBeams() const;
+
+    mutable std::pmr::vector<Beam> beamList;
+    mutable std::shared_ptr<const PendingBeams> pendingBeams;
 };
 
+// Plan::openLazy(path) followed by Plan::forEachControlPoint(visit)
+bool forEachControlPoint(const std::string& path, const ControlPointVisitor& visit, std::string& error);
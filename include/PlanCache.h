@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <filesystem>
+#include <iostream>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "Plan.h"
+
+// Persistent cache of parsed plans.
+// One entry file per source path, holding a versioned binary image of the
+// Plan together with the source's size, mtime and SOP Instance UID. An
+// entry is only used when all three still match the source, the UID as read
+// by the caller's header triage. A hit is an mmap plus bulk copies of the
+// control point columns; DCMTK is not used.
+// Safe to use from several threads at once.
+class PlanCache
+{
+public:
+    struct Counters
+    {
+        std::atomic<size_t> hits{0};
+        std::atomic<size_t> misses{0};     // includes stale entries
+        std::atomic<size_t> stale{0};      // entry found but source changed / wrong version
+        std::atomic<size_t> writes{0};
+        std::atomic<size_t> writeErrors{0};
+    };
+
+    // invalidate: ignore every existing entry and rewrite it on store()
+    explicit PlanCache(std::filesystem::path dir, bool invalidate = false);
+
+    // `sopInstanceUid` is the source's current SOP Instance UID; an entry
+    // stored under another one is stale. The plan's beams and CP columns
+    // are allocated from `mr`.
+    std::optional<Plan> load(const std::filesystem::path& source, std::string_view sopInstanceUid,
+                             std::pmr::memory_resource* mr = std::pmr::get_default_resource());
+    void store(const std::filesystem::path& source, const Plan& plan);
+
+    const Counters& counters() const { return stats; }
+    void printCounters(std::ostream& os) const;
+
+    static constexpr uint32_t kFormatVersion = 3;
+
+private:
+    std::filesystem::path entryPath(const std::string& key) const;
+
+    std::filesystem::path dir;
+    bool invalidate = false;
+    Counters stats;
+};
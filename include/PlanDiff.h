@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Plan.h"
+
+struct DiffTolerances
+{
+    double angleDeg = 0.01;             // gantry/collimator/couch, compared around the circle
+    double positionMm = 0.01;           // jaws, isocentre, SSD, SAD, dose spec point
+    double leafMm = 0.01;
+    double weight = 1e-6;               // cumulative meterset weights
+    double meterset = 1e-3;             // MU, Gy, energy, dose rate
+
+    // SOP/Series/Study UIDs and plan date/time change on every re-export;
+    // they are only compared when this is set
+    bool compareIdentity = false;
+};
+
+enum class DiffMode
+{
+    Full,               // every differing field (CP columns summarized per beam)
+    FirstDifference,    // stop at the first difference: a yes/no answer
+};
+
+struct Difference
+{
+    int beamNumber = -1;                // -1: plan level
+    int controlPoint = -1;              // -1: beam level; else the first differing CP
+    size_t count = 1;                   // control points differing in this field
+    std::string field;
+    std::string a, b;
+};
+
+struct PlanDiff
+{
+    std::vector<Difference> differences;
+
+    bool identical() const { return differences.empty(); }
+    void print(std::ostream& os = std::cout) const;
+};
+
+// Beams are matched by beamNumber. Control point columns are compared only
+// when both beams have the same number of CPs.
+PlanDiff diffPlans(const Plan& a, const Plan& b,
+                   const DiffTolerances& tol = {},
+                   DiffMode mode = DiffMode::Full);
+
+inline bool plansEqual(const Plan& a, const Plan& b, const DiffTolerances& tol = {})
+{
+    return diffPlans(a, b, tol, DiffMode::FirstDifference).identical();
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+
+#include "JsonWriter.h"
+#include "Plan.h"
+
+struct ExportOptions
+{
+    bool controlPoints = false;     // one record per control point after the plan record
+};
+
+// NDJSON export. One {"record":"plan",...} line per plan with its beam
+// summaries nested, then with opts.controlPoints one {"record":"cp",...}
+// line per control point (fill-forward applied) keyed by the plan's
+// SOP Instance UID and the beam number. Absent values are null.
+// Returns the number of records written.
+size_t writePlanNdjson(const Plan& plan, JsonWriter& out, const ExportOptions& opts = {});
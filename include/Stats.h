@@ -0,0 +1,108 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+
+// Per-phase timers and counters for --stats.
+// Each thread records into its own histograms and counters; nothing is
+// shared until report(). When the build defines DICOM_READER_STATS the
+// cost of a disabled Scope or add() is one branch on a flag set at
+// startup; without it both are empty inline functions and compile away.
+// Phases nest (Plan includes its Beams), so times do not add up.
+namespace stats
+{
+
+enum class Phase : unsigned
+{
+    File,           // one input file, end to end
+    Scan,           // mmap tag scan (triage)
+    LoadFile,       // DCMTK loadFile / loadFileUntilTag
+    PatientInfo,    // extractPatientInfo
+    Plan,           // Plan::Plan / Plan::openLazy
+    Beam,           // Beam summary, and its CPs when decoded eagerly
+    ControlPoints,  // one beam's ControlPointSequence
+    CacheLoad,
+    CacheStore,
+    Report,         // listing, exports, metrics, fluence
+    Count
+};
+
+enum class Counter : unsigned
+{
+    Files,
+    Bytes,          // size of the input files
+    Plans,
+    Beams,
+    ControlPoints,
+    Count
+};
+
+enum class Format { Text, Json };
+
+#ifdef DICOM_READER_STATS
+
+namespace detail
+{
+extern bool enabled;
+void record(Phase phase, uint64_t ns);
+void add(Counter counter, uint64_t n);
+}
+
+constexpr bool kCompiled = true;
+
+// set before any worker thread starts
+void enable();
+inline bool enabled() { return detail::enabled; }
+
+inline void add(Counter counter, uint64_t n = 1)
+{
+    if(detail::enabled) detail::add(counter, n);
+}
+
+class Scope
+{
+public:
+    explicit Scope(Phase phase) : phase(phase)
+    {
+        if(detail::enabled) start = std::chrono::steady_clock::now();
+    }
+    ~Scope()
+    {
+        if(start != std::chrono::steady_clock::time_point())
+            detail::record(phase, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                      std::chrono::steady_clock::now() - start).count()));
+    }
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+private:
+    Phase phase;
+    std::chrono::steady_clock::time_point start{};
+};
+
+// Aggregates every thread's data; call once the workers are joined.
+// Percentiles come from log-linear histograms (16 steps per power of two,
+// within about 6%).
+void report(std::ostream& os, Format format, double wallSeconds);
+
+#else
+
+constexpr bool kCompiled = false;
+
+inline void enable() {}
+constexpr bool enabled() { return false; }
+inline void add(Counter, uint64_t = 1) {}
+
+class Scope
+{
+public:
+    explicit Scope(Phase) {}
+};
+
+inline void report(std::ostream&, Format, double) {}
+
+#endif
+
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Process-wide pool for strings that repeat across plans (machine names,
+// dosimeter units). Thread-safe; strings are never freed, so only intern
+// values from small vocabularies.
+class StringInterner
+{
+public:
+    static StringInterner& global();
+
+    // the same pointer for equal strings, for the life of the process
+    const std::string* intern(std::string_view s);
+    size_t size() const;
+
+private:
+    mutable std::shared_mutex mutex;
+    std::deque<std::string> strings;        // deque: entries never move
+    std::unordered_map<std::string_view, const std::string*> index;
+};
+
+// Pointer-sized handle to an interned string, null when the value is
+// absent. Reads like std::optional<std::string>; == and hashing compare
+// the pointer only.
+class InternedString
+{
+public:
+    InternedString() = default;
+    explicit InternedString(std::string_view s) : p(StringInterner::global().intern(s)) {}
+    explicit InternedString(const std::string& s) : InternedString(std::string_view(s)) {}
+    explicit InternedString(const char* s) : InternedString(std::string_view(s)) {}
+    explicit InternedString(const std::optional<std::string>& s)
+        : p(s ? StringInterner::global().intern(*s) : nullptr) {}
+
+    bool has_value() const { return p != nullptr; }
+    explicit operator bool() const { return p != nullptr; }
+    const std::string& operator*() const { return *p; }
+    const std::string* operator->() const { return p; }
+
+    // stable for the process lifetime, usable as a group-by key
+    uintptr_t id() const { return reinterpret_cast<uintptr_t>(p); }
+
+    bool operator==(const InternedString& o) const { return p == o.p; }
+    bool operator!=(const InternedString& o) const { return p != o.p; }
+
+private:
+    const std::string* p = nullptr;
+};
+
+namespace std
+{
+template<>
+struct hash<InternedString>
+{
+    size_t operator()(const InternedString& s) const noexcept { return hash<uintptr_t>()(s.id()); }
+};
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed-size work-stealing pool.
+// Every worker owns a deque: it pops its own tasks LIFO (cache-warm) and,
+// when empty, steals FIFO from the other workers. Tasks submitted from a
+// worker go to that worker's deque; external submissions are spread round-robin.
+class ThreadPool
+{
+public:
+    using Task = std::function<void()>;
+
+    // threads == 0 -> std::thread::hardware_concurrency()
+    explicit ThreadPool(unsigned threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // When called from outside the pool, blocks while `maxQueued` tasks are
+    // already waiting (0 = unbounded, the default). Keeps a fast producer
+    // from queueing an entire archive ahead of the workers.
+    void submit(Task task);
+    void setMaxQueued(size_t n);
+
+    // Blocks until every submitted task has finished.
+    // Rethrows the first exception thrown by a task, if any.
+    void wait();
+
+    unsigned size() const { return static_cast<unsigned>(workers.size()); }
+
+private:
+    struct WorkQueue
+    {
+        std::mutex m;
+        std::deque<Task> tasks;
+    };
+
+    bool tryPop(unsigned self, Task& out);
+    void workerLoop(unsigned self);
+
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    std::vector<std::thread> workers;
+
+    std::mutex m;
+    std::condition_variable workCv;
+    std::condition_variable doneCv;
+    std::condition_variable spaceCv;
+    size_t queued = 0;      // tasks sitting in a deque   (guarded by m)
+    size_t pending = 0;     // tasks submitted, not done  (guarded by m)
+    bool stopping = false;  //                            (guarded by m)
+    size_t maxQueued = 0;   // 0: unbounded               (guarded by m)
+    std::exception_ptr firstError;
+
+    std::atomic<unsigned> nextQueue{0};
+};
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <dcmtk/dcmdata/dctk.h>
+
+// What the index keeps about one file. Used to add files and to hand
+// them back; inside the index every string is interned.
+struct IndexedFile
+{
+    std::string path;
+    std::string sopClassUid;
+    std::string sopInstanceUid;
+    std::string modality;
+    std::string patientId;
+    std::string studyInstanceUid;
+    std::string seriesInstanceUid;
+    std::string frameOfReferenceUid;
+
+    // RTPLAN -> RTSTRUCT, RTDOSE -> RTPLAN / RTSTRUCT
+    std::vector<std::string> referencedSopInstanceUids;
+    // RTSTRUCT -> the image series it was contoured on
+    std::vector<std::string> referencedSeriesUids;
+};
+
+// CT, MR, PT, ...: not an RT object, registration, segmentation or report
+bool isImageModality(std::string_view modality);
+
+// Top-level identity tags from a dataset loaded at least up to
+// FrameOfReferenceUID (0020,0052).
+void fillIndexRecord(DcmItem* ds, IndexedFile& f);
+
+// RTSTRUCT and RTDOSE keep their references in nested sequences the tag
+// scanner does not enter: loads the file with DCMTK up to the end of those
+// sequences (never the contours or the dose grid) and appends them.
+// Other SOP classes are left untouched.
+bool readIndexReferences(const std::filesystem::path& path, IndexedFile& f);
+
+// Maps SOP Instance / Series / Study / Frame of Reference UIDs to files and
+// resolves plan -> structure set -> image series links without rescanning.
+// UIDs are interned once and files stored as fixed-size records, so an
+// archive of a million files is a few tens of MB in memory and on disk.
+// Not thread-safe: fill it from one thread (e.g. the serial post-pass).
+class UidIndex
+{
+public:
+    using FileId = uint32_t;
+    static constexpr FileId kNone = ~FileId(0);
+
+    struct PlanLinks
+    {
+        FileId plan = kNone;
+        FileId structureSet = kNone;
+        std::vector<FileId> images;
+        bool imagesByFrameOfReference = false;  // no series reference: matched on the plan's FoR
+        std::vector<FileId> doses;
+    };
+
+    UidIndex();
+
+    // false: no SOP Instance UID, or that instance is already indexed
+    // (the same object stored under two paths keeps the first)
+    bool add(const IndexedFile& f);
+
+    size_t size() const { return entries.size(); }
+    bool empty() const { return entries.empty(); }
+
+    IndexedFile file(FileId id) const;
+    std::string path(FileId id) const;
+    std::string_view sopClassUid(FileId id) const { return str(entries[id].sopClass); }
+    std::string_view modality(FileId id) const { return str(entries[id].modality); }
+
+    FileId bySopInstance(std::string_view uid) const;
+    const std::vector<FileId>& bySeries(std::string_view uid) const { return lookup(series, uid); }
+    const std::vector<FileId>& byStudy(std::string_view uid) const { return lookup(studies, uid); }
+    const std::vector<FileId>& byFrameOfReference(std::string_view uid) const { return lookup(frames, uid); }
+    // files whose SOP or series references include uid
+    const std::vector<FileId>& referencing(std::string_view uid) const { return lookup(referencedBy, uid); }
+
+    PlanLinks resolvePlan(FileId plan) const;
+
+    // Write-then-rename; load() replaces the contents and returns false for
+    // a missing, corrupt, foreign-endian or older-version file.
+    bool save(const std::filesystem::path& file) const;
+    bool load(const std::filesystem::path& file);
+
+    static constexpr uint32_t kFormatVersion = 1;
+
+private:
+    static constexpr uint32_t kNoString = ~uint32_t(0);
+
+    // fixed-size record: string ids into the pool, references in `refs`
+    struct Entry
+    {
+        uint32_t dir, name;
+        uint32_t sopClass, sopInstance, modality, patientId;
+        uint32_t study, series, frameOfReference;
+        uint32_t refBegin, sopRefCount, seriesRefCount;     // series refs follow the SOP refs
+    };
+
+    using MultiMap = std::unordered_map<uint32_t, std::vector<FileId>>;
+
+    uint32_t intern(std::string_view s);
+    uint32_t find(std::string_view s) const;
+    std::string_view str(uint32_t id) const { return strings[id]; }
+
+    const std::vector<FileId>& lookup(const MultiMap& m, std::string_view uid) const;
+    void link(FileId id);
+    void clear();
+
+    // deque: interned strings never move, so the views in `ids` stay valid
+    std::deque<std::string> strings;
+    std::unordered_map<std::string_view, uint32_t> ids;
+
+    std::vector<Entry> entries;
+    std::vector<uint32_t> refs;
+
+    std::unordered_map<uint32_t, FileId> sopInstances;
+    MultiMap series, studies, frames, referencedBy;
+};
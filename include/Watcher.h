@@ -0,0 +1,63 @@
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "Crawler.h"
+
+struct WatchOptions
+{
+    // a file is reported once it has seen no event for this long, so a
+    // file still being written is parsed once, after the last write
+    std::chrono::milliseconds debounce{500};
+};
+
+struct WatchEvent
+{
+    std::filesystem::path path;
+    bool removed = false;   // deleted or moved away; for a directory, everything below it
+};
+
+// Recursive inotify watch of a directory tree. Directories created later
+// are watched as they appear, and files already inside them are reported.
+// Files pass the same filters as the Crawler (globs, then `accept`).
+// Single-threaded: call poll() from one thread.
+class Watcher
+{
+public:
+    Watcher(std::filesystem::path root, CrawlOptions crawl, WatchOptions opts = {});
+    ~Watcher();
+
+    Watcher(const Watcher&) = delete;
+    Watcher& operator=(const Watcher&) = delete;
+
+    bool ok() const { return fd >= 0; }
+    const std::string& error() const { return err; }
+    size_t directories() const { return dirs.size(); }
+
+    // Waits at most `timeout` and returns the files that settled and the
+    // files removed since the last call (possibly none).
+    std::vector<WatchEvent> poll(std::chrono::milliseconds timeout);
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    void addTree(const std::filesystem::path& dir, int depth, bool reportFiles);
+    void forget(const std::filesystem::path& dir);
+    void drain();
+
+    std::filesystem::path root;
+    CrawlOptions crawl;
+    WatchOptions opts;
+    int fd = -1;
+    std::string err;
+
+    std::unordered_map<int, std::pair<std::filesystem::path, int>> dirs;   // wd -> (dir, depth)
+    std::map<std::filesystem::path, Clock::time_point> pending;            // last event per file
+    std::vector<std::filesystem::path> removed;
+};
@@ -1,7 +1,10 @@
 #pragma once
 
 #include <dcmtk/dcmdata/dctk.h>
+#include <cstddef>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <array>
 #include <vector>
 
@@ -40,9 +43,45 @@ bool getDoubleVector(DcmItem* it,
                      const DcmTagKey& key,
                      std::vector<double>& out);
 
+// Bulk decode straight into a caller buffer: writes min(VM, capacity)
+// values and reports the element's VM in `count`.
+bool getDoubles(DcmItem* it,
+                const DcmTagKey& key,
+                double* out,
+                size_t capacity,
+                size_t& count);
+
 // Sequence helper
 DcmSequenceOfItems* getSequence(DcmItem* it,
                                 const DcmTagKey& key);
 
+// Element-level variants, for single-pass readers (see ItemReader.h)
+bool getString(DcmElement* elem, std::string& out);
+// First value without a copy: points into the element's buffer, padding
+// removed. Meant for code strings that are parsed on the spot.
+bool getStringView(DcmElement* elem, std::string_view& out);
+bool getInt(DcmElement* elem, int& out);
+bool getDouble(DcmElement* elem, double& out);
+bool getDouble3(DcmElement* elem, std::array<double,3>& out3);
+bool getDoubles(DcmElement* elem,
+                double* out,
+                size_t capacity,
+                size_t& count);
+DcmSequenceOfItems* asSequence(DcmElement* elem);
+
+std::optional<std::string> getOptString(DcmElement* elem);
+std::optional<double> getOptDouble(DcmElement* elem);
+
+// Backslash-separated DS values without DCMTK: writes min(VM, capacity)
+// values and reports the VM in `count`. False on empty values or exotic
+// spellings, where DCMTK's parser should be used instead.
+bool decodeDecimalString(const char* s, size_t len,
+                         double* out, size_t capacity, size_t& count);
+
+// Parse from memory instead of a file: a whole Part 10 file, or bare
+// dataset elements encoded in `xfer`. Values are copied out of `data`.
+OFCondition readBuffer(DcmFileFormat& ff, const void* data, size_t size);
+OFCondition readBuffer(DcmDataset& ds, const void* data, size_t size, E_TransferSyntax xfer);
+
 }
 
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace dicom
+{
+
+enum class FileKind : unsigned char
+{
+    NotDicom,
+    Part10,         // 128-byte preamble followed by "DICM"
+    RawDataset,     // no preamble; starts directly with a plausible group 0002/0008 element
+};
+
+// Bytes read from the start of every file: preamble + magic, plus enough
+// of a raw dataset to check its first two element headers.
+constexpr size_t kSniffBytes = 256;
+
+// Classifies a file from its first kSniffBytes only.
+FileKind sniffFile(const std::string& path);
+
+// Same as sniffFile() for a batch: every file is opened and its first block
+// requested with readahead before any of them is read, so the disk/page
+// cache can service the batch in parallel instead of one blocking read at
+// a time. `kinds` is resized to paths.size().
+void sniffFiles(const std::vector<std::string>& paths, std::vector<FileKind>& kinds);
+
+// Classification of an already-read header block (exposed for the above
+// and for callers that have the bytes at hand).
+FileKind classifyHeader(const unsigned char* data, size_t size);
+
+}
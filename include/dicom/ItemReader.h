@@ -0,0 +1,55 @@
+#pragma once
+
+#include <dcmtk/dcmdata/dctk.h>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace dicom
+{
+
+constexpr uint32_t tagOf(Uint16 group, Uint16 element)
+{
+    return (uint32_t(group) << 16) | element;
+}
+
+// One row of a compile-time tag -> field table.
+template<class T>
+struct FieldBinding
+{
+    uint32_t tag;
+    void (*read)(DcmElement* elem, T& target);
+};
+
+template<class T, size_t N>
+constexpr bool isSortedByTag(const FieldBinding<T> (&table)[N])
+{
+    for(size_t i = 1; i < N; ++i)
+        if(table[i-1].tag >= table[i].tag) return false;
+    return true;
+}
+
+// Walks the elements of `item` once and hands every element whose tag is in
+// `table` (sorted by tag) to its reader. Items are stored in tag order, so
+// this is a merge: O(elements + fields) instead of one list search per
+// findAndGet* call.
+template<class T, size_t N>
+void readItem(DcmItem* item, const FieldBinding<T> (&table)[N], T& target)
+{
+    if(!item) return;
+
+    size_t k = 0;
+    uint32_t last = 0;
+    for(DcmObject* obj = item->nextInContainer(nullptr); obj; obj = item->nextInContainer(obj))
+    {
+        const uint32_t tag = tagOf(obj->getGTag(), obj->getETag());
+        if(tag < last) k = 0;    // not in tag order: restart the merge
+        last = tag;
+
+        while(k < N && table[k].tag < tag) ++k;
+        if(k < N && table[k].tag == tag)
+            table[k].read(static_cast<DcmElement*>(obj), target);
+    }
+}
+
+}
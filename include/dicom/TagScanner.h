@@ -0,0 +1,108 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+
+namespace dicom
+{
+
+// Read-only memory mapping of a whole file.
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    ~MappedFile();
+
+    MappedFile(MappedFile&& o) noexcept;
+    MappedFile& operator=(MappedFile&& o) noexcept;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const std::string& path);
+    void close();
+
+    const unsigned char* data() const { return base; }
+    size_t size() const { return length; }
+
+private:
+    const unsigned char* base = nullptr;
+    size_t length = 0;
+};
+
+// Top-level tags the scanner extracts, in tag order.
+enum class ScanTag : unsigned
+{
+    SOPClassUID,            // (0008,0016)
+    SOPInstanceUID,         // (0008,0018)
+    Modality,               // (0008,0060)
+    PatientName,            // (0010,0010)
+    PatientID,              // (0010,0020)
+    StudyInstanceUID,       // (0020,000D)
+    SeriesInstanceUID,      // (0020,000E)
+    FrameOfReferenceUID,    // (0020,0052)
+    Count
+};
+
+// Values point into the MappedFile they were scanned from; they are the
+// first value of the element with padding removed the way DCMTK's
+// getOFString() normalizes it.
+struct TagScan
+{
+    static constexpr size_t kCount = static_cast<size_t>(ScanTag::Count);
+
+    std::array<std::string_view, kCount> values{};
+    std::array<bool, kCount> present{};
+
+    bool has(ScanTag t) const { return present[static_cast<size_t>(t)]; }
+    std::string_view get(ScanTag t) const { return values[static_cast<size_t>(t)]; }
+};
+
+// Walks a Part 10 file (explicit or implicit VR little endian dataset) in
+// place and stops after the last wanted tag. Returns false for anything it
+// does not handle (no DICM magic, big endian, deflated, malformed lengths);
+// the caller is expected to fall back to DCMTK in that case.
+bool scanTags(const MappedFile& file, TagScan& out);
+
+// Byte range of a sequence element, tag to last delimiter.
+struct ElementRange
+{
+    size_t begin = 0;
+    size_t first = 0;       // the first item header
+    size_t end = 0;
+    size_t items = 0;       // items directly in the sequence
+    bool explicitVr = true; // encoding of the items' elements
+    bool found = false;
+};
+
+// Finds a top-level sequence by walking item and element headers only,
+// so a large sequence costs a fraction of decoding it. Same file support
+// as scanTags(); true with `found` unset when the element is absent.
+// Tags are (group << 16) | element, as dicom::tagOf() builds them.
+bool locateSequence(const MappedFile& file, uint32_t tag, ElementRange& out);
+// The same inside one item, given as forEachItem() reports it
+bool locateSequence(const MappedFile& file, size_t begin, size_t end, bool explicitVr,
+                    uint32_t tag, ElementRange& out);
+
+// Calls `visit` with the byte range of each item's elements (header and
+// delimiter excluded), in order, until it returns false. Returns false
+// on malformed data.
+bool forEachItem(const MappedFile& file, const ElementRange& seq,
+                 const std::function<bool(size_t begin, size_t end)>& visit);
+
+// First value of `tag` among one item's elements, given as forEachItem()
+// reports them, trimmed like TagScan values. False when it is absent.
+bool itemValue(const MappedFile& file, size_t begin, size_t end, bool explicitVr, uint32_t tag,
+               std::string_view& out);
+
+// Raw value of `tag` in the first item of each sequence along `path`, e.g.
+// the isocenter of a plan's first control point, without walking the rest.
+// False when it is absent or the file is not supported.
+bool firstItemValue(const MappedFile& file, std::initializer_list<uint32_t> path, uint32_t tag,
+                    std::string_view& out);
+
+}
@@ -1,80 +1,291 @@
 #include "Beam.h"
 
+#include <algorithm>
+#include <cmath>
 #include <iomanip>
+#include <limits>
 
 #include "dicom/DicomUtils.h"
+#include "dicom/ItemReader.h"
+#include "Stats.h"
 
 
-// ---- constructor ----
-Beam::Beam(DcmItem* beamItem)
+namespace
+{
+
+using dicom::FieldBinding;
+using dicom::tagOf;
+
+struct BeamFields
+{
+    Beam& beam;
+    DcmSequenceOfItems* deviceSeq = nullptr;
+    DcmSequenceOfItems* cpSeq = nullptr;
+};
+
+struct DeviceFields
+{
+    std::string type;
+    int pairs = 0;
+    DcmElement* boundaries = nullptr;
+};
+
+constexpr FieldBinding<DeviceFields> kDeviceFields[] = {
+    { tagOf(0x300A, 0x00B8), [](DcmElement* e, DeviceFields& f){ dicom::getString(e, f.type); } },
+    { tagOf(0x300A, 0x00BC), [](DcmElement* e, DeviceFields& f){ dicom::getInt(e, f.pairs); } },
+    { tagOf(0x300A, 0x00BE), [](DcmElement* e, DeviceFields& f){ f.boundaries = e; } },
+};
+static_assert(dicom::isSortedByTag(kDeviceFields), "kDeviceFields must be sorted by tag");
+
+template<class E>
+E parseCode(DcmElement* e, E (*parse)(std::string_view), E absent)
 {
-    using namespace dicom;
-    leafPairs = 60;
+    std::string_view v;
+    return dicom::getStringView(e, v) ? parse(v) : absent;
+}
+
+constexpr FieldBinding<BeamFields> kBeamFields[] = {
+    { tagOf(0x300A, 0x00B2), [](DcmElement* e, BeamFields& f){ f.beam.treatmentMachineName = InternedString(dicom::getOptString(e)); } },
+    { tagOf(0x300A, 0x00B3), [](DcmElement* e, BeamFields& f){ f.beam.primaryDosimeterUnit = InternedString(dicom::getOptString(e)); } },
+    { tagOf(0x300A, 0x00B4), [](DcmElement* e, BeamFields& f){ f.beam.sourceAxisDistanceMm = dicom::getOptDouble(e); } },
+    { tagOf(0x300A, 0x00B6), [](DcmElement* e, BeamFields& f){ f.deviceSeq = dicom::asSequence(e); } },
+    { tagOf(0x300A, 0x00C0), [](DcmElement* e, BeamFields& f){ dicom::getInt(e, f.beam.beamNumber); } },
+    { tagOf(0x300A, 0x00C2), [](DcmElement* e, BeamFields& f){ f.beam.beamName = dicom::getOptString(e); } },
+    { tagOf(0x300A, 0x00C4), [](DcmElement* e, BeamFields& f){ f.beam.beamType = parseCode(e, parseBeamType, BeamType::Absent); } },
+    { tagOf(0x300A, 0x00C6), [](DcmElement* e, BeamFields& f){ f.beam.radiationType = parseCode(e, parseRadiationType, RadiationType::Absent); } },
+    { tagOf(0x300A, 0x00CE), [](DcmElement* e, BeamFields& f){ f.beam.treatmentDeliveryType = parseCode(e, parseDeliveryType, DeliveryType::Absent); } },
+    { tagOf(0x300A, 0x010E), [](DcmElement* e, BeamFields& f){ f.beam.finalCumulativeMetersetWeight = dicom::getOptDouble(e); } },
+    { tagOf(0x300A, 0x0110), [](DcmElement* e, BeamFields& f){ dicom::getInt(e, f.beam.numberOfControlPoints); } },
+    { tagOf(0x300A, 0x0111), [](DcmElement* e, BeamFields& f){ f.cpSeq = dicom::asSequence(e); } },
+};
+static_assert(dicom::isSortedByTag(kBeamFields), "kBeamFields must be sorted by tag");
 
-    // Identity
-    getInt(beamItem, DCM_BeamNumber, beamNumber);
+enum class Turn { Shortest, Clockwise, CounterClockwise };
 
+// A direction applies from its CP until another CP states a new one
+Turn turnOf(RotationDirection dir, Turn current)
+{
+    switch(dir)
     {
-        std::string s;
-        if(getString(beamItem, DCM_BeamName, s)) beamName = s;
-        if(getString(beamItem, DCM_BeamType, s)) beamType = s;
-        if(getString(beamItem, DCM_RadiationType, s)) radiationType = s;
-        if(getString(beamItem, DCM_TreatmentDeliveryType, s)) treatmentDeliveryType = s;
+    case RotationDirection::Absent: return current;
+    case RotationDirection::CW:     return Turn::Clockwise;
+    case RotationDirection::CC:     return Turn::CounterClockwise;
+    default:                        return Turn::Shortest;
     }
+}
 
-    // Machine / SAD / dosimeter unit
+// a + f * (b - a) on the circle, going the way `turn` says (IEC: CW increases the angle)
+double lerpAngle(double a, double b, double f, Turn turn)
+{
+    double d = std::fmod(b - a, 360.0);
+    switch(turn)
     {
-        std::string s;
-        if(getString(beamItem, DCM_TreatmentMachineName, s)) treatmentMachineName = s;
-        if(getString(beamItem, DCM_PrimaryDosimeterUnit, s)) primaryDosimeterUnit = s;
+    case Turn::Clockwise:        if(d < 0.0) d += 360.0; break;
+    case Turn::CounterClockwise: if(d > 0.0) d -= 360.0; break;
+    case Turn::Shortest:
+        if(d > 180.0) d -= 360.0;
+        else if(d <= -180.0) d += 360.0;
+        break;
+    }
+    double v = std::fmod(a + f * d, 360.0);
+    return v < 0.0 ? v + 360.0 : v;
+}
 
-        double d;
-        if(getDouble(beamItem, DCM_SourceAxisDistance, d)) sourceAxisDistanceMm = d;
-        if(getDouble(beamItem, DCM_FinalCumulativeMetersetWeight, d)) finalCumulativeMetersetWeight = d;
+}
+
+namespace
+{
+
+// Identity, classification, machine meta and MLC geometry; returns the
+// ControlPointSequence for the caller to decode now or later
+DcmSequenceOfItems* readSummary(Beam& beam, DcmItem* beamItem)
+{
+    BeamFields fields{ beam };
+    dicom::readItem(beamItem, kBeamFields, fields);
+
+    // MLC geometry: leaf count and the leaf edges perpendicular to travel
+    if(DcmSequenceOfItems* devSeq = fields.deviceSeq)
+    {
+        for(unsigned long i = 0; i < devSeq->card(); ++i)
+        {
+            DeviceFields dev;
+            dicom::readItem(devSeq->getItem(i), kDeviceFields, dev);
+            if(dev.type != "MLCX" || dev.pairs <= 0) continue;
+
+            beam.leafPairs = dev.pairs;
+            auto& edges = beam.leafBoundariesMm;
+            edges.resize(static_cast<size_t>(dev.pairs) + 1);
+            size_t count = 0;
+            if(!dicom::getDoubles(dev.boundaries, edges.data(), edges.size(), count) ||
+               count != edges.size())
+                edges.clear();
+            break;
+        }
     }
+    return fields.cpSeq;
+}
 
-    // Number of CPs
-    getInt(beamItem, DCM_NumberOfControlPoints, numberOfControlPoints);
+void readControlPoints(DcmSequenceOfItems* cpSeq, int leafPairs, ControlPointTable& t)
+{
+    stats::Scope scope(stats::Phase::ControlPoints);
+    t.leafPairs = leafPairs;
+    t.reserve(static_cast<size_t>(cpSeq->card()));
 
-    // Parse ControlPointSequence
-    DcmSequenceOfItems* cpSeq = nullptr;
-    if(beamItem &&
-       beamItem->findAndGetSequence(DCM_ControlPointSequence, cpSeq).good() &&
-       cpSeq)
+    for(unsigned long i = 0; i < cpSeq->card(); ++i)
     {
-        controlPoints.clear();
-        controlPoints.reserve(static_cast<size_t>(cpSeq->card()));
+        DcmItem* cpItem = cpSeq->getItem(i);
+        if(!cpItem) continue;
 
-        for(unsigned long i = 0; i < cpSeq->card(); ++i)
-        {
-            DcmItem* cpItem = cpSeq->getItem(i);
-            if(!cpItem) continue;
+        t.append(cpItem);
+    }
+
+    for(size_t i = 1; i < t.size(); ++i)
+        t.fillForward(i);
+    stats::add(stats::Counter::ControlPoints, t.size());
+}
+
+}
+
+// ---- constructor ----
+Beam::Beam(std::pmr::memory_resource* mr)
+    : leafBoundariesMm(mr), table(0, mr)
+{
+}
+
+Beam::Beam(DcmItem* beamItem, std::pmr::memory_resource* mr)
+    : Beam(mr)
+{
+    stats::Scope scope(stats::Phase::Beam);
+    stats::add(stats::Counter::Beams);
+    if(DcmSequenceOfItems* cpSeq = readSummary(*this, beamItem))
+        readControlPoints(cpSeq, leafPairs, table);
+}
+
+Beam::Beam(DcmItem* beamItem, std::shared_ptr<DcmItem> owner, std::pmr::memory_resource* mr)
+    : Beam(mr)
+{
+    stats::Scope scope(stats::Phase::Beam);
+    stats::add(stats::Counter::Beams);
+    if(DcmSequenceOfItems* cpSeq = readSummary(*this, beamItem))
+        pendingControlPoints = std::shared_ptr<DcmSequenceOfItems>(std::move(owner), cpSeq);
+}
+
+void Beam::decodeControlPoints() const
+{
+    readControlPoints(pendingControlPoints.get(), leafPairs, table);
+    pendingControlPoints.reset();
+}
 
-            ControlPoint cp(cpItem);
-            controlPoints.push_back(std::move(cp));
+std::vector<double> Beam::leafBoundariesOrDefault() const
+{
+    const size_t pairs = leafPairs > 0 ? static_cast<size_t>(leafPairs) : 0;
+    if(leafBoundariesMm.size() == pairs + 1)
+        return { leafBoundariesMm.begin(), leafBoundariesMm.end() };
+
+    std::vector<double> edges(pairs + 1);
+    if(pairs == 60)
+    {
+        double y = -200.0;
+        edges[0] = y;
+        for(size_t i = 0; i < pairs; ++i)
+        {
+            y += (i < 10 || i >= 50) ? 10.0 : 5.0;
+            edges[i + 1] = y;
         }
+    }
+    else
+    {
+        for(size_t i = 0; i <= pairs; ++i)
+            edges[i] = (double(i) - double(pairs) / 2.0) * 5.0;
+    }
+    return edges;
+}
 
-        // Optional robustness: inherit missing aperture/geometry from previous CP
-        // (useful if vendor omits repeated values)
-        for(size_t i = 1; i < controlPoints.size(); ++i)
+bool Beam::interpolate(const double* cmw, size_t count, const InterpolationBuffers& out) const
+{
+    const ControlPointTable& t = controlPoints();
+    const size_t n = t.size();
+    if(n == 0) return false;
+
+    constexpr double kNaN = std::numeric_limits<double>::quiet_NaN();
+    const double* w = t.cumulativeMetersetWeight.data();
+    const size_t m = t.leafPairs > 0 ? 2 * static_cast<size_t>(t.leafPairs) : 0;
+
+    size_t k = 0;
+    Turn gantryTurn = turnOf(t.gantryRotationDirection[0], Turn::Shortest);
+    Turn collimatorTurn = turnOf(t.collimatorRotationDirection[0], Turn::Shortest);
+    Turn couchTurn = turnOf(t.couchRotationDirection[0], Turn::Shortest);
+
+    double prev = -std::numeric_limits<double>::infinity();
+    for(size_t q = 0; q < count; ++q)
+    {
+        const double x = cmw[q];
+        if(!(x >= prev)) return false;      // unsorted or NaN
+        prev = x;
+
+        // merge step: k is the last CP at or before x, kept below n - 1 so
+        // that [k, k + 1] is always an interval
+        while(k + 2 < n && w[k + 1] <= x)
         {
-            auto& cur = controlPoints[i];
-            const auto& prev = controlPoints[i-1];
+            ++k;
+            gantryTurn = turnOf(t.gantryRotationDirection[k], gantryTurn);
+            collimatorTurn = turnOf(t.collimatorRotationDirection[k], collimatorTurn);
+            couchTurn = turnOf(t.couchRotationDirection[k], couchTurn);
+        }
+        const size_t k1 = n > 1 ? k + 1 : k;
 
-            if(!cur.jawX && prev.jawX) cur.jawX = prev.jawX;
-            if(!cur.jawY && prev.jawY) cur.jawY = prev.jawY;
+        double f = 0.0;
+        if(k1 != k)
+        {
+            const double span = w[k1] - w[k];
+            f = span > 0.0 ? (x - w[k]) / span : (x >= w[k1] ? 1.0 : 0.0);
+            f = std::min(1.0, std::max(0.0, f));
+        }
 
-            if(!cur.isocenterMm && prev.isocenterMm) cur.isocenterMm = prev.isocenterMm;
-            if(!cur.ssdMm && prev.ssdMm) cur.ssdMm = prev.ssdMm;
+        // one end missing: hold the other; both missing: NaN
+        auto pick = [&](ControlPointTable::Flag bit, auto&& both, const std::pmr::vector<double>& col){
+            const bool h0 = t.has(k, bit), h1 = t.has(k1, bit);
+            if(h0 && h1) return both();
+            return h0 ? col[k] : h1 ? col[k1] : kNaN;
+        };
+        auto linear = [&](ControlPointTable::Flag bit, const std::pmr::vector<double>& col){
+            return pick(bit, [&]{ return col[k] + f * (col[k1] - col[k]); }, col);
+        };
+        auto angular = [&](ControlPointTable::Flag bit, const std::pmr::vector<double>& col, Turn turn){
+            return pick(bit, [&]{ return lerpAngle(col[k], col[k1], f, turn); }, col);
+        };
 
-            if(!cur.gantryAngleDeg && prev.gantryAngleDeg) cur.gantryAngleDeg = prev.gantryAngleDeg;
-            if(!cur.collimatorAngleDeg && prev.collimatorAngleDeg) cur.collimatorAngleDeg = prev.collimatorAngleDeg;
-            if(!cur.couchAngleDeg && prev.couchAngleDeg) cur.couchAngleDeg = prev.couchAngleDeg;
+        if(out.gantryAngleDeg)     out.gantryAngleDeg[q] = angular(ControlPointTable::HasGantry, t.gantryAngleDeg, gantryTurn);
+        if(out.collimatorAngleDeg) out.collimatorAngleDeg[q] = angular(ControlPointTable::HasCollimator, t.collimatorAngleDeg, collimatorTurn);
+        if(out.couchAngleDeg)      out.couchAngleDeg[q] = angular(ControlPointTable::HasCouch, t.couchAngleDeg, couchTurn);
+        if(out.jawX1) out.jawX1[q] = linear(ControlPointTable::HasJawX, t.jawX1);
+        if(out.jawX2) out.jawX2[q] = linear(ControlPointTable::HasJawX, t.jawX2);
+        if(out.jawY1) out.jawY1[q] = linear(ControlPointTable::HasJawY, t.jawY1);
+        if(out.jawY2) out.jawY2[q] = linear(ControlPointTable::HasJawY, t.jawY2);
 
-            if(cur.mlcA.empty() && !prev.mlcA.empty()) cur.mlcA = prev.mlcA;
-            if(cur.mlcB.empty() && !prev.mlcB.empty()) cur.mlcB = prev.mlcB;
+        if(out.mlc && m)
+        {
+            double* dst = out.mlc + q * m;
+            const bool h0 = t.has(k, ControlPointTable::HasMLC), h1 = t.has(k1, ControlPointTable::HasMLC);
+            if(h0 && h1 && t.mlcRef[k] != t.mlcRef[k1])
+            {
+                const double* a = t.mlcRow(k);
+                const double* b = t.mlcRow(k1);
+                for(size_t i = 0; i < m; ++i)
+                    dst[i] = a[i] + f * (b[i] - a[i]);
+            }
+            else if(h0 || h1)
+            {
+                const double* a = t.mlcRow(h0 ? k : k1);    // shared or one-sided aperture
+                std::copy(a, a + m, dst);
+            }
+            else
+            {
+                std::fill(dst, dst + m, kNaN);
+            }
         }
     }
+    return true;
 }
 
 void Beam::print(std::ostream& os) const
@@ -82,21 +293,27 @@ void Beam::print(std::ostream& os) const
     auto optS = [&](const char* k, const std::optional<std::string>& v){
         os << "  " << std::left << std::setw(26) << k << ": " << (v ? *v : "<missing>") << "\n";
     };
+    auto optI = [&](const char* k, const InternedString& v){
+        os << "  " << std::left << std::setw(26) << k << ": " << (v ? *v : "<missing>") << "\n";
+    };
+    auto optE = [&](const char* k, auto v){
+        os << "  " << std::left << std::setw(26) << k << ": " << (*toString(v) ? toString(v) : "<missing>") << "\n";
+    };
     auto optD = [&](const char* k, const std::optional<double>& v){
         os << "  " << std::left << std::setw(26) << k << ": " << (v ? std::to_string(*v) : "<missing>") << "\n";
     };
 
     os << "Beam #" << beamNumber << "\n";
     optS("BeamName", beamName);
-    optS("BeamType", beamType);
-    optS("RadiationType", radiationType);
-    optS("TreatmentDeliveryType", treatmentDeliveryType);
-    optS("TreatmentMachineName", treatmentMachineName);
-    optS("PrimaryDosimeterUnit", primaryDosimeterUnit);
+    optE("BeamType", beamType);
+    optE("RadiationType", radiationType);
+    optE("TreatmentDeliveryType", treatmentDeliveryType);
+    optI("TreatmentMachineName", treatmentMachineName);
+    optI("PrimaryDosimeterUnit", primaryDosimeterUnit);
     optD("SAD (mm)", sourceAxisDistanceMm);
     optD("Final CMW", finalCumulativeMetersetWeight);
 
-    os << "  " << std::left << std::setw(26) << "ControlPoints" << ": " << controlPoints.size() << "\n";
+    os << "  " << std::left << std::setw(26) << "ControlPoints" << ": " << controlPoints().size() << "\n";
 
     if(beamMetersetMU) os << "  BeamMeterset (MU): " << beamMetersetMU << "\n";
     if(beamDoseGy)     os << "  BeamDose (Gy): " << beamDoseGy << "\n";
@@ -0,0 +1,41 @@
+#include "Categorical.h"
+
+#include <cstddef>
+
+namespace
+{
+
+// Spellings indexed by enumerator; [0] is Absent, the last entry Other
+constexpr const char* kRotationDirections[] = { "", "NONE", "CW", "CC", "OTHER" };
+constexpr const char* kBeamTypes[] = { "", "STATIC", "DYNAMIC", "OTHER" };
+constexpr const char* kRadiationTypes[] = { "", "PHOTON", "ELECTRON", "NEUTRON", "PROTON", "ION", "OTHER" };
+constexpr const char* kDeliveryTypes[] = { "", "TREATMENT", "OPEN_PORTFILM", "TRMT_PORTFILM",
+                                           "CONTINUATION", "SETUP", "OTHER" };
+
+template<class E, size_t N>
+E parse(std::string_view s, const char* const (&names)[N])
+{
+    for(size_t i = 1; i + 1 < N; ++i)
+        if(s == names[i]) return static_cast<E>(i);
+    return static_cast<E>(N - 1);
+}
+
+// out-of-range values (e.g. from a damaged cache file) print as OTHER
+template<class E, size_t N>
+const char* name(E v, const char* const (&names)[N])
+{
+    const size_t i = static_cast<size_t>(v);
+    return names[i < N ? i : N - 1];
+}
+
+}
+
+RotationDirection parseRotationDirection(std::string_view s) { return parse<RotationDirection>(s, kRotationDirections); }
+BeamType parseBeamType(std::string_view s) { return parse<BeamType>(s, kBeamTypes); }
+RadiationType parseRadiationType(std::string_view s) { return parse<RadiationType>(s, kRadiationTypes); }
+DeliveryType parseDeliveryType(std::string_view s) { return parse<DeliveryType>(s, kDeliveryTypes); }
+
+const char* toString(RotationDirection v) { return name(v, kRotationDirections); }
+const char* toString(BeamType v) { return name(v, kBeamTypes); }
+const char* toString(RadiationType v) { return name(v, kRadiationTypes); }
+const char* toString(DeliveryType v) { return name(v, kDeliveryTypes); }
@@ -0,0 +1,310 @@
+#include "ColumnExport.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+
+constexpr char kMagic[8] = { 'D', 'R', 'C', 'O', 'L', 'S', 0, 0 };
+constexpr double kNaN = std::numeric_limits<double>::quiet_NaN();
+
+struct ColumnSpec
+{
+    const char* name;
+    ColumnType type;
+    bool leaves;        // width is the store's leaf width
+};
+
+// File order is column order; any change needs a kFormatVersion bump.
+enum ColumnId { PlanId, BeamNumber, CpIndex, Cmw, Gantry, Collimator, Couch,
+                JawX1, JawX2, JawY1, JawY2, MlcA, MlcB, ColumnCount };
+
+constexpr ColumnSpec kColumns[ColumnCount] = {
+    { "planId",                   ColumnType::U32, false },
+    { "beamNumber",               ColumnType::I32, false },
+    { "cpIndex",                  ColumnType::I32, false },
+    { "cumulativeMetersetWeight", ColumnType::F64, false },
+    { "gantryAngleDeg",           ColumnType::F64, false },
+    { "collimatorAngleDeg",       ColumnType::F64, false },
+    { "couchAngleDeg",            ColumnType::F64, false },
+    { "jawX1",                    ColumnType::F64, false },
+    { "jawX2",                    ColumnType::F64, false },
+    { "jawY1",                    ColumnType::F64, false },
+    { "jawY2",                    ColumnType::F64, false },
+    { "mlcA",                     ColumnType::F64, true },
+    { "mlcB",                     ColumnType::F64, true },
+};
+
+size_t valueSize(ColumnType t)
+{
+    return t == ColumnType::F64 ? 8 : 4;
+}
+
+bool littleEndianHost()
+{
+    const uint16_t one = 1;
+    unsigned char first;
+    std::memcpy(&first, &one, 1);
+    return first == 1;
+}
+
+bool writeAll(int fd, const void* data, size_t size)
+{
+    const char* p = static_cast<const char*>(data);
+    while(size > 0)
+    {
+        const ssize_t n = ::write(fd, p, size);
+        if(n < 0)
+        {
+            if(errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// number of data lines, i.e. the next plan id
+bool countLines(int fd, uint32_t& lines)
+{
+    char buf[64 * 1024];
+    uint64_t n = 0;
+    for(;;)
+    {
+        const ssize_t r = ::read(fd, buf, sizeof(buf));
+        if(r < 0)
+        {
+            if(errno == EINTR) continue;
+            return false;
+        }
+        if(r == 0) break;
+        n += static_cast<uint64_t>(std::count(buf, buf + r, '\n'));
+    }
+    lines = n > 0 ? static_cast<uint32_t>(n - 1) : 0;   // minus the header
+    return true;
+}
+
+// plans.tsv is line-based: tabs and newlines in values become spaces
+void appendTsv(std::string& line, const std::string& v)
+{
+    for(char c : v)
+        line += (c == '\t' || c == '\n' || c == '\r') ? ' ' : c;
+}
+
+}
+
+ColumnWriter::~ColumnWriter()
+{
+    close();
+}
+
+void ColumnWriter::close()
+{
+    for(Column& c : columns)
+        if(c.fd >= 0) ::close(c.fd);
+    columns.clear();
+    if(plansFd >= 0) ::close(plansFd);
+    plansFd = -1;
+}
+
+bool ColumnWriter::open(const fs::path& dir, int width)
+{
+    close();
+    err.clear();
+
+    if(!littleEndianHost())
+    {
+        err = "columnar export needs a little endian host";
+        return false;
+    }
+    if(width < 0)
+    {
+        err = "leaf width must be positive";
+        return false;
+    }
+
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    if(ec)
+    {
+        err = dir.string() + ": " + ec.message();
+        return false;
+    }
+
+    auto fail = [&](const fs::path& p, const std::string& why){
+        err = p.string() + ": " + why;
+        close();
+        return false;
+    };
+
+    // an existing store fixes the width; the other headers are checked below
+    const fs::path mlcA = dir / (std::string(kColumns[MlcA].name) + ".col");
+    const int fd = ::open(mlcA.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd >= 0)
+    {
+        ColumnHeader have{};
+        const ssize_t n = ::pread(fd, &have, sizeof(have), 0);
+        ::close(fd);
+        if(n == static_cast<ssize_t>(sizeof(have)) && std::memcmp(have.magic, kMagic, sizeof(kMagic)) == 0 &&
+           have.width > 0 && have.width <= static_cast<uint32_t>(std::numeric_limits<int>::max()))
+        {
+            if(width != 0 && static_cast<uint32_t>(width) != have.width)
+                return fail(mlcA, "store has " + std::to_string(have.width) + " leaf pairs per row, not " +
+                                  std::to_string(width));
+            width = static_cast<int>(have.width);
+        }
+    }
+    leafWidth = width != 0 ? width : kDefaultLeafWidth;
+
+    uint64_t common = std::numeric_limits<uint64_t>::max();
+    for(const ColumnSpec& spec : kColumns)
+    {
+        const fs::path p = dir / (std::string(spec.name) + ".col");
+        Column c;
+        c.width = spec.leaves ? static_cast<uint32_t>(leafWidth) : 1;
+        c.valueSize = valueSize(spec.type);
+        c.fd = ::open(p.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if(c.fd < 0) return fail(p, std::strerror(errno));
+        columns.push_back(c);
+
+        ColumnHeader want{};
+        std::memcpy(want.magic, kMagic, sizeof(kMagic));
+        want.version = kFormatVersion;
+        want.type = static_cast<uint32_t>(spec.type);
+        want.width = c.width;
+        std::strncpy(want.name, spec.name, sizeof(want.name) - 1);
+
+        struct stat st;
+        if(::fstat(c.fd, &st) != 0) return fail(p, std::strerror(errno));
+
+        uint64_t size = static_cast<uint64_t>(st.st_size);
+        if(size == 0)
+        {
+            if(!writeAll(c.fd, &want, sizeof(want))) return fail(p, std::strerror(errno));
+            size = sizeof(want);
+        }
+        else
+        {
+            ColumnHeader have{};
+            if(::pread(c.fd, &have, sizeof(have), 0) != static_cast<ssize_t>(sizeof(have)) ||
+               std::memcmp(&have, &want, sizeof(want)) != 0)
+                return fail(p, "not a column file of this layout (version, type or leaf width differ)");
+        }
+        common = std::min(common, (size - sizeof(ColumnHeader)) / (c.width * c.valueSize));
+    }
+
+    // cut every column back to whole rows present in all of them
+    for(size_t i = 0; i < columns.size(); ++i)
+    {
+        const Column& c = columns[i];
+        const off_t end = static_cast<off_t>(sizeof(ColumnHeader) + common * c.width * c.valueSize);
+        if(::ftruncate(c.fd, end) != 0 || ::lseek(c.fd, end, SEEK_SET) != end)
+            return fail(dir / (std::string(kColumns[i].name) + ".col"), std::strerror(errno));
+    }
+
+    const fs::path plans = dir / "plans.tsv";
+    plansFd = ::open(plans.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(plansFd < 0 || !countLines(plansFd, nextPlanId))
+        return fail(plans, std::strerror(errno));
+    if(::lseek(plansFd, 0, SEEK_END) == 0)
+    {
+        static const char kHeader[] = "planId\tsopInstanceUid\tpatientId\tfile\n";
+        if(!writeAll(plansFd, kHeader, sizeof(kHeader) - 1))
+            return fail(plans, std::strerror(errno));
+    }
+    return true;
+}
+
+bool ColumnWriter::write(Column& c, const void* data, size_t rows)
+{
+    const size_t size = rows * c.width * c.valueSize;
+    if(!writeAll(c.fd, data, size))
+    {
+        err = std::strerror(errno);
+        return false;
+    }
+    byteCount += size;
+    return true;
+}
+
+bool ColumnWriter::append(const Plan& plan)
+{
+    if(plansFd < 0 || !err.empty()) return false;
+
+    const uint32_t planId = nextPlanId++;
+    std::string line = std::to_string(planId) + '\t';
+    appendTsv(line, plan.sopInstanceUid);
+    line += '\t';
+    appendTsv(line, plan.patientId);
+    line += '\t';
+    appendTsv(line, plan.filePath);
+    line += '\n';
+    if(!writeAll(plansFd, line.data(), line.size()))
+    {
+        err = std::strerror(errno);
+        return false;
+    }
+
+    using T = ControlPointTable;
+    static_assert(sizeof(int) == sizeof(int32_t), "cpIndex is written as i32");
+    for(const Beam& beam : plan.beams())
+    {
+        const T& t = beam.controlPoints();
+        const size_t n = t.size();
+        if(n == 0) continue;
+        if(t.leafPairs > leafWidth && t.apertureCount() > 0)
+        {
+            ++skipped;
+            continue;
+        }
+
+        auto masked = [&](ColumnId id, const std::pmr::vector<double>& col, T::Flag f){
+            scratch.resize(n);
+            for(size_t i = 0; i < n; ++i)
+                scratch[i] = t.has(i, f) ? col[i] : kNaN;
+            return write(columns[id], scratch.data(), n);
+        };
+        // bank 0 = A, 1 = B
+        auto leaves = [&](ColumnId id, size_t bank){
+            const size_t w = static_cast<size_t>(leafWidth);
+            const size_t pairs = static_cast<size_t>(std::max(t.leafPairs, 0));
+            scratch.assign(n * w, kNaN);
+            for(size_t i = 0; i < n; ++i)
+                if(pairs > 0 && t.has(i, T::HasMLC))
+                    std::copy_n(t.mlcRow(i) + bank * pairs, pairs, scratch.begin() + i * w);
+            return write(columns[id], scratch.data(), n);
+        };
+
+        scratchId.assign(n, planId);
+        scratchInt.assign(n, beam.beamNumber);
+        const bool ok =
+            write(columns[PlanId], scratchId.data(), n) &&
+            write(columns[BeamNumber], scratchInt.data(), n) &&
+            write(columns[CpIndex], t.cpIndex.data(), n) &&
+            write(columns[Cmw], t.cumulativeMetersetWeight.data(), n) &&
+            masked(Gantry, t.gantryAngleDeg, T::HasGantry) &&
+            masked(Collimator, t.collimatorAngleDeg, T::HasCollimator) &&
+            masked(Couch, t.couchAngleDeg, T::HasCouch) &&
+            masked(JawX1, t.jawX1, T::HasJawX) &&
+            masked(JawX2, t.jawX2, T::HasJawX) &&
+            masked(JawY1, t.jawY1, T::HasJawY) &&
+            masked(JawY2, t.jawY2, T::HasJawY) &&
+            leaves(MlcA, 0) &&
+            leaves(MlcB, 1);
+        if(!ok) return false;
+        rowCount += n;
+    }
+    return true;
+}
@@ -3,122 +3,312 @@
 #include <dcmtk/dcmdata/dcdeftag.h>
 #include <algorithm> 
 #include "dicom/DicomUtils.h"
+#include "dicom/ItemReader.h"
 
-ControlPoint::ControlPoint(DcmItem* cpItem)
+ControlPointTable::ControlPointTable(int leafPairs, std::pmr::memory_resource* mr)
+    : leafPairs(leafPairs),
+      flags(mr), cpIndex(mr), cumulativeMetersetWeight(mr),
+      gantryAngleDeg(mr), collimatorAngleDeg(mr), couchAngleDeg(mr),
+      gantryRotationDirection(mr), collimatorRotationDirection(mr), couchRotationDirection(mr),
+      isocenterMm(mr), ssdMm(mr), nominalEnergyMV(mr), doseRate(mr),
+      jawX1(mr), jawX2(mr), jawY1(mr), jawY2(mr),
+      mlcRef(mr), leafPositions(mr)
 {
-    using namespace dicom;
-    leafPairs = 60;
+}
+
+void ControlPointTable::reserve(size_t rows)
+{
+    flags.reserve(rows);
+    cpIndex.reserve(rows);
+    cumulativeMetersetWeight.reserve(rows);
+    gantryAngleDeg.reserve(rows);
+    collimatorAngleDeg.reserve(rows);
+    couchAngleDeg.reserve(rows);
+    gantryRotationDirection.reserve(rows);
+    collimatorRotationDirection.reserve(rows);
+    couchRotationDirection.reserve(rows);
+    isocenterMm.reserve(rows);
+    ssdMm.reserve(rows);
+    nominalEnergyMV.reserve(rows);
+    doseRate.reserve(rows);
+    jawX1.reserve(rows); jawX2.reserve(rows);
+    jawY1.reserve(rows); jawY2.reserve(rows);
+    mlcRef.reserve(rows);
+}
+
+void ControlPointTable::clear()
+{
+    flags.clear();
+    cpIndex.clear();
+    cumulativeMetersetWeight.clear();
+    gantryAngleDeg.clear();
+    collimatorAngleDeg.clear();
+    couchAngleDeg.clear();
+    gantryRotationDirection.clear();
+    collimatorRotationDirection.clear();
+    couchRotationDirection.clear();
+    isocenterMm.clear();
+    ssdMm.clear();
+    nominalEnergyMV.clear();
+    doseRate.clear();
+    jawX1.clear(); jawX2.clear();
+    jawY1.clear(); jawY2.clear();
+    mlcRef.clear();
+    leafPositions.clear();
+}
 
-    getInt(cpItem, DCM_ControlPointIndex, cpIndex);
-    getDouble(cpItem, DCM_CumulativeMetersetWeight, cumulativeMetersetWeight);
+namespace
+{
+
+using dicom::FieldBinding;
+using dicom::tagOf;
 
-    //TODO: gantryrotationDirection
-    getDouble(cpItem, DCM_GantryAngle, gantryAngleDeg);
+// Row being filled; columns are pushed with defaults before the pass.
+struct CpFields
+{
+    ControlPointTable& t;
+    size_t row;
+    uint16_t flags = 0;
+    DcmSequenceOfItems* posSeq = nullptr;
+
+    void angle(DcmElement* e, std::pmr::vector<double>& col, ControlPointTable::Flag bit)
     {
-    std::string s;
-    if(getString(cpItem, DCM_GantryRotationDirection, s))
-            gantryRotationDirection=s;
+        if(dicom::getDouble(e, col[row])) flags |= bit;
     }
-    getDouble(cpItem, DCM_BeamLimitingDeviceAngle, collimatorAngleDeg);
-    getDouble(cpItem, DCM_PatientSupportAngle, couchAngleDeg);
 
+    void rotation(DcmElement* e, std::pmr::vector<RotationDirection>& col)
     {
-        std::array<double, 3> iso;
-        if(getDouble3(cpItem, DCM_IsocenterPosition, iso))
-            isocenterMm = iso;
-
-        double ssd;
-        if(getDouble(cpItem, DCM_SourceToSurfaceDistance, ssd))
-            ssdMm = ssd;
+        std::string_view v;
+        if(dicom::getStringView(e, v)) col[row] = parseRotationDirection(v);
     }
-    
-    getDouble(cpItem, DCM_NominalBeamEnergy, nominalEnergyMV);
-    getDouble(cpItem, DCM_DoseRateSet, doseRate);
+};
 
-    DcmSequenceOfItems* posSeq = nullptr;
-    if(cpItem && cpItem->findAndGetSequence(DCM_BeamLimitingDevicePositionSequence, posSeq).good() && posSeq)
+constexpr FieldBinding<CpFields> kCpFields[] = {
+    { tagOf(0x300A, 0x0112), [](DcmElement* e, CpFields& f){ dicom::getInt(e, f.t.cpIndex[f.row]); } },
+    { tagOf(0x300A, 0x0114), [](DcmElement* e, CpFields& f){ dicom::getDouble(e, f.t.nominalEnergyMV[f.row]); } },
+    { tagOf(0x300A, 0x0115), [](DcmElement* e, CpFields& f){ dicom::getDouble(e, f.t.doseRate[f.row]); } },
+    { tagOf(0x300A, 0x011A), [](DcmElement* e, CpFields& f){ f.posSeq = dicom::asSequence(e); } },
+    { tagOf(0x300A, 0x011E), [](DcmElement* e, CpFields& f){ f.angle(e, f.t.gantryAngleDeg, ControlPointTable::HasGantry); } },
+    { tagOf(0x300A, 0x011F), [](DcmElement* e, CpFields& f){ f.rotation(e, f.t.gantryRotationDirection); } },
+    { tagOf(0x300A, 0x0120), [](DcmElement* e, CpFields& f){ f.angle(e, f.t.collimatorAngleDeg, ControlPointTable::HasCollimator); } },
+    { tagOf(0x300A, 0x0121), [](DcmElement* e, CpFields& f){ f.rotation(e, f.t.collimatorRotationDirection); } },
+    { tagOf(0x300A, 0x0122), [](DcmElement* e, CpFields& f){ f.angle(e, f.t.couchAngleDeg, ControlPointTable::HasCouch); } },
+    { tagOf(0x300A, 0x0123), [](DcmElement* e, CpFields& f){ f.rotation(e, f.t.couchRotationDirection); } },
+    { tagOf(0x300A, 0x012C), [](DcmElement* e, CpFields& f){
+        if(dicom::getDouble3(e, f.t.isocenterMm[f.row])) f.flags |= ControlPointTable::HasIsocenter; } },
+    { tagOf(0x300A, 0x0130), [](DcmElement* e, CpFields& f){
+        if(dicom::getDouble(e, f.t.ssdMm[f.row])) f.flags |= ControlPointTable::HasSsd; } },
+    { tagOf(0x300A, 0x0134), [](DcmElement* e, CpFields& f){ dicom::getDouble(e, f.t.cumulativeMetersetWeight[f.row]); } },
+};
+static_assert(dicom::isSortedByTag(kCpFields), "kCpFields must be sorted by tag");
+
+struct DeviceFields
+{
+    std::string type;
+    DcmElement* positions = nullptr;
+};
+
+constexpr FieldBinding<DeviceFields> kDeviceFields[] = {
+    { tagOf(0x300A, 0x00B8), [](DcmElement* e, DeviceFields& f){ dicom::getString(e, f.type); } },
+    { tagOf(0x300A, 0x011C), [](DcmElement* e, DeviceFields& f){ f.positions = e; } },
+};
+static_assert(dicom::isSortedByTag(kDeviceFields), "kDeviceFields must be sorted by tag");
+
+}
+
+void ControlPointTable::append(DcmItem* cpItem)
+{
+    const size_t row = size();
+
+    flags.push_back(0);
+    cpIndex.push_back(-1);
+    cumulativeMetersetWeight.push_back(0.0);
+    gantryAngleDeg.push_back(0.0);
+    collimatorAngleDeg.push_back(0.0);
+    couchAngleDeg.push_back(0.0);
+    gantryRotationDirection.push_back(RotationDirection::Absent);
+    collimatorRotationDirection.push_back(RotationDirection::Absent);
+    couchRotationDirection.push_back(RotationDirection::Absent);
+    isocenterMm.push_back({});
+    ssdMm.push_back(0.0);
+    nominalEnergyMV.push_back(0.0);
+    doseRate.push_back(0.0);
+    jawX1.push_back(0.0); jawX2.push_back(0.0);
+    jawY1.push_back(0.0); jawY2.push_back(0.0);
+    mlcRef.push_back(kNoAperture);
+
+    CpFields fields{ *this, row };
+    dicom::readItem(cpItem, kCpFields, fields);
+
+    const size_t n = static_cast<size_t>(std::max(leafPairs, 0));
+
+    if(DcmSequenceOfItems* posSeq = fields.posSeq)
     {
-       for(unsigned long i = 0; i < posSeq->card(); ++i)
+        for(unsigned long i = 0; i < posSeq->card(); ++i)
         {
-            DcmItem* posItem = posSeq->getItem(i);
-            if(!posItem) continue;
+            DeviceFields dev;
+            dicom::readItem(posSeq->getItem(i), kDeviceFields, dev);
+            if(dev.type.empty() || !dev.positions) continue;
 
-            std::string devType;
-            if(!getString(posItem, DCM_RTBeamLimitingDeviceType, devType)) continue;
+            if(dev.type == "MLCX")
+            {
+                if(n == 0) continue;
 
-            std::vector<double> vals;
-            if(!getDoubleVector(posItem, DCM_LeafJawPositions, vals)) continue;
+                // decode straight into a new pool row; any other count than
+                // NumberOfLeafJawPairs asks for is malformed, not truncated
+                const size_t base = leafPositions.size();
+                leafPositions.resize(base + 2*n);
+                size_t count = 0;
+                if(!dicom::getDoubles(dev.positions, leafPositions.data() + base, 2*n, count) ||
+                   count != 2*n)
+                {
+                    leafPositions.resize(base);
+                    continue;
+                }
 
-            if(devType == "ASYMX" && vals.size() >= 2)
-            {
-                jawX = std::array<double,2>{vals[0], vals[1]};
+                // step-and-shoot segments repeat the last aperture verbatim: share it
+                const size_t stored = base / (2*n);
+                if(stored > 0 && std::equal(aperture(stored - 1), aperture(stored - 1) + 2*n,
+                                            leafPositions.data() + base))
+                {
+                    leafPositions.resize(base);
+                    mlcRef[row] = static_cast<uint32_t>(stored - 1);
+                }
+                else
+                {
+                    mlcRef[row] = static_cast<uint32_t>(stored);
+                }
+                fields.flags |= HasMLC;
+                continue;
             }
-            else if(devType == "ASYMY" && vals.size() >= 2)
+
+            double jaw[2];
+            size_t count = 0;
+            if(!dicom::getDoubles(dev.positions, jaw, 2, count) || count < 2) continue;
+
+            if(dev.type == "ASYMX")
             {
-                jawY = std::array<double,2>{vals[0], vals[1]};
+                jawX1[row] = jaw[0];
+                jawX2[row] = jaw[1];
+                fields.flags |= HasJawX;
             }
-            else if(devType == "MLCX")
+            else if(dev.type == "ASYMY")
             {
-                const int n = leafPairs;
-                if(n > 0 && (int)vals.size() >= 2*n)
-                {
-                    mlcA.assign(vals.begin(), vals.begin() + n);
-                    mlcB.assign(vals.begin() + n, vals.begin() + 2*n);
-                }
+                jawY1[row] = jaw[0];
+                jawY2[row] = jaw[1];
+                fields.flags |= HasJawY;
             }
         }
     }
+
+    flags[row] = fields.flags;
+}
+
+void ControlPointTable::fillForward(size_t row)
+{
+    // Optional robustness: inherit missing aperture/geometry from previous CP
+    // (useful if vendor omits repeated values)
+    if(row == 0 || row >= size()) return;
+
+    auto inherit = [&](Flag bit, auto&... cols){
+        if(has(row, bit) || !has(row - 1, bit)) return;
+        ((cols[row] = cols[row - 1]), ...);
+        flags[row] |= bit;
+    };
+
+    inherit(HasJawX, jawX1, jawX2);
+    inherit(HasJawY, jawY1, jawY2);
+
+    inherit(HasIsocenter, isocenterMm);
+    inherit(HasSsd, ssdMm);
+
+    inherit(HasGantry, gantryAngleDeg);
+    inherit(HasCollimator, collimatorAngleDeg);
+    inherit(HasCouch, couchAngleDeg);
+
+    // the aperture is shared, not copied
+    inherit(HasMLC, mlcRef);
+}
+
+void ControlPointTable::keepLast()
+{
+    const size_t n = size();
+    if(n <= 1) return;
+
+    auto keep = [&](auto&... cols){
+        ((cols.front() = cols[n - 1], cols.resize(1)), ...);
+    };
+    keep(flags, cpIndex, cumulativeMetersetWeight,
+         gantryAngleDeg, collimatorAngleDeg, couchAngleDeg,
+         gantryRotationDirection, collimatorRotationDirection, couchRotationDirection,
+         isocenterMm, ssdMm, nominalEnergyMV, doseRate,
+         jawX1, jawX2, jawY1, jawY2, mlcRef);
+
+    if(mlcRef[0] == kNoAperture)
+    {
+        leafPositions.clear();
+        return;
+    }
+    const size_t width = 2 * static_cast<size_t>(leafPairs);
+    if(mlcRef[0] != 0)
+        std::copy_n(aperture(mlcRef[0]), width, leafPositions.begin());
+    leafPositions.resize(width);
+    mlcRef[0] = 0;
 }
+
 void ControlPoint::print(std::ostream& os) const
 {
-    os << "    ControlPoint index=" << cpIndex
-       << "  CMW=" << cumulativeMetersetWeight << "\n";
+    os << "    ControlPoint index=" << cpIndex()
+       << "  CMW=" << cumulativeMetersetWeight() << "\n";
 
     auto pOptD = [&](const char* label, const std::optional<double>& v){
         os << "    " << std::left << std::setw(28) << label << ": ";
         if(v) os << *v; else os << "<missing>";
         os << "\n";
     };
-    auto pOptS = [&](const char* label, const std::optional<std::string>& v){
+    auto pOptS = [&](const char* label, RotationDirection v){
         os << "    " << std::left << std::setw(28) << label << ": ";
-        if(v && !v->empty()) os << *v; else os << "<missing>";
+        if(v != RotationDirection::Absent) os << toString(v); else os << "<missing>";
         os << "\n";
     };
 
-    pOptD("GantryAngle (deg)", gantryAngleDeg);
-    pOptS("GantryRotationDirection", gantryRotationDirection);
-    pOptD("CollimatorAngle (deg)", collimatorAngleDeg);
-    pOptS("CollimatorRotationDirection", collimatorRotationDirection);
-    pOptD("CouchAngle (deg)", couchAngleDeg);
-    pOptS("CouchRotationDirection", couchRotationDirection);
+    pOptD("GantryAngle (deg)", gantryAngleDeg());
+    pOptS("GantryRotationDirection", gantryRotationDirection());
+    pOptD("CollimatorAngle (deg)", collimatorAngleDeg());
+    pOptS("CollimatorRotationDirection", collimatorRotationDirection());
+    pOptD("CouchAngle (deg)", couchAngleDeg());
+    pOptS("CouchRotationDirection", couchRotationDirection());
 
-    if(isocenterMm) {
+    if(const auto isocenterMm = this->isocenterMm()) {
         os << "    " << std::left << std::setw(28) << "Isocenter (mm)" << ": ["
            << (*isocenterMm)[0] << ", " << (*isocenterMm)[1] << ", " << (*isocenterMm)[2] << "]\n";
     } else {
         os << "    " << std::left << std::setw(28) << "Isocenter (mm)" << ": <missing>\n";
     }
 
-    pOptD("SSD (mm)", ssdMm);
-    pOptD("NominalEnergy (MV)", nominalEnergyMV);
-    pOptD("DoseRateSet", doseRate);
+    pOptD("SSD (mm)", ssdMm());
+    pOptD("NominalEnergy (MV)", nominalEnergyMV());
+    pOptD("DoseRateSet", doseRate());
 
-    if(jawX) {
+    if(const auto jawX = this->jawX()) {
         os << "    " << std::left << std::setw(28) << "Jaws X (mm)" << ": ["
            << (*jawX)[0] << ", " << (*jawX)[1] << "]\n";
     } else {
         os << "    " << std::left << std::setw(28) << "Jaws X (mm)" << ": <missing>\n";
     }
 
-    if(jawY) {
+    if(const auto jawY = this->jawY()) {
         os << "    " << std::left << std::setw(28) << "Jaws Y (mm)" << ": ["
            << (*jawY)[0] << ", " << (*jawY)[1] << "]\n";
     } else {
         os << "    " << std::left << std::setw(28) << "Jaws Y (mm)" << ": <missing>\n";
     }
 
+    const int leafPairs = this->leafPairs();
     os << "    " << std::left << std::setw(28) << "MLC (leaf pairs)" << ": " << leafPairs << "\n";
     if(hasMLC()) {
+        const LeafSpan mlcA = this->mlcA();
+        const LeafSpan mlcB = this->mlcB();
         os << "    MLC A[0..min(4)] (mm): ";
         for(int i=0; i<std::min(5, leafPairs); ++i) os << mlcA[i] << (i< std::min(5,leafPairs)-1 ? ", " : "");
         os << "\n";
@@ -0,0 +1,151 @@
+#include "Crawler.h"
+
+#include <chrono>
+#include <set>
+#include <utility>
+
+#include <fnmatch.h>
+#include <sys/stat.h>
+
+namespace fs = std::filesystem;
+
+bool crawlExcluded(const CrawlOptions& opts, const std::string& name)
+{
+    for(const auto& g : opts.exclude)
+        if(::fnmatch(g.c_str(), name.c_str(), 0) == 0) return true;
+    return false;
+}
+
+bool crawlWanted(const CrawlOptions& opts, const fs::path& file)
+{
+    const std::string name = file.filename().string();
+    if(crawlExcluded(opts, name)) return false;
+
+    if(!opts.include.empty())
+    {
+        bool any = false;
+        for(const auto& g : opts.include)
+            if(::fnmatch(g.c_str(), name.c_str(), 0) == 0) { any = true; break; }
+        if(!any) return false;
+    }
+
+    return true;
+}
+
+Crawler::Crawler(fs::path root, CrawlOptions opts, BoundedQueue<fs::path>& out)
+    : root(std::move(root)), opts(std::move(opts)), out(out)
+{
+    worker = std::thread([this]{ run(); });
+}
+
+Crawler::~Crawler()
+{
+    out.close();    // unblocks a walk stuck on a full queue
+    join();
+}
+
+void Crawler::join()
+{
+    if(worker.joinable())
+        worker.join();
+}
+
+// Runs the accept filter over a batch and queues the survivors;
+// false once the consumer has closed the queue.
+bool Crawler::flush(std::vector<fs::path>& batch)
+{
+    if(batch.empty()) return true;
+
+    std::vector<bool> keep(batch.size(), true);
+    if(opts.accept)
+        opts.accept(batch, keep);
+
+    bool open = true;
+    for(size_t i = 0; i < batch.size() && open; ++i)
+    {
+        if(!keep[i]) continue;
+        open = out.push(std::move(batch[i]));
+        if(open) ++result.filesQueued;
+    }
+    batch.clear();
+    return open;
+}
+
+void Crawler::run()
+{
+    const auto t0 = std::chrono::steady_clock::now();
+
+    std::vector<fs::path> batch;
+    batch.reserve(CrawlOptions::kAcceptBatch);
+
+    auto offer = [&](const fs::path& p){
+        ++result.filesSeen;
+        if(!crawlWanted(opts, p)) return true;
+        batch.push_back(p);
+        return batch.size() < CrawlOptions::kAcceptBatch || flush(batch);
+    };
+
+    std::error_code ec;
+    if(fs::is_regular_file(root, ec))
+    {
+        offer(root);
+        flush(batch);
+    }
+    else if(fs::is_directory(root, ec))
+    {
+        // (device, inode) of every directory entered when directory links
+        // are followed, to break cycles
+        std::set<std::pair<dev_t, ino_t>> visited;
+        auto firstVisit = [&](const fs::path& dir){
+            struct stat st;
+            if(::stat(dir.c_str(), &st) != 0) return false;
+            return visited.emplace(st.st_dev, st.st_ino).second;
+        };
+
+        std::vector<std::pair<fs::path, int>> stack;
+        if(opts.symlinks != SymlinkPolicy::All || firstVisit(root))
+            stack.emplace_back(root, 0);
+
+        bool stop = false;
+        while(!stack.empty() && !stop)
+        {
+            auto [dir, depth] = std::move(stack.back());
+            stack.pop_back();
+            ++result.directories;
+
+            fs::directory_iterator it(dir, fs::directory_options::skip_permission_denied, ec);
+            if(ec) continue;
+
+            for(const fs::directory_iterator end; it != end && !stop; it.increment(ec))
+            {
+                if(ec) break;
+                const fs::directory_entry& entry = *it;
+
+                std::error_code sec;
+                const bool isLink = entry.is_symlink(sec);
+                if(isLink && opts.symlinks == SymlinkPolicy::None)
+                    continue;
+
+                // is_directory/is_regular_file follow links; d_type makes
+                // them free for plain entries on most file systems
+                if(entry.is_directory(sec))
+                {
+                    if(isLink && opts.symlinks != SymlinkPolicy::All) continue;
+                    if(opts.maxDepth >= 0 && depth >= opts.maxDepth) continue;
+                    if(crawlExcluded(opts, entry.path().filename().string())) continue;
+                    if(opts.symlinks == SymlinkPolicy::All && !firstVisit(entry.path())) continue;
+
+                    stack.emplace_back(entry.path(), depth + 1);
+                }
+                else if(entry.is_regular_file(sec))
+                {
+                    stop = !offer(entry.path());
+                }
+            }
+            stop = stop || !flush(batch);
+        }
+    }
+
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    out.close();
+}
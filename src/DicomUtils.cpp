@@ -1,6 +1,12 @@
 #include "dicom/DicomUtils.h"
 #include <dcmtk/dcmdata/dcdeftag.h>
 #include <dcmtk/dcmdata/dcelem.h>
+#include <dcmtk/dcmdata/dcistrmb.h>
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstring>
 
 namespace dicom
 {
@@ -82,31 +88,139 @@ bool getDouble3(DcmItem* it,
     return false;
 }
 
-bool getDoubleVector(DcmItem* it,
-                     const DcmTagKey& key,
-                     std::vector<double>& out)
+// DS values are short decimal strings separated by '\\'. Parsing the raw value
+// once with from_chars avoids DCMTK's per-index getFloat64(), which rescans the
+// string up to the requested value every time. The results must be
+// bit-identical to getFloat64(); dicom_reader_bench checks that on its corpus
+// and on edge spellings before timing anything. Returns false on anything
+// unusual (empty values, inf/nan, exotic spellings) so the caller can take
+// the DCMTK path.
+bool decodeDecimalString(const char* s, size_t len,
+                         double* out, size_t capacity, size_t& count)
+{
+    const char* p = s;
+    const char* const end = s + len;
+    count = 0;
+
+    for(;;)
+    {
+        const char* sep = static_cast<const char*>(std::memchr(p, '\\', static_cast<size_t>(end - p)));
+        const char* tokEnd = sep ? sep : end;
+
+        const char* a = p;
+        const char* b = tokEnd;
+        while(a < b && *a == ' ') ++a;
+        while(b > a && (*(b-1) == ' ' || *(b-1) == '\0')) --b;
+        // a digit or '.' after at most one sign: no inf, nan or "+-1"
+        const char* digits = a;
+        if(a < b && *a == '+')
+            digits = ++a;
+        else if(a < b && *a == '-')
+            digits = a + 1;
+        if(digits == b) return false;
+        if(!(std::isdigit(static_cast<unsigned char>(*digits)) || *digits == '.')) return false;
+
+        double v;
+        const auto res = std::from_chars(a, b, v);
+        if(res.ec != std::errc() || res.ptr != b) return false;
+
+        if(count < capacity) out[count] = v;
+        ++count;
+
+        if(!sep) return true;
+        p = sep + 1;
+    }
+}
+
+namespace
 {
-    if(!it) return false;
+
+DcmElement* findElement(DcmItem* it, const DcmTagKey& key)
+{
+    if(!it) return nullptr;
 
     DcmElement* elem = nullptr;
-    if(it->findAndGetElement(key, elem).bad() || !elem)
-        return false;
+    if(it->findAndGetElement(key, elem).bad())
+        return nullptr;
+    return elem;
+}
 
+bool getDoublesPerValue(DcmElement* elem,
+                        double* out,
+                        size_t capacity,
+                        size_t& count)
+{
     const unsigned long vm = elem->getVM();
+    count = vm;
     if(vm == 0) return false;
 
-    out.clear();
-    out.reserve(vm);
-
-    for(unsigned long i = 0; i < vm; ++i)
+    for(unsigned long i = 0; i < vm && i < capacity; ++i)
     {
         Float64 v;
         if(elem->getFloat64(v, i).bad())
             return false;
 
-        out.push_back(static_cast<double>(v));
+        out[i] = static_cast<double>(v);
     }
+    return true;
+}
 
+bool getDoublesFromElement(DcmElement* elem,
+                           double* out,
+                           size_t capacity,
+                           size_t& count)
+{
+    if(elem->ident() == EVR_DS)
+    {
+        char* raw = nullptr;
+        if(elem->getString(raw).good() && raw &&
+           decodeDecimalString(raw, std::strlen(raw), out, capacity, count))
+            return true;
+    }
+    return getDoublesPerValue(elem, out, capacity, count);
+}
+
+}
+
+bool getDoubles(DcmItem* it,
+                const DcmTagKey& key,
+                double* out,
+                size_t capacity,
+                size_t& count)
+{
+    DcmElement* elem = findElement(it, key);
+    if(!elem) return false;
+
+    return getDoublesFromElement(elem, out, capacity, count);
+}
+
+bool getDoubles(DcmElement* elem,
+                double* out,
+                size_t capacity,
+                size_t& count)
+{
+    if(!elem) return false;
+
+    return getDoublesFromElement(elem, out, capacity, count);
+}
+
+bool getDoubleVector(DcmItem* it,
+                     const DcmTagKey& key,
+                     std::vector<double>& out)
+{
+    DcmElement* elem = findElement(it, key);
+    if(!elem) return false;
+
+    const unsigned long vm = elem->getVM();
+    if(vm == 0) return false;
+
+    out.resize(vm);
+
+    size_t count = 0;
+    if(!getDoublesFromElement(elem, out.data(), out.size(), count))
+        return false;
+
+    out.resize(std::min<size_t>(count, vm));
     return true;
 }
 
@@ -122,5 +236,119 @@ DcmSequenceOfItems* getSequence(DcmItem* it,
     return nullptr;
 }
 
+bool getString(DcmElement* elem, std::string& out)
+{
+    if(!elem) return false;
+
+    OFString s;
+    if(elem->getOFString(s, 0).good())
+    {
+        out = s.c_str();
+        return true;
+    }
+    return false;
 }
 
+bool getStringView(DcmElement* elem, std::string_view& out)
+{
+    char* raw = nullptr;
+    if(!elem || elem->getString(raw).bad() || !raw) return false;
+
+    std::string_view v(raw);
+    v = v.substr(0, v.find('\\'));
+    const size_t first = v.find_first_not_of(' ');
+    const size_t last = v.find_last_not_of(' ');
+    out = first == std::string_view::npos ? std::string_view() : v.substr(first, last - first + 1);
+    return true;
+}
+
+bool getInt(DcmElement* elem, int& out)
+{
+    if(!elem) return false;
+
+    Sint32 v;
+    if(elem->getSint32(v, 0).good())
+    {
+        out = static_cast<int>(v);
+        return true;
+    }
+    return false;
+}
+
+bool getDouble(DcmElement* elem, double& out)
+{
+    if(!elem) return false;
+
+    Float64 v;
+    if(elem->getFloat64(v, 0).good())
+    {
+        out = static_cast<double>(v);
+        return true;
+    }
+    return false;
+}
+
+bool getDouble3(DcmElement* elem, std::array<double,3>& out3)
+{
+    if(!elem) return false;
+
+    std::array<double,3> v;
+    size_t count = 0;
+    if(getDoublesFromElement(elem, v.data(), v.size(), count) && count >= 3)
+    {
+        out3 = v;
+        return true;
+    }
+    return false;
+}
+
+DcmSequenceOfItems* asSequence(DcmElement* elem)
+{
+    if(!elem || elem->ident() != EVR_SQ) return nullptr;
+
+    return static_cast<DcmSequenceOfItems*>(elem);
+}
+
+std::optional<std::string> getOptString(DcmElement* elem)
+{
+    std::string s;
+    if(getString(elem, s)) return s;
+    return std::nullopt;
+}
+
+std::optional<double> getOptDouble(DcmElement* elem)
+{
+    double d;
+    if(getDouble(elem, d)) return d;
+    return std::nullopt;
+}
+
+namespace
+{
+
+template<class Obj>
+OFCondition readFromMemory(Obj& obj, const void* data, size_t size, E_TransferSyntax xfer)
+{
+    DcmInputBufferStream in;
+    in.setBuffer(data, static_cast<offile_off_t>(size));
+    in.setEos();
+
+    obj.transferInit();
+    const OFCondition st = obj.read(in, xfer, EGL_noChange, DCM_MaxReadLength);
+    obj.transferEnd();
+    return st;
+}
+
+}
+
+OFCondition readBuffer(DcmFileFormat& ff, const void* data, size_t size)
+{
+    return readFromMemory(ff, data, size, EXS_Unknown);
+}
+
+OFCondition readBuffer(DcmDataset& ds, const void* data, size_t size, E_TransferSyntax xfer)
+{
+    return readFromMemory(ds, data, size, xfer);
+}
+
+}
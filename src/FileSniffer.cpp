@@ -0,0 +1,179 @@
+#include "dicom/FileSniffer.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace dicom
+{
+
+namespace
+{
+
+constexpr size_t kPreamble = 128;
+constexpr uint32_t kUndefinedLength = 0xFFFFFFFFu;
+
+inline uint16_t rd16(const unsigned char* p) { return uint16_t(p[0] | (p[1] << 8)); }
+inline uint32_t rd32(const unsigned char* p)
+{
+    return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+bool isVR(const unsigned char* p)
+{
+    static constexpr char kVRs[][3] = {
+        "AE", "AS", "AT", "CS", "DA", "DS", "DT", "FD", "FL", "IS", "LO", "LT",
+        "OB", "OD", "OF", "OL", "OV", "OW", "PN", "SH", "SL", "SQ", "SS", "ST",
+        "SV", "TM", "UC", "UI", "UL", "UN", "UR", "US", "UT", "UV",
+    };
+    for(const auto& vr : kVRs)
+        if(p[0] == vr[0] && p[1] == vr[1]) return true;
+    return false;
+}
+
+bool hasLongLength(const unsigned char* vr)
+{
+    const char a = char(vr[0]), b = char(vr[1]);
+    switch(a)
+    {
+    case 'O': return true;                          // OB OD OF OL OV OW
+    case 'S': return b == 'Q' || b == 'V';
+    case 'U': return b == 'C' || b == 'N' || b == 'R' || b == 'T' || b == 'V';
+    default:  return false;
+    }
+}
+
+// Groups a dataset written without a preamble realistically starts with
+bool plausibleFirstGroup(uint16_t g)
+{
+    return g == 0x0002 || g == 0x0004 || g == 0x0008;
+}
+
+struct Header
+{
+    uint32_t tag = 0;
+    uint32_t length = 0;
+    size_t size = 0;    // bytes taken by the header itself
+};
+
+bool readHeader(const unsigned char* p, size_t left, bool explicitVR, Header& h)
+{
+    if(left < 8) return false;
+    h.tag = (uint32_t(rd16(p)) << 16) | rd16(p + 2);
+
+    if(!explicitVR)
+    {
+        h.length = rd32(p + 4);
+        h.size = 8;
+    }
+    else
+    {
+        if(!isVR(p + 4)) return false;
+        if(hasLongLength(p + 4))
+        {
+            if(left < 12) return false;
+            h.length = rd32(p + 8);
+            h.size = 12;
+        }
+        else
+        {
+            h.length = rd16(p + 6);
+            h.size = 8;
+        }
+    }
+
+    // lengths are even; the first elements of these groups are short
+    if(h.length == kUndefinedLength) return true;
+    return (h.length & 1) == 0 && h.length < 0x10000;
+}
+
+// Both encodings are tried; the first element must sit in an expected
+// group and, when it fits in the block, the second one must follow it in
+// tag order within a nearby group.
+FileKind classifyRaw(const unsigned char* data, size_t size)
+{
+    if(size < 8 || !plausibleFirstGroup(rd16(data))) return FileKind::NotDicom;
+
+    for(bool explicitVR : { true, false })
+    {
+        Header first;
+        if(!readHeader(data, size, explicitVR, first)) continue;
+        if(first.length == kUndefinedLength) continue;
+
+        const size_t next = first.size + first.length;
+        Header second;
+        if(next + 8 > size)
+        {
+            // an explicit VR code at bytes 4-5 is already a strong signal
+            if(explicitVR) return FileKind::RawDataset;
+            continue;
+        }
+        if(!readHeader(data + next, size - next, explicitVR, second)) continue;
+
+        const uint16_t g1 = uint16_t(first.tag >> 16), g2 = uint16_t(second.tag >> 16);
+        if(second.tag > first.tag && g2 - g1 <= 0x0008)
+            return FileKind::RawDataset;
+    }
+    return FileKind::NotDicom;
+}
+
+int openForSniff(const char* path)
+{
+    // O_NOATIME avoids an inode write per file but is refused for files we
+    // do not own
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC | O_NOATIME);
+    if(fd < 0 && errno == EPERM)
+        fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    return fd;
+}
+
+FileKind sniffFd(int fd)
+{
+    unsigned char buf[kSniffBytes];
+    const ssize_t n = ::pread(fd, buf, sizeof(buf), 0);
+    return n > 0 ? classifyHeader(buf, static_cast<size_t>(n)) : FileKind::NotDicom;
+}
+
+}
+
+FileKind classifyHeader(const unsigned char* data, size_t size)
+{
+    if(size >= kPreamble + 4 && std::memcmp(data + kPreamble, "DICM", 4) == 0)
+        return FileKind::Part10;
+    return classifyRaw(data, size);
+}
+
+FileKind sniffFile(const std::string& path)
+{
+    const int fd = openForSniff(path.c_str());
+    if(fd < 0) return FileKind::NotDicom;
+
+    const FileKind kind = sniffFd(fd);
+    ::close(fd);
+    return kind;
+}
+
+void sniffFiles(const std::vector<std::string>& paths, std::vector<FileKind>& kinds)
+{
+    kinds.assign(paths.size(), FileKind::NotDicom);
+
+    std::vector<int> fds(paths.size(), -1);
+    for(size_t i = 0; i < paths.size(); ++i)
+    {
+        fds[i] = openForSniff(paths[i].c_str());
+        if(fds[i] >= 0)
+            ::posix_fadvise(fds[i], 0, kSniffBytes, POSIX_FADV_WILLNEED);
+    }
+
+    for(size_t i = 0; i < paths.size(); ++i)
+    {
+        if(fds[i] < 0) continue;
+        kinds[i] = sniffFd(fds[i]);
+        ::close(fds[i]);
+    }
+}
+
+}
@@ -0,0 +1,200 @@
+#include "Fluence.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+
+#include "ThreadPool.h"
+
+namespace fs = std::filesystem;
+
+namespace
+{
+
+constexpr double kInf = std::numeric_limits<double>::infinity();
+
+struct CpWeight
+{
+    size_t row;
+    float weight;
+};
+
+// Each CP carries half of the meterset of the interval before and after it,
+// i.e. every interval is delivered with the mean of its two end apertures.
+std::vector<CpWeight> cpWeights(const Beam& beam, bool& relative)
+{
+    const ControlPointTable& t = beam.controlPoints();
+    std::vector<CpWeight> out;
+    if(t.empty()) return out;
+
+    const double final = beam.finalCumulativeMetersetWeight.value_or(t.cumulativeMetersetWeight.back());
+    if(!(final > 0.0)) return out;
+
+    relative = !(beam.beamMetersetMU > 0.0);
+    const double scale = (relative ? 1.0 : beam.beamMetersetMU) / final;
+
+    auto delta = [&](size_t j){
+        return j == 0 || j >= t.size() ? 0.0
+             : std::max(0.0, t.cumulativeMetersetWeight[j] - t.cumulativeMetersetWeight[j - 1]);
+    };
+
+    for(size_t j = 0; j < t.size(); ++j)
+    {
+        const bool aperture = t.has(j, ControlPointTable::HasMLC) || t.has(j, ControlPointTable::HasJawX);
+        const double w = 0.5 * (delta(j) + delta(j + 1)) * scale;
+        if(aperture && w > 0.0)
+            out.push_back({ j, static_cast<float>(w) });
+    }
+    return out;
+}
+
+// Adds `w` over [u0, u1) in pixel units, with fractional end pixels.
+// The interior is a plain contiguous add the compiler vectorizes.
+inline void addSpan(float* row, int width, double u0, double u1, float w)
+{
+    u0 = std::max(u0, 0.0);
+    u1 = std::min(u1, double(width));
+    if(!(u1 > u0)) return;
+
+    const int c0 = static_cast<int>(u0);
+    const int c1 = static_cast<int>(u1);
+    if(c0 == c1)
+    {
+        row[c0] += w * static_cast<float>(u1 - u0);
+        return;
+    }
+
+    row[c0] += w * static_cast<float>(c0 + 1 - u0);
+    for(int c = c0 + 1; c < c1; ++c)
+        row[c] += w;
+    if(c1 < width)
+        row[c1] += w * static_cast<float>(u1 - c1);
+}
+
+struct Rasterizer
+{
+    const ControlPointTable& t;
+    const std::vector<double> edges;        // leafPairs + 1
+    const std::vector<CpWeight>& weights;
+    FluenceMap& map;
+
+    // Rows [rowBegin, rowEnd): each row stays in cache while every CP is
+    // added to it, and bands never share rows, so no locking is needed.
+    void band(int rowBegin, int rowEnd) const
+    {
+        const size_t pairs = edges.size() - 1;
+        const double px = map.pixelMm;
+
+        for(int r = rowBegin; r < rowEnd; ++r)
+        {
+            float* row = map.values.data() + static_cast<size_t>(r) * map.width;
+            const double yLo = map.originYmm + r * px;
+            const double yHi = yLo + px;
+
+            // leaf pairs overlapping this row
+            const size_t first = static_cast<size_t>(
+                std::max<std::ptrdiff_t>(0, std::upper_bound(edges.begin(), edges.end(), yLo) - edges.begin() - 1));
+            const size_t last = std::min(pairs,
+                static_cast<size_t>(std::lower_bound(edges.begin(), edges.end(), yHi) - edges.begin()));
+            if(first >= last) continue;
+
+            for(const CpWeight& cw : weights)
+            {
+                const size_t j = cw.row;
+                const bool hasX = t.has(j, ControlPointTable::HasJawX);
+                const bool hasY = t.has(j, ControlPointTable::HasJawY);
+                const double x1 = hasX ? t.jawX1[j] : -kInf, x2 = hasX ? t.jawX2[j] : kInf;
+                const double y1 = std::max(yLo, hasY ? t.jawY1[j] : -kInf);
+                const double y2 = std::min(yHi, hasY ? t.jawY2[j] : kInf);
+                if(!(y2 > y1)) continue;
+
+                const double* A = t.has(j, ControlPointTable::HasMLC) ? t.mlcRow(j) : nullptr;
+
+                for(size_t i = first; i < last; ++i)
+                {
+                    const double fy = (std::min(y2, edges[i + 1]) - std::max(y1, edges[i])) / px;
+                    if(!(fy > 0.0)) continue;
+
+                    const double a = A ? std::max(A[i], x1) : x1;
+                    const double b = A ? std::min(A[i + pairs], x2) : x2;
+                    if(!(b > a)) continue;
+
+                    addSpan(row, map.width,
+                            (a - map.originXmm) / px, (b - map.originXmm) / px,
+                            cw.weight * static_cast<float>(fy));
+                }
+            }
+        }
+    }
+};
+
+}
+
+FluenceMap computeFluence(const Beam& beam, const FluenceOptions& opts, ThreadPool* pool)
+{
+    FluenceMap map;
+    map.pixelMm = opts.pixelMm > 0.0 ? opts.pixelMm : 1.0;
+    const int n = std::max(1, static_cast<int>(std::ceil(opts.fieldSizeMm / map.pixelMm)));
+    map.width = n;
+    map.height = n;
+    map.originXmm = -0.5 * n * map.pixelMm;
+    map.originYmm = map.originXmm;
+    map.values.assign(static_cast<size_t>(n) * n, 0.0f);
+
+    const ControlPointTable& t = beam.controlPoints();
+    if(t.empty() || t.leafPairs <= 0 || t.leafPairs != beam.leafPairs) return map;
+
+    const std::vector<CpWeight> weights = cpWeights(beam, map.relative);
+    if(weights.empty()) return map;
+
+    const Rasterizer raster{ t, beam.leafBoundariesOrDefault(), weights, map };
+
+    if(!pool || pool->size() <= 1)
+    {
+        raster.band(0, map.height);
+        return map;
+    }
+
+    // a few bands per thread so uneven apertures still balance
+    const int bands = static_cast<int>(pool->size()) * 4;
+    const int rows = std::max(8, (map.height + bands - 1) / bands);
+    for(int r = 0; r < map.height; r += rows)
+    {
+        const int end = std::min(map.height, r + rows);
+        pool->submit([&raster, r, end]{ raster.band(r, end); });
+    }
+    pool->wait();
+    return map;
+}
+
+bool writeFluence(const FluenceMap& map, const fs::path& base)
+{
+    fs::path raw = base;
+    raw += ".raw";
+    fs::path mhd = base;
+    mhd += ".mhd";
+
+    {
+        std::ofstream out(raw, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(map.values.data()),
+                  static_cast<std::streamsize>(map.values.size() * sizeof(float)));
+        if(!out) return false;
+    }
+
+    const uint16_t probe = 1;
+    const bool bigEndian = *reinterpret_cast<const unsigned char*>(&probe) == 0;
+
+    std::ofstream hdr(mhd, std::ios::trunc);
+    hdr << "ObjectType = Image\n"
+        << "NDims = 2\n"
+        << "DimSize = " << map.width << " " << map.height << "\n"
+        << "ElementSpacing = " << map.pixelMm << " " << map.pixelMm << "\n"
+        // MetaImage offsets are pixel centres
+        << "Offset = " << map.originXmm + 0.5 * map.pixelMm << " " << map.originYmm + 0.5 * map.pixelMm << "\n"
+        << "ElementType = MET_FLOAT\n"
+        << "ElementByteOrderMSB = " << (bigEndian ? "True" : "False") << "\n"
+        << "ElementDataFile = " << raw.filename().string() << "\n";
+    return static_cast<bool>(hdr);
+}
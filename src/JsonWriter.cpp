@@ -0,0 +1,159 @@
+#include "JsonWriter.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace
+{
+
+// longest shortest-round-trip double: "-2.2250738585072014e-308"
+constexpr size_t kMaxNumber = 32;
+
+// characters a JSON string must escape
+bool needsEscape(unsigned char c)
+{
+    return c < 0x20 || c == '"' || c == '\\';
+}
+
+}
+
+JsonWriter::JsonWriter(size_t capacity)
+    : buf(new char[std::max<size_t>(capacity, 4096)]),
+      cap(std::max<size_t>(capacity, 4096))
+{
+}
+
+JsonWriter::~JsonWriter()
+{
+    flush();
+    if(ownsFd)
+        ::close(fd);
+}
+
+bool JsonWriter::open(const std::string& path)
+{
+    flush();
+    const int f = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(f < 0)
+    {
+        err = path + ": " + std::strerror(errno);
+        return false;
+    }
+    if(ownsFd)
+        ::close(fd);
+    fd = f;
+    ownsFd = true;
+    return true;
+}
+
+bool JsonWriter::flush()
+{
+    const char* p = buf.get();
+    size_t left = len;
+    while(left > 0 && err.empty())
+    {
+        const ssize_t n = ::write(fd, p, left);
+        if(n < 0)
+        {
+            if(errno == EINTR) continue;
+            err = std::strerror(errno);
+            break;
+        }
+        p += n;
+        left -= static_cast<size_t>(n);
+    }
+    // after a failure the output is dropped rather than buffered forever
+    flushed += len;
+    len = 0;
+    return err.empty();
+}
+
+void JsonWriter::append(std::string_view s)
+{
+    while(!s.empty())
+    {
+        if(len == cap) flush();
+        const size_t n = std::min(s.size(), cap - len);
+        std::memcpy(buf.get() + len, s.data(), n);
+        len += n;
+        s.remove_prefix(n);
+    }
+}
+
+void JsonWriter::key(std::string_view k)
+{
+    value(k);
+    put(':');
+    comma = false;
+}
+
+void JsonWriter::value(std::string_view s)
+{
+    static const char kHex[] = "0123456789abcdef";
+
+    separate();
+    put('"');
+    // copy runs of plain characters in one go
+    size_t run = 0;
+    for(size_t i = 0; i < s.size(); ++i)
+    {
+        const unsigned char c = static_cast<unsigned char>(s[i]);
+        if(!needsEscape(c)) continue;
+
+        append(s.substr(run, i - run));
+        run = i + 1;
+
+        char* out = reserve(6);
+        out[0] = '\\';
+        switch(c)
+        {
+        case '"':  out[1] = '"';  len += 2; break;
+        case '\\': out[1] = '\\'; len += 2; break;
+        case '\n': out[1] = 'n';  len += 2; break;
+        case '\r': out[1] = 'r';  len += 2; break;
+        case '\t': out[1] = 't';  len += 2; break;
+        default:
+            out[1] = 'u'; out[2] = '0'; out[3] = '0';
+            out[4] = kHex[c >> 4]; out[5] = kHex[c & 0xF];
+            len += 6;
+        }
+    }
+    append(s.substr(run));
+    put('"');
+    comma = true;
+}
+
+void JsonWriter::value(double v)
+{
+    if(!std::isfinite(v))
+    {
+        null();
+        return;
+    }
+    separate();
+    char* out = reserve(kMaxNumber);
+    len = static_cast<size_t>(std::to_chars(out, out + kMaxNumber, v).ptr - buf.get());
+    comma = true;
+}
+
+void JsonWriter::integer(int64_t v)
+{
+    separate();
+    char* out = reserve(kMaxNumber);
+    len = static_cast<size_t>(std::to_chars(out, out + kMaxNumber, v).ptr - buf.get());
+    comma = true;
+}
+
+void JsonWriter::value(uint64_t v)
+{
+    separate();
+    char* out = reserve(kMaxNumber);
+    len = static_cast<size_t>(std::to_chars(out, out + kMaxNumber, v).ptr - buf.get());
+    comma = true;
+}
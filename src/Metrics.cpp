@@ -0,0 +1,375 @@
+#include "Metrics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <limits>
+
+#include "ThreadPool.h"
+
+// The per-CP kernels are branch-free element-wise loops over contiguous
+// leaf-pair arrays (selects instead of ifs, reductions split into four
+// partial sums) so that the optimizer vectorizes them without intrinsics.
+
+namespace
+{
+
+constexpr double kInf = std::numeric_limits<double>::infinity();
+
+double sum(const double* v, size_t n)
+{
+    double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+    size_t i = 0;
+    for(; i + 4 <= n; i += 4)
+    {
+        s0 += v[i];
+        s1 += v[i + 1];
+        s2 += v[i + 2];
+        s3 += v[i + 3];
+    }
+    for(; i < n; ++i) s0 += v[i];
+    return (s0 + s1) + (s2 + s3);
+}
+
+struct ApertureStats
+{
+    double areaMm2 = 0.0;
+    double perimeterMm = 0.0;
+    double lsv = 0.0;
+    double aav = 0.0;
+    double smallFraction = 0.0;
+};
+
+// Per-beam scratch, sized once to the leaf count.
+struct Workspace
+{
+    size_t n = 0;
+    std::vector<double> edges;      // n + 1
+    std::vector<double> width;      // pair width inside the Y jaws
+    std::vector<double> a, b;       // leaf tips clipped to the X jaws
+    std::vector<double> gap;        // b - a for open, in-field pairs, else 0
+    std::vector<double> tmp;
+    std::vector<double> maxGap;     // largest gap of each pair over the beam
+
+    Workspace(const Beam& beam, size_t pairs)
+        : n(pairs),
+          edges(beam.leafBoundariesOrDefault()),
+          width(pairs), a(pairs), b(pairs), gap(pairs), tmp(pairs), maxGap(pairs, 0.0)
+    {}
+
+    // Aperture of CP `row`, clipped to its jaws. A CP without MLC is the
+    // jaw rectangle; without MLC and X jaws the aperture is unknown (closed).
+    void load(const ControlPointTable& t, size_t row)
+    {
+        const bool hasX = t.has(row, ControlPointTable::HasJawX);
+        const bool hasY = t.has(row, ControlPointTable::HasJawY);
+        const bool hasMLC = t.has(row, ControlPointTable::HasMLC);
+
+        const double x1 = hasX ? t.jawX1[row] : -kInf, x2 = hasX ? t.jawX2[row] : kInf;
+        const double y1 = hasY ? t.jawY1[row] : -kInf, y2 = hasY ? t.jawY2[row] : kInf;
+
+        const double* e = edges.data();
+        double* w = width.data();
+        for(size_t i = 0; i < n; ++i)
+            w[i] = std::max(0.0, std::min(e[i + 1], y2) - std::max(e[i], y1));
+
+        if(!hasMLC && !hasX)
+        {
+            std::fill(gap.begin(), gap.end(), 0.0);
+            return;
+        }
+
+        double* pa = a.data();
+        double* pb = b.data();
+        if(hasMLC)
+        {
+            const double* A = t.mlcRow(row);
+            const double* B = A + n;
+            for(size_t i = 0; i < n; ++i)
+            {
+                pa[i] = std::max(A[i], x1);
+                pb[i] = std::min(B[i], x2);
+            }
+        }
+        else
+        {
+            std::fill(a.begin(), a.end(), x1);
+            std::fill(b.begin(), b.end(), x2);
+        }
+
+        double* g = gap.data();
+        for(size_t i = 0; i < n; ++i)
+        {
+            const double d = pb[i] - pa[i];
+            g[i] = (w[i] > 0.0 && d > 0.0) ? d : 0.0;
+        }
+    }
+
+    void accumulateMaxGap()
+    {
+        const double* g = gap.data();
+        double* m = maxGap.data();
+        for(size_t i = 0; i < n; ++i)
+            m[i] = std::max(m[i], g[i]);
+    }
+
+    // LSV of one bank: 1 - mean |step| between adjacent open pairs,
+    // relative to the bank's spread over the open pairs.
+    double bankLsv(const std::vector<double>& pos)
+    {
+        const double* p = pos.data();
+        const double* g = gap.data();
+
+        double lo = kInf, hi = -kInf;
+        for(size_t i = 0; i < n; ++i)
+        {
+            lo = std::min(lo, g[i] > 0.0 ? p[i] : kInf);
+            hi = std::max(hi, g[i] > 0.0 ? p[i] : -kInf);
+        }
+        const double posMax = hi - lo;
+
+        double* t = tmp.data();
+        size_t pairs = 0;
+        for(size_t i = 1; i < n; ++i)
+        {
+            const bool both = g[i - 1] > 0.0 && g[i] > 0.0;
+            t[i - 1] = both ? posMax - std::fabs(p[i] - p[i - 1]) : 0.0;
+            pairs += both;
+        }
+        if(pairs == 0 || !(posMax > 0.0)) return 1.0;
+        return sum(t, n - 1) / (double(pairs) * posMax);
+    }
+
+    ApertureStats stats(double sumMaxGap, double smallMm)
+    {
+        ApertureStats s;
+        const double* w = width.data();
+        const double* g = gap.data();
+        const double* pa = a.data();
+        const double* pb = b.data();
+        double* t = tmp.data();
+
+        for(size_t i = 0; i < n; ++i) t[i] = g[i] * w[i];
+        s.areaMm2 = sum(t, n);
+
+        const double sumGap = sum(g, n);
+        s.aav = sumMaxGap > 0.0 ? sumGap / sumMaxGap : 0.0;
+
+        size_t open = 0, small = 0;
+        for(size_t i = 0; i < n; ++i)
+        {
+            open += g[i] > 0.0;
+            small += g[i] > 0.0 && g[i] < smallMm;
+        }
+        s.smallFraction = open ? double(small) / double(open) : 0.0;
+
+        // Outline of the union of the open pair rectangles: two sides per
+        // open pair, plus the steps between neighbours (the full gap where
+        // a neighbour is closed, the tip offsets where both are open).
+        for(size_t i = 0; i < n; ++i) t[i] = g[i] > 0.0 ? 2.0 * w[i] : 0.0;
+        double perimeter = sum(t, n) + (n ? g[0] + g[n - 1] : 0.0);
+        for(size_t i = 1; i < n; ++i)
+        {
+            const bool both = g[i - 1] > 0.0 && g[i] > 0.0;
+            t[i - 1] = both ? std::fabs(pa[i] - pa[i - 1]) + std::fabs(pb[i] - pb[i - 1])
+                            : g[i - 1] + g[i];
+        }
+        if(n > 1) perimeter += sum(t, n - 1);
+        s.perimeterMm = perimeter;
+
+        s.lsv = open ? bankLsv(a) * bankLsv(b) : 0.0;
+        return s;
+    }
+};
+
+double leafTravel(const ControlPointTable& t, size_t prev, size_t row)
+{
+    if(!t.has(prev, ControlPointTable::HasMLC) || !t.has(row, ControlPointTable::HasMLC))
+        return 0.0;
+    if(t.mlcRef[prev] == t.mlcRef[row])
+        return 0.0;     // shared aperture, nothing moved
+
+    const size_t m = 2 * static_cast<size_t>(t.leafPairs);
+    const double* p = t.mlcRow(prev);
+    const double* q = t.mlcRow(row);
+
+    double s0 = 0.0, s1 = 0.0;
+    size_t i = 0;
+    for(; i + 2 <= m; i += 2)
+    {
+        s0 += std::fabs(q[i] - p[i]);
+        s1 += std::fabs(q[i + 1] - p[i + 1]);
+    }
+    for(; i < m; ++i) s0 += std::fabs(q[i] - p[i]);
+    return s0 + s1;
+}
+
+void finishPlan(PlanMetrics& pm)
+{
+    double mu = 0.0, weighted = 0.0, plain = 0.0;
+    pm.controlPoints = 0;
+    for(const auto& b : pm.beams)
+    {
+        pm.controlPoints += b.controlPoints;
+        mu += b.beamMetersetMU;
+        weighted += b.beamMetersetMU * b.mcs;
+        plain += b.mcs;
+    }
+    if(mu > 0.0)
+        pm.mcs = weighted / mu;
+    else
+        pm.mcs = pm.beams.empty() ? 0.0 : plain / double(pm.beams.size());
+}
+
+PlanMetrics planShell(const Plan& plan)
+{
+    PlanMetrics pm;
+    pm.filePath = plan.filePath;
+    pm.sopInstanceUid = plan.sopInstanceUid;
+    pm.rtPlanLabel = plan.rtPlanLabel;
+    pm.beams.resize(plan.beams().size());
+    return pm;
+}
+
+}
+
+BeamMetrics computeBeamMetrics(const Beam& beam, const MetricsOptions& opts)
+{
+    BeamMetrics m;
+    m.beamNumber = beam.beamNumber;
+    m.beamName = beam.beamName;
+    m.beamMetersetMU = beam.beamMetersetMU;
+
+    const ControlPointTable& t = beam.controlPoints();
+    m.controlPoints = t.size();
+    if(t.empty() || t.leafPairs <= 0 || t.leafPairs != beam.leafPairs) return m;
+
+    Workspace ws(beam, static_cast<size_t>(t.leafPairs));
+
+    // pass 1: per-pair maximum opening, the AAV reference
+    for(size_t row = 0; row < t.size(); ++row)
+    {
+        ws.load(t, row);
+        ws.accumulateMaxGap();
+    }
+    const double sumMaxGap = sum(ws.maxGap.data(), ws.n);
+
+    // pass 2: per-CP metrics, weighted per delivery interval
+    ApertureStats prev;
+    double totalWeight = 0.0;
+    ApertureStats acc, plain;
+    double mcs = 0.0, plainMcs = 0.0;
+
+    for(size_t row = 0; row < t.size(); ++row)
+    {
+        ws.load(t, row);
+        const ApertureStats cur = ws.stats(sumMaxGap, opts.smallApertureMm);
+
+        plain.areaMm2 += cur.areaMm2;
+        plain.perimeterMm += cur.perimeterMm;
+        plain.lsv += cur.lsv;
+        plain.aav += cur.aav;
+        plain.smallFraction += cur.smallFraction;
+        plainMcs += cur.lsv * cur.aav;
+
+        if(row > 0)
+        {
+            const double dw = std::max(0.0, t.cumulativeMetersetWeight[row] - t.cumulativeMetersetWeight[row - 1]);
+            const double h = 0.5 * dw;
+            totalWeight += dw;
+
+            acc.areaMm2 += h * (prev.areaMm2 + cur.areaMm2);
+            acc.perimeterMm += h * (prev.perimeterMm + cur.perimeterMm);
+            acc.lsv += h * (prev.lsv + cur.lsv);
+            acc.aav += h * (prev.aav + cur.aav);
+            acc.smallFraction += h * (prev.smallFraction + cur.smallFraction);
+            mcs += h * (prev.lsv * prev.aav + cur.lsv * cur.aav);
+
+            m.leafTravelMm += leafTravel(t, row - 1, row);
+        }
+        prev = cur;
+    }
+
+    // no meterset information (single CP, all weights equal): plain mean
+    double scale = totalWeight;
+    if(!(totalWeight > 0.0))
+    {
+        acc = plain;
+        mcs = plainMcs;
+        scale = double(t.size());
+    }
+
+    m.areaMm2 = acc.areaMm2 / scale;
+    m.perimeterMm = acc.perimeterMm / scale;
+    m.lsv = acc.lsv / scale;
+    m.aav = acc.aav / scale;
+    m.smallApertureFraction = acc.smallFraction / scale;
+    m.mcs = mcs / scale;
+    return m;
+}
+
+PlanMetrics computePlanMetrics(const Plan& plan, const MetricsOptions& opts)
+{
+    PlanMetrics pm = planShell(plan);
+    for(size_t b = 0; b < plan.beams().size(); ++b)
+        pm.beams[b] = computeBeamMetrics(plan.beams()[b], opts);
+    finishPlan(pm);
+    return pm;
+}
+
+std::vector<PlanMetrics> computeMetrics(const std::vector<const Plan*>& plans,
+                                        ThreadPool* pool,
+                                        const MetricsOptions& opts)
+{
+    std::vector<PlanMetrics> out;
+    out.reserve(plans.size());
+    for(const Plan* p : plans)
+        out.push_back(planShell(*p));
+
+    for(size_t p = 0; p < plans.size(); ++p)
+    {
+        for(size_t b = 0; b < plans[p]->beams().size(); ++b)
+        {
+            auto task = [&out, &plans, &opts, p, b]{
+                out[p].beams[b] = computeBeamMetrics(plans[p]->beams()[b], opts);
+            };
+            if(pool) pool->submit(task);
+            else task();
+        }
+    }
+    if(pool) pool->wait();
+
+    for(auto& pm : out)
+        finishPlan(pm);
+    return out;
+}
+
+void PlanMetrics::print(std::ostream& os) const
+{
+    os << "================ METRICS ================\n";
+    os << "File            : " << filePath << "\n";
+    os << "Plan Label      : " << rtPlanLabel << "\n";
+    os << "Control Points  : " << controlPoints << "\n";
+    os << "Plan MCS        : " << std::fixed << std::setprecision(4) << mcs << "\n";
+
+    os << "  " << std::left << std::setw(6) << "Beam" << std::setw(12) << "Name" << std::right
+       << std::setw(6) << "CPs" << std::setw(10) << "MU"
+       << std::setw(11) << "Area cm2" << std::setw(11) << "Perim cm"
+       << std::setw(8) << "LSV" << std::setw(8) << "AAV" << std::setw(8) << "MCS"
+       << std::setw(12) << "Travel mm" << std::setw(9) << "Small" << "\n";
+
+    for(const auto& b : beams)
+    {
+        os << "  " << std::left << std::setw(6) << b.beamNumber
+           << std::setw(12) << (b.beamName ? *b.beamName : "-") << std::right
+           << std::setw(6) << b.controlPoints
+           << std::setprecision(1) << std::setw(10) << b.beamMetersetMU
+           << std::setprecision(2) << std::setw(11) << b.areaMm2 / 100.0
+           << std::setw(11) << b.perimeterMm / 10.0
+           << std::setprecision(4) << std::setw(8) << b.lsv << std::setw(8) << b.aav << std::setw(8) << b.mcs
+           << std::setprecision(1) << std::setw(12) << b.leafTravelMm
+           << std::setprecision(3) << std::setw(9) << b.smallApertureFraction << "\n";
+    }
+    os.unsetf(std::ios::floatfield);
+    os << std::setprecision(6);
+}
@@ -0,0 +1,278 @@
+#include "PatientBatch.h"
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <string_view>
+
+#include <dcmtk/dcmdata/dctk.h>
+#include <dcmtk/dcmdata/dcuid.h>
+
+#include "Stats.h"
+#include "ThreadPool.h"
+#include "UidIndex.h"
+#include "dicom/DicomUtils.h"
+#include "dicom/TagScanner.h"
+
+namespace fs = std::filesystem;
+
+namespace
+{
+
+// just past FrameOfReferenceUID (0020,0052)
+const DcmTagKey kBatchStopTag(0x0020, 0x0053);
+
+// issues listing UIDs name at most this many
+constexpr size_t kMaxListed = 3;
+
+// PN compares equal without trailing empty components: DOE^JOHN^^ is DOE^JOHN
+std::string_view normalizedName(std::string_view name)
+{
+    while(!name.empty() && (name.back() == '^' || name.back() == ' '))
+        name.remove_suffix(1);
+    return name;
+}
+
+}
+
+bool readPatientRecord(const fs::path& path, PatientRecord& r, std::string& error)
+{
+    using dicom::ScanTag;
+
+    {
+        stats::Scope scope(stats::Phase::Scan);
+        dicom::MappedFile mf;
+        dicom::TagScan scan;
+        if(mf.open(path.string()) && dicom::scanTags(mf, scan))
+        {
+            r.patientId = scan.get(ScanTag::PatientID);
+            r.patientName = scan.get(ScanTag::PatientName);
+            r.studyInstanceUid = scan.get(ScanTag::StudyInstanceUID);
+            r.frameOfReferenceUid = scan.get(ScanTag::FrameOfReferenceUID);
+            r.sopClassUid = scan.get(ScanTag::SOPClassUID);
+            r.modality = scan.get(ScanTag::Modality);
+            return true;
+        }
+    }
+
+    DcmFileFormat ff;
+    OFCondition st;
+    {
+        stats::Scope scope(stats::Phase::LoadFile);
+        st = ff.loadFileUntilTag(path.string().c_str(), EXS_Unknown, EGL_noChange, DCM_MaxReadLength,
+                                 ERM_autoDetect, kBatchStopTag);
+    }
+    if(st.bad())
+    {
+        error = st.text();
+        return false;
+    }
+
+    DcmDataset* ds = ff.getDataset();
+    dicom::getString(ds, DCM_PatientID, r.patientId);
+    dicom::getString(ds, DCM_PatientName, r.patientName);
+    dicom::getString(ds, DCM_StudyInstanceUID, r.studyInstanceUid);
+    dicom::getString(ds, DCM_FrameOfReferenceUID, r.frameOfReferenceUid);
+    dicom::getString(ds, DCM_SOPClassUID, r.sopClassUid);
+    dicom::getString(ds, DCM_Modality, r.modality);
+    return true;
+}
+
+PatientBatch::PatientBatch(size_t shardCount)
+{
+    shards.resize(std::max<size_t>(shardCount, 1));
+    for(auto& s : shards)
+        s = std::make_unique<Shard>();
+}
+
+void PatientBatch::add(const PatientRecord& r)
+{
+    if(r.patientId.empty())
+    {
+        std::lock_guard<std::mutex> lock(failureMutex);
+        ++withoutId;
+        return;
+    }
+
+    Shard& shard = *shards[std::hash<std::string>()(r.patientId) % shards.size()];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    Patient& p = shard.patients[r.patientId];
+    ++p.files;
+    const std::string_view name = normalizedName(r.patientName);
+    if(name.empty())
+        ++p.unnamed;
+    else
+        ++p.names[std::string(name)];
+    if(r.sopClassUid == UID_RTPlanStorage)
+        ++p.plans;
+    if(!r.studyInstanceUid.empty())
+        p.studies.insert(r.studyInstanceUid);
+    if(!r.frameOfReferenceUid.empty())
+    {
+        unsigned& kind = p.frames[r.frameOfReferenceUid];
+        if(isImageModality(r.modality))
+            kind |= kImage;
+        else if(r.modality.compare(0, 2, "RT") == 0)
+            kind |= kRtObject;
+    }
+}
+
+void PatientBatch::addFailure(const fs::path& path, const std::string& error)
+{
+    std::lock_guard<std::mutex> lock(failureMutex);
+    ++failed;
+    if(failureList.size() < kKeptFailures)
+        failureList.push_back(path.string() + ": " + error);
+}
+
+size_t PatientBatch::filesWithoutPatientId() const
+{
+    std::lock_guard<std::mutex> lock(failureMutex);
+    return withoutId;
+}
+
+size_t PatientBatch::failures() const
+{
+    std::lock_guard<std::mutex> lock(failureMutex);
+    return failed;
+}
+
+std::vector<std::string> PatientBatch::failureSamples() const
+{
+    std::lock_guard<std::mutex> lock(failureMutex);
+    return failureList;
+}
+
+void PatientBatch::check(const std::string& id, const Patient& p, Summary& out)
+{
+    out.patientId = id;
+    out.files = p.files;
+    out.plans = p.plans;
+    out.studies = p.studies.size();
+    out.framesOfReference = p.frames.size();
+
+    size_t best = 0;
+    for(const auto& [name, files] : p.names)
+        if(files > best)
+        {
+            best = files;
+            out.patientName = name;
+        }
+
+    if(p.names.size() > 1)
+    {
+        std::string issue = "PatientName differs:";
+        for(const auto& [name, files] : p.names)
+            issue += " '" + name + "' (" + std::to_string(files) + (files == 1 ? " file)" : " files)");
+        out.issues.push_back(std::move(issue));
+    }
+    if(p.unnamed > 0 && !p.names.empty())
+        out.issues.push_back("PatientName missing in " + std::to_string(p.unnamed) +
+                             (p.unnamed == 1 ? " file" : " files"));
+
+    bool hasImages = false;
+    for(const auto& [uid, kind] : p.frames)
+        hasImages = hasImages || (kind & kImage);
+    if(!hasImages) return;
+
+    std::vector<std::string_view> orphans;
+    for(const auto& [uid, kind] : p.frames)
+        if((kind & kRtObject) && !(kind & kImage))
+            orphans.push_back(uid);
+    if(orphans.empty()) return;
+
+    std::sort(orphans.begin(), orphans.end());
+    std::string issue = "RT objects on a Frame of Reference with no images:";
+    for(size_t i = 0; i < orphans.size() && i < kMaxListed; ++i)
+        issue.append(" ").append(orphans[i]);
+    if(orphans.size() > kMaxListed)
+        issue += " (+" + std::to_string(orphans.size() - kMaxListed) + " more)";
+    out.issues.push_back(std::move(issue));
+}
+
+std::vector<PatientBatch::Summary> PatientBatch::summarize(ThreadPool* pool) const
+{
+    // per-patient checks, one task per shard
+    std::vector<std::vector<Summary>> perShard(shards.size());
+    std::vector<std::vector<const Patient*>> patients(shards.size());
+    auto checkShard = [&](size_t s){
+        const Shard& shard = *shards[s];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        perShard[s].resize(shard.patients.size());
+        size_t i = 0;
+        for(const auto& [id, p] : shard.patients)
+        {
+            check(id, p, perShard[s][i++]);
+            patients[s].push_back(&p);
+        }
+    };
+    if(pool)
+    {
+        for(size_t s = 0; s < shards.size(); ++s)
+            pool->submit([&checkShard, s]{ checkShard(s); });
+        pool->wait();
+    }
+    else
+    {
+        for(size_t s = 0; s < shards.size(); ++s)
+            checkShard(s);
+    }
+
+    std::vector<Summary> out;
+    std::vector<const Patient*> byIndex;
+    for(size_t s = 0; s < shards.size(); ++s)
+    {
+        std::move(perShard[s].begin(), perShard[s].end(), std::back_inserter(out));
+        byIndex.insert(byIndex.end(), patients[s].begin(), patients[s].end());
+    }
+
+    // UIDs are globally unique: one seen under two PatientIDs means files
+    // of one patient were stored under another ID (or a UID was reused)
+    auto crossCheck = [&](const char* what, bool frames){
+        struct Shared
+        {
+            std::vector<std::string> uids;  // the first few, sorted later
+            size_t count = 0;
+        };
+        std::unordered_map<std::string_view, size_t> owner;
+        std::vector<Shared> shared(out.size());
+        auto note = [&](size_t i, const std::string& uid, size_t other){
+            if(shared[i].count++ < 4 * kMaxListed)
+                shared[i].uids.push_back(uid + " (also " + out[other].patientId + ")");
+        };
+        auto visit = [&](size_t i, const std::string& uid){
+            auto [it, fresh] = owner.emplace(uid, i);
+            if(fresh) return;
+            note(i, uid, it->second);
+            note(it->second, uid, i);
+        };
+
+        for(size_t i = 0; i < out.size(); ++i)
+        {
+            if(frames)
+                for(const auto& [uid, kind] : byIndex[i]->frames) visit(i, uid);
+            else
+                for(const std::string& uid : byIndex[i]->studies) visit(i, uid);
+        }
+
+        for(size_t i = 0; i < out.size(); ++i)
+        {
+            Shared& sh = shared[i];
+            if(sh.count == 0) continue;
+            std::sort(sh.uids.begin(), sh.uids.end());
+            std::string issue = std::string(what) + " shared with another PatientID:";
+            for(size_t k = 0; k < sh.uids.size() && k < kMaxListed; ++k)
+                issue += " " + sh.uids[k];
+            if(sh.count > kMaxListed)
+                issue += " (+" + std::to_string(sh.count - kMaxListed) + " more)";
+            out[i].issues.push_back(std::move(issue));
+        }
+    };
+    crossCheck("StudyInstanceUID", false);
+    crossCheck("FrameOfReferenceUID", true);
+
+    std::sort(out.begin(), out.end(),
+              [](const Summary& a, const Summary& b){ return a.patientId < b.patientId; });
+    return out;
+}
@@ -1,139 +1,400 @@
 #include "Plan.h"
 
+#include <filesystem>
 #include <iostream>
+#include <memory>
 #include <map>
 #include <iomanip>
+#include "Stats.h"
 #include "dicom/DicomUtils.h"
+#include "dicom/ItemReader.h"
+#include "dicom/TagScanner.h"
 
-Plan::Plan(DcmDataset* ds)
+namespace
 {
-    if(!ds)
-        return;
 
-    using namespace dicom;
+using dicom::FieldBinding;
+using dicom::tagOf;
 
+// Sequences are only recorded during the pass: beams need the fraction
+// group info, whatever order the elements come in.
+struct PlanFields
+{
+    Plan& plan;
+    DcmSequenceOfItems* refStructSeq = nullptr;
+    DcmSequenceOfItems* fgSeq = nullptr;
+    DcmSequenceOfItems* beamSeq = nullptr;
+};
+
+constexpr FieldBinding<PlanFields> kPlanFields[] = {
+    { tagOf(0x0008, 0x0018), [](DcmElement* e, PlanFields& f){ dicom::getString(e, f.plan.sopInstanceUid); } },
+    { tagOf(0x0010, 0x0010), [](DcmElement* e, PlanFields& f){ dicom::getString(e, f.plan.patientName); } },
+    { tagOf(0x0010, 0x0020), [](DcmElement* e, PlanFields& f){ dicom::getString(e, f.plan.patientId); } },
+    { tagOf(0x0020, 0x000D), [](DcmElement* e, PlanFields& f){ dicom::getString(e, f.plan.studyInstanceUid); } },
+    { tagOf(0x0020, 0x000E), [](DcmElement* e, PlanFields& f){ dicom::getString(e, f.plan.seriesInstanceUid); } },
+    { tagOf(0x0020, 0x0052), [](DcmElement* e, PlanFields& f){ dicom::getString(e, f.plan.frameOfReferenceUid); } },
+    { tagOf(0x300A, 0x0002), [](DcmElement* e, PlanFields& f){ dicom::getString(e, f.plan.rtPlanLabel); } },
+    { tagOf(0x300A, 0x0003), [](DcmElement* e, PlanFields& f){ dicom::getString(e, f.plan.rtPlanName); } },
+    { tagOf(0x300A, 0x0004), [](DcmElement* e, PlanFields& f){ f.plan.rtPlanDescription = dicom::getOptString(e); } },
+    { tagOf(0x300A, 0x0006), [](DcmElement* e, PlanFields& f){ f.plan.rtPlanDate = dicom::getOptString(e); } },
+    { tagOf(0x300A, 0x0007), [](DcmElement* e, PlanFields& f){ f.plan.rtPlanTime = dicom::getOptString(e); } },
+    { tagOf(0x300A, 0x000C), [](DcmElement* e, PlanFields& f){ f.plan.rtPlanGeometry = dicom::getOptString(e); } },
+    { tagOf(0x300A, 0x0070), [](DcmElement* e, PlanFields& f){ f.fgSeq = dicom::asSequence(e); } },
+    { tagOf(0x300A, 0x00B0), [](DcmElement* e, PlanFields& f){ f.beamSeq = dicom::asSequence(e); } },
+    { tagOf(0x300C, 0x0060), [](DcmElement* e, PlanFields& f){ f.refStructSeq = dicom::asSequence(e); } },
+    { tagOf(0x300E, 0x0002), [](DcmElement* e, PlanFields& f){ f.plan.approvalStatus = dicom::getOptString(e); } },
+};
+static_assert(dicom::isSortedByTag(kPlanFields), "kPlanFields must be sorted by tag");
+
+constexpr FieldBinding<std::optional<std::string>> kRefStructFields[] = {
+    { tagOf(0x0008, 0x1155), [](DcmElement* e, std::optional<std::string>& uid){ uid = dicom::getOptString(e); } },
+};
+
+struct FractionGroupFields
+{
+    Plan& plan;
+    DcmSequenceOfItems* refBeamSeq = nullptr;
+};
+
+constexpr FieldBinding<FractionGroupFields> kFractionGroupFields[] = {
+    { tagOf(0x300A, 0x0071), [](DcmElement* e, FractionGroupFields& f){ dicom::getInt(e, f.plan.fractionGroupNumber); } },
+    { tagOf(0x300A, 0x0078), [](DcmElement* e, FractionGroupFields& f){ dicom::getInt(e, f.plan.numFractionsPlanned); } },
+    { tagOf(0x300C, 0x0004), [](DcmElement* e, FractionGroupFields& f){ f.refBeamSeq = dicom::asSequence(e); } },
+};
+static_assert(dicom::isSortedByTag(kFractionGroupFields), "kFractionGroupFields must be sorted by tag");
+
+struct FGBeamInfo{
+    int beamNum = -1;
+    double mu = 0.0;
+    double dose = 0.0;
+    std::array<double, 3> specPoint{};
+    bool hasSpec = false;
+};
+
+constexpr FieldBinding<FGBeamInfo> kRefBeamFields[] = {
+    { tagOf(0x300A, 0x0082), [](DcmElement* e, FGBeamInfo& b){ b.hasSpec = dicom::getDouble3(e, b.specPoint); } },
+    { tagOf(0x300A, 0x0084), [](DcmElement* e, FGBeamInfo& b){ dicom::getDouble(e, b.dose); } },
+    { tagOf(0x300A, 0x0086), [](DcmElement* e, FGBeamInfo& b){ dicom::getDouble(e, b.mu); } },
+    { tagOf(0x300C, 0x0006), [](DcmElement* e, FGBeamInfo& b){ dicom::getInt(e, b.beamNum); } },
+};
+static_assert(dicom::isSortedByTag(kRefBeamFields), "kRefBeamFields must be sorted by tag");
+
+using FractionInfo = std::pmr::map<int, FGBeamInfo>;
+
+// Everything but the beams: identity, structure set link and the first
+// fraction group. Returns the BeamSequence.
+DcmSequenceOfItems* readPlanFields(Plan& plan, DcmDataset* ds, FractionInfo& fgInfo)
+{
+    // --- Patient, UIDs, plan identity: one pass over the dataset ---
+    PlanFields fields{ plan };
+    dicom::readItem(ds, kPlanFields, fields);
 
-    // --- Patient ---
-    getString(ds, DCM_PatientName, patientName);
-    getString(ds, DCM_PatientID, patientId);
+    // --- Linking to structure set ---
+    if(fields.refStructSeq && fields.refStructSeq->card() > 0)
+        dicom::readItem(fields.refStructSeq->getItem(0), kRefStructFields, plan.referencedStructSetSOPInstanceUid);
 
-    // --- UIDs ---
-    getString(ds, DCM_StudyInstanceUID, studyInstanceUid);
-    getString(ds, DCM_SeriesInstanceUID, seriesInstanceUid);
-    getString(ds, DCM_SOPInstanceUID, sopInstanceUid);
-    getString(ds, DCM_FrameOfReferenceUID, frameOfReferenceUid);
+    // ---- Fraction group (store MU info temporarily) ----
+    if(fields.fgSeq && fields.fgSeq->card() > 0)
+    {
+        FractionGroupFields fg{ plan };
+        dicom::readItem(fields.fgSeq->getItem(0), kFractionGroupFields, fg);
 
-    // --- Plan identity ---
-    getString(ds, DCM_RTPlanLabel, rtPlanLabel);
-    getString(ds, DCM_RTPlanName, rtPlanName);
+        if(fg.refBeamSeq)
+        {
+            for(unsigned long i = 0; i < fg.refBeamSeq->card(); i++)
+            {
+                DcmItem* rb = fg.refBeamSeq->getItem(i);
+                if(!rb) continue;
 
+                FGBeamInfo info;
+                dicom::readItem(rb, kRefBeamFields, info);
+                fgInfo[info.beamNum] = info;
+            }
+        }
+    }
+    return fields.beamSeq;
+}
+
+// Attaches the fraction group info to a beam; returns its MU if referenced
+std::optional<double> attachFractionInfo(Beam& b, const FractionInfo& fgInfo)
+{
+    auto it = fgInfo.find(b.beamNumber);
+    if(it == fgInfo.end())
+        return std::nullopt;
+
+    b.beamMetersetMU = it->second.mu;
+    b.beamDoseGy = it->second.dose;
+    if(it->second.hasSpec)
+        b.beamDoseSpecPointMm = it->second.specPoint;
+    return it->second.mu;
+}
+
+}
+
+// What a lazy plan needs to decode its beams later. The file is mapped
+// again for that rather than kept mapped: a listing holds every plan at
+// once, and one mapping each would run into the per-process map limit.
+struct Plan::PendingBeams
+{
+    std::string path;
+    uintmax_t size = 0;                 // of the file at openLazy, to detect a rewrite
+    std::filesystem::file_time_type mtime;
+    dicom::ElementRange range;          // the BeamSequence element
+    E_TransferSyntax xfer = EXS_Unknown;
+    FractionInfo fgInfo;
+
+    // false when the file is gone or changed since openLazy
+    bool map(dicom::MappedFile& file) const
     {
-        std::string s;
-        if(getString(ds, DCM_RTPlanDescription, s))
-            rtPlanDescription = s;
-        if(getString(ds, DCM_RTPlanGeometry, s))
-            rtPlanGeometry = s;
-        if(getString(ds, DCM_ApprovalStatus, s))
-            approvalStatus = s;
-        if(getString(ds, DCM_RTPlanDate, s))
-            rtPlanDate = s;
-        if(getString(ds, DCM_RTPlanTime, s))
-            rtPlanTime = s;
+        std::error_code ec;
+        return std::filesystem::last_write_time(path, ec) == mtime && !ec &&
+               file.open(path) && file.size() == size && range.end <= file.size();
     }
+};
+
+Plan::Plan(std::pmr::memory_resource* mr)
+    : beamList(mr)
+{
+}
+
+Plan::Plan(DcmDataset* ds, std::pmr::memory_resource* mr)
+    : Plan(mr)
+{
+    if(!ds)
+        return;
 
+    stats::Scope scope(stats::Phase::Plan);
+    stats::add(stats::Counter::Plans);
+
+    FractionInfo fgInfo(mr);
+
+    // ---- Beam Sequence ----
+    if(DcmSequenceOfItems* beamSeq = readPlanFields(*this, ds, fgInfo))
     {
-        DcmSequenceOfItems* seq = nullptr;
-        if(ds->findAndGetSequence(DCM_ReferencedStructureSetSequence, seq).good() && seq && seq->card() > 0)
+        beamList.reserve(beamSeq->card());
+        for(unsigned long i=0; i < beamSeq->card(); i++)
         {
-            DcmItem* item = seq->getItem(0);
-            std::string uid;
-            if(item && getString(item, DCM_ReferencedSOPInstanceUID, uid))
-                referencedStructSetSOPInstanceUid = uid;
+            DcmItem* beamItem = beamSeq->getItem(i);
+            if(!beamItem) continue;
+
+            Beam b(beamItem, mr);
+            if(auto mu = attachFractionInfo(b, fgInfo))
+                totalPlannedMetersetMU = (totalPlannedMetersetMU ? *totalPlannedMetersetMU : 0.0) + *mu;
+
+            beamList.push_back(std::move(b));
         }
     }
 
-    // ---- Fraction group (store MU info temporarily) ----
-    struct FGBeamInfo{
-        double mu = 0.0;
-        double dose = 0.0;
-        std::array<double, 3> specPoint{};
-        bool hasSpec = false;
-    };
+    // ---- Primary isocenter (convenience) ----
+    if(!beamList.empty() && !beamList.front().controlPoints().empty())
+        primaryIsocenterMm = beamList.front().controlPoints().front().isocenterMm();
+}
+
+std::optional<Plan> Plan::openLazy(const std::string& path, std::string& error, std::pmr::memory_resource* mr)
+{
+    dicom::MappedFile file;
+    dicom::ElementRange range;
+    const uint32_t beamTag = tagOf(0x300A, 0x00B0);
+
+    DcmFileFormat ff;
+    OFCondition st;
+    // stamped before mapping: a rewrite in between is caught on decode
+    std::error_code ec;
+    const auto mtime = std::filesystem::last_write_time(path, ec);
+    const bool split = !ec && file.open(path) && dicom::locateSequence(file, beamTag, range) && range.found;
+    // the fallback is timed by Plan::Plan
+    std::optional<stats::Scope> scope;
+    if(split)
+    {
+        scope.emplace(stats::Phase::Plan);
+        stats::add(stats::Counter::Plans);
+        // everything around the BeamSequence; the sequence is the bulk of
+        // the file and is left on disk for later
+        std::string rest(reinterpret_cast<const char*>(file.data()), range.begin);
+        rest.append(reinterpret_cast<const char*>(file.data()) + range.end, file.size() - range.end);
+        st = dicom::readBuffer(ff, rest.data(), rest.size());
+    }
+    else
+        st = ff.loadFile(path.c_str());
 
-    std::map<int, FGBeamInfo> fgInfo;
+    if(st.bad())
+    {
+        error = st.text();
+        return std::nullopt;
+    }
 
+    if(!split)
     {
-        DcmSequenceOfItems* fgSeq = nullptr;
-        if(ds->findAndGetSequence(DCM_FractionGroupSequence, fgSeq).good() && fgSeq && fgSeq->card() >  0)
+        std::optional<Plan> plan(std::in_place, ff.getDataset(), mr);
+        plan->filePath = path;
+        return plan;
+    }
+
+    std::optional<Plan> plan(std::in_place, mr);
+    plan->filePath = path;
+
+    auto pending = std::make_shared<PendingBeams>();
+    readPlanFields(*plan, ff.getDataset(), pending->fgInfo);
+
+    // as Plan::Plan: only referenced beams present in the BeamSequence
+    // count, found by their BeamNumber (300A,00C0) without decoding them
+    auto addBeamMu = [&](size_t begin, size_t end){
+        std::string_view value;
+        double number = 0.0;
+        size_t count = 0;
+        if(dicom::itemValue(file, begin, end, range.explicitVr, tagOf(0x300A, 0x00C0), value) &&
+           dicom::decodeDecimalString(value.data(), value.size(), &number, 1, count) && count == 1)
         {
-            DcmItem* fgItem = fgSeq->getItem(0);
-            if(fgItem)
-            {
-                getInt(fgItem, DCM_FractionGroupNumber, fractionGroupNumber);
-                getInt(fgItem, DCM_NumberOfFractionsPlanned, numFractionsPlanned);
+            auto it = pending->fgInfo.find(static_cast<int>(number));
+            if(it != pending->fgInfo.end())
+                plan->totalPlannedMetersetMU = plan->totalPlannedMetersetMU.value_or(0.0) + it->second.mu;
+        }
+        return true;
+    };
+    dicom::forEachItem(file, range, addBeamMu);
+
+    // BeamSequence[0] > ControlPointSequence[0] > IsocenterPosition
+    std::string_view iso;
+    std::array<double, 3> xyz{};
+    size_t count = 0;
+    if(dicom::firstItemValue(file, { beamTag, tagOf(0x300A, 0x0111) }, tagOf(0x300A, 0x012C), iso) &&
+       dicom::decodeDecimalString(iso.data(), iso.size(), xyz.data(), xyz.size(), count) && count == 3)
+        plan->primaryIsocenterMm = xyz;
+
+    pending->path = path;
+    pending->size = file.size();
+    pending->mtime = mtime;
+    pending->xfer = ff.getDataset()->getOriginalXfer();
+    pending->range = range;
+    plan->pendingBeams = std::move(pending);
+    return plan;
+}
 
-                DcmSequenceOfItems* refBeamSeq = nullptr;
-                if(fgItem->findAndGetSequence(DCM_ReferencedBeamSequence, refBeamSeq).good() && refBeamSeq)
-                {
-                    for(unsigned int i = 0; i < refBeamSeq->card(); i++)
-                    {
-                        DcmItem* rb = refBeamSeq->getItem(i);
-                        if(!rb) continue;
+void Plan::decodeBeams() const
+{
+    const std::shared_ptr<const PendingBeams> p = std::move(pendingBeams);
 
-                        int beamNum = -1;
-                        rb->findAndGetSint32(DCM_ReferencedBeamNumber, beamNum);
+    dicom::MappedFile file;
+    if(!p->map(file))
+        return;
 
-                        FGBeamInfo info;
-                        rb->findAndGetFloat64(DCM_BeamMeterset, info.mu);
-                        rb->findAndGetFloat64(DCM_BeamDose, info.dose);
-                        info.hasSpec = getDouble3(rb, DCM_BeamDoseSpecificationPoint, info.specPoint);
+    // shared by the beams until each has decoded its control points
+    auto ds = std::make_shared<DcmDataset>();
+    const unsigned char* begin = file.data() + p->range.begin;
+    if(dicom::readBuffer(*ds, begin, p->range.end - p->range.begin, p->xfer).bad())
+        return;
+    file.close();
 
-                        fgInfo[beamNum] = info;
+    DcmSequenceOfItems* beamSeq = dicom::getSequence(ds.get(), DCM_BeamSequence);
+    if(!beamSeq)
+        return;
 
-                    }
-                }
-            }
-        }
+    beamList.reserve(beamSeq->card());
+    for(unsigned long i = 0; i < beamSeq->card(); i++)
+    {
+        DcmItem* beamItem = beamSeq->getItem(i);
+        if(!beamItem) continue;
+
+        Beam& b = beamList.emplace_back(beamItem, ds, beamList.get_allocator().resource());
+        attachFractionInfo(b, p->fgInfo);
     }
+}
 
-    // ---- Beam Sequence ----
+bool Plan::forEachControlPoint(const ControlPointVisitor& visit) const
+{
+    if(!pendingBeams)
     {
-        DcmSequenceOfItems* beamSeq = nullptr;
-        if(ds->findAndGetSequence(DCM_BeamSequence, beamSeq).good() && beamSeq)
+        for(const Beam& beam : beamList)
+            for(const ControlPoint cp : beam.controlPoints())
+                if(!visit(beam, cp)) return true;
+        return true;
+    }
+
+    const PendingBeams& p = *pendingBeams;
+    dicom::MappedFile file;
+    if(!p.map(file))
+        return false;
+    const char* data = reinterpret_cast<const char*>(file.data());
+
+    std::string header;         // beam item without its ControlPointSequence
+    DcmDataset item;
+    bool ok = true;
+    bool stopped = false;
+
+    auto visitBeam = [&](size_t begin, size_t end){
+        dicom::ElementRange cps;
+        if(!dicom::locateSequence(file, begin, end, p.range.explicitVr, tagOf(0x300A, 0x0111), cps))
         {
-            beams.reserve(beamSeq->card());
-            for(unsigned long i=0; i < beamSeq->card(); i++)
-            {
-                DcmItem* beamItem = beamSeq->getItem(i);
-                if(!beamItem) continue;
+            ok = false;
+            return false;
+        }
 
-                Beam b(beamItem);
+        header.assign(data + begin, (cps.found ? cps.begin : end) - begin);
+        if(cps.found)
+            header.append(data + cps.end, end - cps.end);
 
-                // attach fraction group info
-                auto it = fgInfo.find(b.beamNumber);
-                if(it != fgInfo.end())
-                {
-                    b.beamMetersetMU = it->second.mu;
-                    b.beamDoseGy = it->second.dose;
-                    if(it->second.hasSpec)
-                        b.beamDoseSpecPointMm = it->second.specPoint;
+        const E_TransferSyntax beamXfer = p.range.explicitVr ? EXS_LittleEndianExplicit : EXS_LittleEndianImplicit;
+        item.clear();
+        if(dicom::readBuffer(item, header.data(), header.size(), beamXfer).bad())
+        {
+            ok = false;
+            return false;
+        }
 
-                    totalPlannedMetersetMU = 
-                            (totalPlannedMetersetMU ? *totalPlannedMetersetMU : 0.0) + it->second.mu;
-                }
+        Beam beam(&item);
+        attachFractionInfo(beam, p.fgInfo);
+        if(!cps.found)
+            return true;
+
+        const E_TransferSyntax cpXfer = cps.explicitVr ? EXS_LittleEndianExplicit : EXS_LittleEndianImplicit;
+        ControlPointTable window(beam.leafPairs);
+        window.reserve(2);
+        auto visitCp = [&](size_t cpBegin, size_t cpEnd){
+            item.clear();
+            if(dicom::readBuffer(item, data + cpBegin, cpEnd - cpBegin, cpXfer).bad())
+            {
+                ok = false;
+                return false;
+            }
 
-                beams.push_back(std::move(b));
+            window.append(&item);
+            window.fillForward(window.size() - 1);
+            stats::add(stats::Counter::ControlPoints);
+            if(!visit(beam, window.back()))
+            {
+                stopped = true;
+                return false;
             }
-        }
-    }
+            window.keepLast();
+            return true;
+        };
+        if(!dicom::forEachItem(file, cps, visitCp))
+            ok = false;
+        return ok && !stopped;
+    };
 
-    // ---- Primary isocenter (convenience) ----
-    if(!beams.empty() && !beams.front().controlPoints.empty())
-        primaryIsocenterMm = beams.front().controlPoints.front().isocenterMm;
+    if(!dicom::forEachItem(file, p.range, visitBeam))
+        return false;
+    return ok;
 }
 
+bool forEachControlPoint(const std::string& path, const ControlPointVisitor& visit, std::string& error)
+{
+    std::optional<Plan> plan = Plan::openLazy(path, error);
+    if(!plan)
+        return false;
+    if(!plan->forEachControlPoint(visit))
+    {
+        error = "cannot decode the BeamSequence";
+        return false;
+    }
+    return true;
+}
 
-
+size_t Plan::beamCount() const
+{
+    return pendingBeams ? pendingBeams->range.items : beamList.size();
+}
 
 void Plan::print(std::ostream& os) const
 {
@@ -177,10 +438,10 @@ void Plan::print(std::ostream& os) const
     if(totalPlannedMetersetMU)
         os << "Total MU        : " << *totalPlannedMetersetMU << "\n";
 
-    os << "Number of Beams : " << beams.size() << "\n";
+    os << "Number of Beams : " << beams().size() << "\n";
 
     os << "-----------------------------------------\n";
-    for(const auto& b : beams)
+    for(const auto& b : beams())
     {
         b.print(os);
         os << "-----------------------------------------\n";
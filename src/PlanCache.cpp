@@ -0,0 +1,362 @@
+#include "PlanCache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <thread>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "BinaryIO.h"
+#include "Stats.h"
+#include "dicom/TagScanner.h"
+
+namespace fs = std::filesystem;
+
+namespace
+{
+
+constexpr uint32_t kMagic = 0x43504452;   // "RDPC" on disk for little endian hosts
+
+struct SourceStamp
+{
+    uint64_t size = 0;
+    int64_t mtimeNs = 0;
+};
+
+bool stampOf(const fs::path& p, SourceStamp& out)
+{
+    struct stat st;
+    if(::stat(p.c_str(), &st) != 0) return false;
+
+    out.size = static_cast<uint64_t>(st.st_size);
+    out.mtimeNs = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+std::string keyOf(const fs::path& p)
+{
+    std::error_code ec;
+    fs::path abs = fs::absolute(p, ec);
+    return (ec ? p : abs).lexically_normal().string();
+}
+
+uint64_t fnv1a(const std::string& s)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    for(unsigned char c : s)
+    {
+        h ^= c;
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+// Field lists shared by the writer and the reader so the two cannot drift.
+// Any change here needs a kFormatVersion bump.
+
+template<class T, class F>
+void forEachColumn(T& t, F&& f)
+{
+    f(t.leafPairs);
+    f(t.flags);
+    f(t.cpIndex);
+    f(t.cumulativeMetersetWeight);
+    f(t.gantryAngleDeg);
+    f(t.collimatorAngleDeg);
+    f(t.couchAngleDeg);
+    f(t.gantryRotationDirection);
+    f(t.collimatorRotationDirection);
+    f(t.couchRotationDirection);
+    f(t.isocenterMm);
+    f(t.ssdMm);
+    f(t.nominalEnergyMV);
+    f(t.doseRate);
+    f(t.jawX1);
+    f(t.jawX2);
+    f(t.jawY1);
+    f(t.jawY2);
+    f(t.mlcRef);
+    f(t.leafPositions);
+}
+
+template<class B, class F>
+void forEachBeamField(B& b, F&& f)
+{
+    f(b.beamNumber);
+    f(b.beamName);
+    f(b.beamType);
+    f(b.radiationType);
+    f(b.treatmentDeliveryType);
+    f(b.treatmentMachineName);
+    f(b.primaryDosimeterUnit);
+    f(b.sourceAxisDistanceMm);
+    f(b.finalCumulativeMetersetWeight);
+    f(b.numberOfControlPoints);
+    f(b.leafPairs);
+    f(b.leafBoundariesMm);
+    f(b.beamMetersetMU);
+    f(b.beamDoseGy);
+    f(b.beamDoseSpecPointMm);
+}
+
+template<class P, class F>
+void forEachPlanField(P& p, F&& f)
+{
+    f(p.patientName);
+    f(p.patientId);
+    f(p.studyInstanceUid);
+    f(p.seriesInstanceUid);
+    f(p.sopInstanceUid);
+    f(p.frameOfReferenceUid);
+    f(p.rtPlanLabel);
+    f(p.rtPlanName);
+    f(p.rtPlanDescription);
+    f(p.rtPlanGeometry);
+    f(p.approvalStatus);
+    f(p.rtPlanDate);
+    f(p.rtPlanTime);
+    f(p.patientPosition);
+    f(p.referencedStructSetSOPInstanceUid);
+    f(p.fractionGroupNumber);
+    f(p.numFractionsPlanned);
+    f(p.primaryIsocenterMm);
+    f(p.totalPlannedMetersetMU);
+}
+
+// Interned strings travel as optional strings and are re-interned on load
+void putField(BinaryWriter& w, const InternedString& v)
+{
+    w.pod(static_cast<uint8_t>(v.has_value()));
+    if(v) w.str(*v);
+}
+template<class T> void putField(BinaryWriter& w, const T& v) { w.field(v); }
+
+bool getField(BinaryReader& r, InternedString& v)
+{
+    uint8_t has = 0;
+    std::string_view s;
+    if(!r.pod(has) || (has && !r.view(s))) return false;
+    v = has ? InternedString(s) : InternedString();
+    return true;
+}
+template<class T> bool getField(BinaryReader& r, T& v) { return r.field(v); }
+
+void writePlan(BinaryWriter& w, const Plan& plan)
+{
+    auto put = [&](const auto& v){ putField(w, v); };
+
+    forEachPlanField(plan, put);
+    w.pod(static_cast<uint32_t>(plan.beams().size()));
+    for(const auto& b : plan.beams())
+    {
+        forEachBeamField(b, put);
+        forEachColumn(b.controlPoints(), put);
+    }
+}
+
+bool validTable(const ControlPointTable& t)
+{
+    const size_t n = t.size();
+    const bool sameLength =
+        t.flags.size() == n && t.cumulativeMetersetWeight.size() == n &&
+        t.gantryAngleDeg.size() == n && t.collimatorAngleDeg.size() == n &&
+        t.couchAngleDeg.size() == n && t.gantryRotationDirection.size() == n &&
+        t.collimatorRotationDirection.size() == n && t.couchRotationDirection.size() == n &&
+        t.isocenterMm.size() == n && t.ssdMm.size() == n &&
+        t.nominalEnergyMV.size() == n && t.doseRate.size() == n &&
+        t.jawX1.size() == n && t.jawX2.size() == n &&
+        t.jawY1.size() == n && t.jawY2.size() == n && t.mlcRef.size() == n;
+    if(!sameLength || t.leafPairs < 0) return false;
+
+    if(t.leafPairs == 0) return t.leafPositions.empty();
+    if(t.leafPositions.size() % (2 * static_cast<size_t>(t.leafPairs)) != 0) return false;
+
+    const size_t apertures = t.apertureCount();
+    for(size_t i = 0; i < n; ++i)
+    {
+        const uint32_t ref = t.mlcRef[i];
+        if(ref != ControlPointTable::kNoAperture && ref >= apertures) return false;
+        if(t.has(i, ControlPointTable::HasMLC) && ref == ControlPointTable::kNoAperture) return false;
+    }
+    return true;
+}
+
+// one-byte enums are stored raw: anything past Other is corruption
+template<class E>
+bool validEnum(E v)
+{
+    return static_cast<uint8_t>(v) <= static_cast<uint8_t>(E::Other);
+}
+
+template<class E>
+bool validEnums(const std::pmr::vector<E>& column)
+{
+    return std::all_of(column.begin(), column.end(), [](E v){ return validEnum(v); });
+}
+
+bool validBeam(const Beam& b)
+{
+    const ControlPointTable& t = b.controlPoints();
+    // a beam without a ControlPointSequence keeps the table's default 0
+    const bool sameLeaves = t.leafPairs == b.leafPairs || (t.leafPairs == 0 && t.empty());
+    return sameLeaves && validTable(t) &&
+        validEnum(b.beamType) && validEnum(b.radiationType) && validEnum(b.treatmentDeliveryType) &&
+        validEnums(t.gantryRotationDirection) && validEnums(t.collimatorRotationDirection) &&
+        validEnums(t.couchRotationDirection);
+}
+
+bool readPlan(BinaryReader& r, Plan& plan)
+{
+    bool ok = true;
+    auto get = [&](auto& v){ ok = ok && getField(r, v); };
+
+    forEachPlanField(plan, get);
+
+    uint32_t beamCount = 0;
+    if(!ok || !r.pod(beamCount) || beamCount > r.remaining()) return false;
+
+    // beams and their columns land in the plan's resource
+    auto& beams = plan.beams();
+    std::pmr::memory_resource* mr = beams.get_allocator().resource();
+    beams.reserve(beamCount);
+    for(uint32_t i = 0; i < beamCount; ++i)
+    {
+        Beam& b = beams.emplace_back(mr);
+        forEachBeamField(b, get);
+        forEachColumn(b.controlPoints(), get);
+        if(!ok || !validBeam(b)) return false;
+    }
+    return ok && r.ok();
+}
+
+}
+
+PlanCache::PlanCache(fs::path dir, bool invalidate)
+    : dir(std::move(dir)), invalidate(invalidate)
+{
+    std::error_code ec;
+    fs::create_directories(this->dir, ec);
+}
+
+fs::path PlanCache::entryPath(const std::string& key) const
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.plan", static_cast<unsigned long long>(fnv1a(key)));
+    return dir / name;
+}
+
+std::optional<Plan> PlanCache::load(const fs::path& source, std::string_view sopInstanceUid,
+                                    std::pmr::memory_resource* mr)
+{
+    stats::Scope scope(stats::Phase::CacheLoad);
+    const std::string key = keyOf(source);
+
+    SourceStamp stamp;
+    dicom::MappedFile mf;
+    if(invalidate || !stampOf(source, stamp) || !mf.open(entryPath(key).string()))
+    {
+        ++stats.misses;
+        return std::nullopt;
+    }
+
+    BinaryReader r(mf.data(), mf.size());
+
+    uint32_t magic = 0, version = 0;
+    std::string_view storedKey;
+    SourceStamp storedStamp;
+    std::string_view sopUid;
+
+    Plan plan(mr);
+    const bool valid =
+        r.pod(magic) && magic == kMagic &&
+        r.pod(version) && version == kFormatVersion &&
+        r.view(storedKey) && storedKey == key &&
+        r.pod(storedStamp.size) && storedStamp.size == stamp.size &&
+        r.pod(storedStamp.mtimeNs) && storedStamp.mtimeNs == stamp.mtimeNs &&
+        r.view(sopUid) && sopUid == sopInstanceUid &&
+        readPlan(r, plan) && sopUid == plan.sopInstanceUid;
+
+    if(!valid)
+    {
+        ++stats.stale;
+        ++stats.misses;
+        return std::nullopt;
+    }
+
+    plan.filePath = source.string();
+    ++stats.hits;
+    if(stats::enabled())
+    {
+        // what Plan::Plan would have counted
+        stats::add(stats::Counter::Plans);
+        stats::add(stats::Counter::Beams, plan.beams().size());
+        for(const Beam& b : plan.beams())
+            stats::add(stats::Counter::ControlPoints, b.controlPoints().size());
+    }
+    return plan;
+}
+
+void PlanCache::store(const fs::path& source, const Plan& plan)
+{
+    stats::Scope scope(stats::Phase::CacheStore);
+    const std::string key = keyOf(source);
+
+    SourceStamp stamp;
+    if(!stampOf(source, stamp))
+    {
+        ++stats.writeErrors;
+        return;
+    }
+
+    BinaryWriter w;
+    w.pod(kMagic);
+    w.pod(kFormatVersion);
+    w.str(key);
+    w.pod(stamp.size);
+    w.pod(stamp.mtimeNs);
+    w.str(plan.sopInstanceUid);
+    writePlan(w, plan);
+
+    // write-then-rename so concurrent readers never see a partial entry
+    const fs::path entry = entryPath(key);
+    std::ostringstream tmpName;
+    tmpName << entry.string() << ".tmp." << ::getpid() << "."
+            << std::hash<std::thread::id>()(std::this_thread::get_id());
+    const fs::path tmp = tmpName.str();
+
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        out.write(w.buffer().data(), static_cast<std::streamsize>(w.buffer().size()));
+        if(!out)
+        {
+            std::error_code ec;
+            fs::remove(tmp, ec);
+            ++stats.writeErrors;
+            return;
+        }
+    }
+
+    std::error_code ec;
+    fs::rename(tmp, entry, ec);
+    if(ec)
+    {
+        fs::remove(tmp, ec);
+        ++stats.writeErrors;
+        return;
+    }
+    ++stats.writes;
+}
+
+void PlanCache::printCounters(std::ostream& os) const
+{
+    os << "Plan cache      : " << stats.hits << " hits, "
+       << stats.misses << " misses (" << stats.stale << " stale), "
+       << stats.writes << " written";
+    if(stats.writeErrors)
+        os << ", " << stats.writeErrors << " write errors";
+    os << "\n";
+}
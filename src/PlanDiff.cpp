@@ -0,0 +1,332 @@
+#include "PlanDiff.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+#include <type_traits>
+#include <utility>
+
+namespace
+{
+
+std::string fmt(double v)
+{
+    std::ostringstream os;
+    os << std::setprecision(10) << v;
+    return os.str();
+}
+std::string fmt(int v) { return std::to_string(v); }
+std::string fmt(const std::string& v) { return "\"" + v + "\""; }
+std::string fmt(const std::array<double,3>& v)
+{
+    return "[" + fmt(v[0]) + ", " + fmt(v[1]) + ", " + fmt(v[2]) + "]";
+}
+std::string fmt(const InternedString& v) { return v ? fmt(*v) : "<missing>"; }
+template<class E, class = std::enable_if_t<std::is_enum<E>::value>>
+std::string fmt(E v) { return *toString(v) ? toString(v) : "<missing>"; }
+template<class T>
+std::string fmt(const std::optional<T>& v) { return v ? fmt(*v) : "<missing>"; }
+
+bool same(const std::string& a, const std::string& b, double) { return a == b; }
+bool same(int a, int b, double) { return a == b; }
+// enum codes and interned strings: one integer compare
+template<class T, class = std::enable_if_t<std::is_enum<T>::value || std::is_same<T, InternedString>::value>>
+bool same(T a, T b, double) { return a == b; }
+bool same(double a, double b, double tol) { return std::fabs(a - b) <= tol || (std::isnan(a) && std::isnan(b)); }
+bool same(const std::array<double,3>& a, const std::array<double,3>& b, double tol)
+{
+    return same(a[0], b[0], tol) && same(a[1], b[1], tol) && same(a[2], b[2], tol);
+}
+template<class T>
+bool same(const std::optional<T>& a, const std::optional<T>& b, double tol)
+{
+    if(!a || !b) return !a && !b;
+    return same(*a, *b, tol);
+}
+
+// ---- column kernels ----
+
+enum class Metric { Linear, Angular };
+
+template<Metric M>
+inline bool outside(double a, double b, double tol)
+{
+    double d = std::fabs(a - b);
+    if constexpr (M == Metric::Angular)
+        d = d > 180.0 ? 360.0 - d : d;      // angles are in [0, 360)
+    return d > tol;
+}
+
+// Index of the first element outside tolerance, or n. Blocks of 8 are
+// tested without branches so the inner loop vectorizes; only the block
+// result is branched on, which keeps the early exit cheap.
+template<Metric M>
+size_t firstOutside(const double* a, const double* b, size_t n, double tol)
+{
+    size_t i = 0;
+    for(; i + 8 <= n; i += 8)
+    {
+        int any = 0;
+        for(size_t j = 0; j < 8; ++j)
+            any |= outside<M>(a[i + j], b[i + j], tol);
+        if(any) break;
+    }
+    for(; i < n; ++i)
+        if(outside<M>(a[i], b[i], tol)) return i;
+    return n;
+}
+
+template<Metric M>
+size_t countOutside(const double* a, const double* b, size_t n, double tol)
+{
+    size_t count = 0;
+    for(size_t i = 0; i < n; ++i)
+        count += outside<M>(a[i], b[i], tol);
+    return count;
+}
+
+static_assert(sizeof(std::array<double,3>) == 3 * sizeof(double), "isocentre rows must be packed");
+
+class Differ
+{
+public:
+    Differ(const DiffTolerances& tol, DiffMode mode, PlanDiff& out) : tol(tol), mode(mode), out(out) {}
+
+    void add(int beam, int cp, size_t count, std::string field, std::string a, std::string b)
+    {
+        out.differences.push_back({ beam, cp, count, std::move(field), std::move(a), std::move(b) });
+        stop = mode == DiffMode::FirstDifference;
+    }
+
+    template<class T>
+    void field(int beam, const char* name, const T& a, const T& b, double tolerance = 0.0)
+    {
+        if(stop || same(a, b, tolerance)) return;
+        add(beam, -1, 1, name, fmt(a), fmt(b));
+    }
+
+    void plan(const Plan& a, const Plan& b);
+
+private:
+    void beam(const Beam& a, const Beam& b);
+    void controlPoints(int beam, const ControlPointTable& a, const ControlPointTable& b);
+
+    // `stride` values per CP (3 for the isocentre)
+    template<Metric M>
+    void doubles(int beam, const char* name, const double* a, const double* b, size_t n, size_t stride, double tolerance)
+    {
+        if(stop) return;
+        const size_t first = firstOutside<M>(a, b, n, tolerance);
+        if(first == n) return;
+
+        // a CP counts once however many of its values differ
+        size_t count = 1;
+        if(mode == DiffMode::Full && stride == 1)
+            count = countOutside<M>(a, b, n, tolerance);
+        else if(mode == DiffMode::Full)
+        {
+            count = 0;
+            for(size_t r = 0; r < n; r += stride)
+                count += firstOutside<M>(a + r, b + r, stride, tolerance) != stride;
+        }
+        add(beam, static_cast<int>(first / stride), count, name, fmt(a[first]), fmt(b[first]));
+    }
+
+    template<class T, class A>
+    void exact(int beam, const char* name, const std::vector<T, A>& a, const std::vector<T, A>& b)
+    {
+        if(stop) return;
+        const size_t n = a.size();
+        size_t first = n, count = 0;
+        for(size_t i = 0; i < n; ++i)
+        {
+            if(a[i] == b[i]) continue;
+            if(first == n) first = i;
+            ++count;
+            if(mode == DiffMode::FirstDifference) break;
+        }
+        if(first == n) return;
+        add(beam, static_cast<int>(first), count, name, fmtValue(a[first]), fmtValue(b[first]));
+    }
+
+    template<class T> static std::string fmtValue(const T& v) { return fmt(v); }
+    static std::string fmtValue(uint16_t v) { return fmt(int(v)); }
+
+    const DiffTolerances& tol;
+    DiffMode mode;
+    PlanDiff& out;
+    bool stop = false;
+};
+
+void Differ::plan(const Plan& a, const Plan& b)
+{
+    field(-1, "PatientName", a.patientName, b.patientName);
+    field(-1, "PatientID", a.patientId, b.patientId);
+    field(-1, "FrameOfReferenceUID", a.frameOfReferenceUid, b.frameOfReferenceUid);
+    if(tol.compareIdentity)
+    {
+        field(-1, "StudyInstanceUID", a.studyInstanceUid, b.studyInstanceUid);
+        field(-1, "SeriesInstanceUID", a.seriesInstanceUid, b.seriesInstanceUid);
+        field(-1, "SOPInstanceUID", a.sopInstanceUid, b.sopInstanceUid);
+        field(-1, "RTPlanDate", a.rtPlanDate, b.rtPlanDate);
+        field(-1, "RTPlanTime", a.rtPlanTime, b.rtPlanTime);
+    }
+    field(-1, "RTPlanLabel", a.rtPlanLabel, b.rtPlanLabel);
+    field(-1, "RTPlanName", a.rtPlanName, b.rtPlanName);
+    field(-1, "RTPlanDescription", a.rtPlanDescription, b.rtPlanDescription);
+    field(-1, "RTPlanGeometry", a.rtPlanGeometry, b.rtPlanGeometry);
+    field(-1, "ApprovalStatus", a.approvalStatus, b.approvalStatus);
+    field(-1, "PatientPosition", a.patientPosition, b.patientPosition);
+    field(-1, "ReferencedStructureSet", a.referencedStructSetSOPInstanceUid, b.referencedStructSetSOPInstanceUid);
+    field(-1, "FractionGroupNumber", a.fractionGroupNumber, b.fractionGroupNumber);
+    field(-1, "NumberOfFractionsPlanned", a.numFractionsPlanned, b.numFractionsPlanned);
+    field(-1, "PrimaryIsocenter", a.primaryIsocenterMm, b.primaryIsocenterMm, tol.positionMm);
+    field(-1, "TotalPlannedMeterset", a.totalPlannedMetersetMU, b.totalPlannedMetersetMU, tol.meterset);
+
+    // merge the two beam lists by beam number
+    auto order = [](const Plan& p){
+        std::vector<std::pair<int, const Beam*>> v;
+        v.reserve(p.beams().size());
+        for(const auto& beam : p.beams()) v.emplace_back(beam.beamNumber, &beam);
+        std::sort(v.begin(), v.end(), [](const auto& x, const auto& y){ return x.first < y.first; });
+        return v;
+    };
+    const auto ba = order(a), bb = order(b);
+
+    size_t i = 0, j = 0;
+    while(!stop && (i < ba.size() || j < bb.size()))
+    {
+        if(j == bb.size() || (i < ba.size() && ba[i].first < bb[j].first))
+            add(ba[i++].first, -1, 1, "Beam", "present", "<missing>");
+        else if(i == ba.size() || bb[j].first < ba[i].first)
+            add(bb[j++].first, -1, 1, "Beam", "<missing>", "present");
+        else
+            beam(*ba[i++].second, *bb[j++].second);
+    }
+}
+
+void Differ::beam(const Beam& a, const Beam& b)
+{
+    const int n = a.beamNumber;
+    field(n, "BeamName", a.beamName, b.beamName);
+    field(n, "BeamType", a.beamType, b.beamType);
+    field(n, "RadiationType", a.radiationType, b.radiationType);
+    field(n, "TreatmentDeliveryType", a.treatmentDeliveryType, b.treatmentDeliveryType);
+    field(n, "TreatmentMachineName", a.treatmentMachineName, b.treatmentMachineName);
+    field(n, "PrimaryDosimeterUnit", a.primaryDosimeterUnit, b.primaryDosimeterUnit);
+    field(n, "SourceAxisDistance", a.sourceAxisDistanceMm, b.sourceAxisDistanceMm, tol.positionMm);
+    field(n, "FinalCumulativeMetersetWeight", a.finalCumulativeMetersetWeight, b.finalCumulativeMetersetWeight, tol.weight);
+    field(n, "BeamMeterset", a.beamMetersetMU, b.beamMetersetMU, tol.meterset);
+    field(n, "BeamDose", a.beamDoseGy, b.beamDoseGy, tol.meterset);
+    field(n, "BeamDoseSpecificationPoint", a.beamDoseSpecPointMm, b.beamDoseSpecPointMm, tol.positionMm);
+    field(n, "NumberOfLeafJawPairs", a.leafPairs, b.leafPairs);
+
+    if(!stop && a.leafBoundariesMm.size() != b.leafBoundariesMm.size())
+        add(n, -1, 1, "LeafPositionBoundaries",
+            std::to_string(a.leafBoundariesMm.size()) + " values",
+            std::to_string(b.leafBoundariesMm.size()) + " values");
+    else if(!stop && !a.leafBoundariesMm.empty())
+    {
+        const size_t k = a.leafBoundariesMm.size();
+        const size_t first = firstOutside<Metric::Linear>(a.leafBoundariesMm.data(), b.leafBoundariesMm.data(), k, tol.positionMm);
+        if(first != k)
+            add(n, -1, 1, "LeafPositionBoundaries", fmt(a.leafBoundariesMm[first]), fmt(b.leafBoundariesMm[first]));
+    }
+
+    field(n, "NumberOfControlPoints", static_cast<int>(a.controlPoints().size()), static_cast<int>(b.controlPoints().size()));
+    if(!stop && a.controlPoints().size() == b.controlPoints().size())
+        controlPoints(n, a.controlPoints(), b.controlPoints());
+}
+
+void Differ::controlPoints(int beam, const ControlPointTable& a, const ControlPointTable& b)
+{
+    const size_t n = a.size();
+    if(n == 0) return;
+
+    exact(beam, "ControlPointIndex", a.cpIndex, b.cpIndex);
+    exact(beam, "PresentAttributes", a.flags, b.flags);
+    doubles<Metric::Linear>(beam, "CumulativeMetersetWeight", a.cumulativeMetersetWeight.data(), b.cumulativeMetersetWeight.data(), n, 1, tol.weight);
+
+    doubles<Metric::Angular>(beam, "GantryAngle", a.gantryAngleDeg.data(), b.gantryAngleDeg.data(), n, 1, tol.angleDeg);
+    exact(beam, "GantryRotationDirection", a.gantryRotationDirection, b.gantryRotationDirection);
+    doubles<Metric::Angular>(beam, "BeamLimitingDeviceAngle", a.collimatorAngleDeg.data(), b.collimatorAngleDeg.data(), n, 1, tol.angleDeg);
+    exact(beam, "BeamLimitingDeviceRotationDirection", a.collimatorRotationDirection, b.collimatorRotationDirection);
+    doubles<Metric::Angular>(beam, "PatientSupportAngle", a.couchAngleDeg.data(), b.couchAngleDeg.data(), n, 1, tol.angleDeg);
+    exact(beam, "PatientSupportRotationDirection", a.couchRotationDirection, b.couchRotationDirection);
+
+    doubles<Metric::Linear>(beam, "IsocenterPosition", a.isocenterMm.data()->data(), b.isocenterMm.data()->data(), 3 * n, 3, tol.positionMm);
+    doubles<Metric::Linear>(beam, "SourceToSurfaceDistance", a.ssdMm.data(), b.ssdMm.data(), n, 1, tol.positionMm);
+    doubles<Metric::Linear>(beam, "NominalBeamEnergy", a.nominalEnergyMV.data(), b.nominalEnergyMV.data(), n, 1, tol.meterset);
+    doubles<Metric::Linear>(beam, "DoseRateSet", a.doseRate.data(), b.doseRate.data(), n, 1, tol.meterset);
+
+    doubles<Metric::Linear>(beam, "JawX1", a.jawX1.data(), b.jawX1.data(), n, 1, tol.positionMm);
+    doubles<Metric::Linear>(beam, "JawX2", a.jawX2.data(), b.jawX2.data(), n, 1, tol.positionMm);
+    doubles<Metric::Linear>(beam, "JawY1", a.jawY1.data(), b.jawY1.data(), n, 1, tol.positionMm);
+    doubles<Metric::Linear>(beam, "JawY2", a.jawY2.data(), b.jawY2.data(), n, 1, tol.positionMm);
+
+    if(stop || a.leafPairs != b.leafPairs || a.leafPairs <= 0) return;
+
+    // leaf banks; CPs sharing the same pair of apertures are compared once
+    const size_t m = 2 * static_cast<size_t>(a.leafPairs);
+    size_t first = n, count = 0, leaf = 0;
+    uint32_t lastA = ControlPointTable::kNoAperture, lastB = ControlPointTable::kNoAperture;
+    bool lastDiffers = false;
+
+    for(size_t r = 0; r < n; ++r)
+    {
+        if(!a.has(r, ControlPointTable::HasMLC) || !b.has(r, ControlPointTable::HasMLC))
+            continue;   // presence differences are reported with the flags
+
+        const uint32_t ra = a.mlcRef[r], rb = b.mlcRef[r];
+        if(ra != lastA || rb != lastB)
+        {
+            const size_t k = firstOutside<Metric::Linear>(a.aperture(ra), b.aperture(rb), m, tol.leafMm);
+            lastDiffers = k != m;
+            lastA = ra;
+            lastB = rb;
+            if(lastDiffers && first == n) leaf = k;
+        }
+        if(!lastDiffers) continue;
+
+        if(first == n) first = r;
+        ++count;
+        if(mode == DiffMode::FirstDifference) break;
+    }
+
+    if(first != n)
+    {
+        // first differing leaf of the first differing CP, e.g. LeafJawPositions[B12]
+        const std::string name = std::string("LeafJawPositions[") + (leaf < m / 2 ? "A" : "B") +
+                                 std::to_string(leaf % (m / 2) + 1) + "]";
+        add(beam, static_cast<int>(first), count, name,
+            fmt(a.mlcRow(first)[leaf]), fmt(b.mlcRow(first)[leaf]));
+    }
+}
+
+}
+
+PlanDiff diffPlans(const Plan& a, const Plan& b, const DiffTolerances& tol, DiffMode mode)
+{
+    PlanDiff out;
+    Differ(tol, mode, out).plan(a, b);
+    return out;
+}
+
+void PlanDiff::print(std::ostream& os) const
+{
+    for(const auto& d : differences)
+    {
+        std::string where = "plan";
+        if(d.beamNumber >= 0 || d.controlPoint >= 0)
+            where = "beam " + std::to_string(d.beamNumber);
+        if(d.controlPoint >= 0)
+            where += " CP " + std::to_string(d.controlPoint);
+
+        os << "  " << std::left << std::setw(16) << where << std::setw(36) << d.field
+           << ": " << d.a << " vs " << d.b;
+        if(d.count > 1)
+            os << " (" << d.count << " CPs)";
+        os << "\n";
+    }
+}
@@ -0,0 +1,146 @@
+#include "PlanExport.h"
+
+namespace
+{
+
+void writeEnum(JsonWriter& out, std::string_view key, const char* v)
+{
+    out.key(key);
+    if(*v) out.value(v); else out.null();
+}
+
+void writeInterned(JsonWriter& out, std::string_view key, const InternedString& v)
+{
+    out.key(key);
+    if(v) out.value(*v); else out.null();
+}
+
+template<size_t N>
+void writeArray(JsonWriter& out, const std::array<double, N>& v)
+{
+    out.beginArray();
+    for(double d : v) out.value(d);
+    out.endArray();
+}
+
+void writeArray(JsonWriter& out, LeafSpan v)
+{
+    out.beginArray();
+    for(double d : v) out.value(d);
+    out.endArray();
+}
+
+void writeBeam(JsonWriter& out, const Beam& b)
+{
+    out.beginObject();
+    out.field("beamNumber", b.beamNumber);
+    out.field("beamName", b.beamName);
+    writeEnum(out, "beamType", toString(b.beamType));
+    writeEnum(out, "radiationType", toString(b.radiationType));
+    writeEnum(out, "treatmentDeliveryType", toString(b.treatmentDeliveryType));
+    writeInterned(out, "treatmentMachineName", b.treatmentMachineName);
+    writeInterned(out, "primaryDosimeterUnit", b.primaryDosimeterUnit);
+    out.field("sourceAxisDistanceMm", b.sourceAxisDistanceMm);
+    out.field("finalCumulativeMetersetWeight", b.finalCumulativeMetersetWeight);
+    out.field("numberOfControlPoints", b.numberOfControlPoints);
+    out.field("leafPairs", b.leafPairs);
+    out.field("beamMetersetMU", b.beamMetersetMU);
+    out.field("beamDoseGy", b.beamDoseGy);
+    out.key("beamDoseSpecPointMm");
+    writeArray(out, b.beamDoseSpecPointMm);
+    out.endObject();
+}
+
+void writePlan(JsonWriter& out, const Plan& p)
+{
+    out.beginObject();
+    out.field("record", "plan");
+    out.field("file", p.filePath);
+    out.field("patientName", p.patientName);
+    out.field("patientId", p.patientId);
+    out.field("studyInstanceUid", p.studyInstanceUid);
+    out.field("seriesInstanceUid", p.seriesInstanceUid);
+    out.field("sopInstanceUid", p.sopInstanceUid);
+    out.field("frameOfReferenceUid", p.frameOfReferenceUid);
+    out.field("rtPlanLabel", p.rtPlanLabel);
+    out.field("rtPlanName", p.rtPlanName);
+    out.field("rtPlanDescription", p.rtPlanDescription);
+    out.field("rtPlanGeometry", p.rtPlanGeometry);
+    out.field("approvalStatus", p.approvalStatus);
+    out.field("rtPlanDate", p.rtPlanDate);
+    out.field("rtPlanTime", p.rtPlanTime);
+    out.field("patientPosition", p.patientPosition);
+    out.field("referencedStructureSetSopInstanceUid", p.referencedStructSetSOPInstanceUid);
+    out.field("fractionGroupNumber", p.fractionGroupNumber);
+    out.field("numberOfFractionsPlanned", p.numFractionsPlanned);
+    out.key("primaryIsocenterMm");
+    if(p.primaryIsocenterMm) writeArray(out, *p.primaryIsocenterMm); else out.null();
+    out.field("totalPlannedMetersetMU", p.totalPlannedMetersetMU);
+
+    out.key("beams");
+    out.beginArray();
+    for(const Beam& b : p.beams())
+        writeBeam(out, b);
+    out.endArray();
+
+    out.endObject();
+    out.newline();
+}
+
+void writeControlPoint(JsonWriter& out, const Plan& p, const Beam& b, const ControlPoint& cp)
+{
+    using T = ControlPointTable;
+    const T& t = *cp.table;
+    auto angle = [&](std::string_view key, double v, T::Flag f){
+        out.key(key);
+        if(t.has(cp.row, f)) out.value(v); else out.null();
+    };
+
+    out.beginObject();
+    out.field("record", "cp");
+    out.field("sopInstanceUid", p.sopInstanceUid);
+    out.field("beamNumber", b.beamNumber);
+    out.field("cpIndex", cp.cpIndex());
+    out.field("cumulativeMetersetWeight", cp.cumulativeMetersetWeight());
+    angle("gantryAngleDeg", cp.gantryAngleDeg(), T::HasGantry);
+    writeEnum(out, "gantryRotationDirection", toString(cp.gantryRotationDirection()));
+    angle("collimatorAngleDeg", cp.collimatorAngleDeg(), T::HasCollimator);
+    writeEnum(out, "collimatorRotationDirection", toString(cp.collimatorRotationDirection()));
+    angle("couchAngleDeg", cp.couchAngleDeg(), T::HasCouch);
+    writeEnum(out, "couchRotationDirection", toString(cp.couchRotationDirection()));
+
+    out.key("isocenterMm");
+    if(const auto iso = cp.isocenterMm()) writeArray(out, *iso); else out.null();
+    out.field("ssdMm", cp.ssdMm());
+    out.field("nominalEnergyMV", cp.nominalEnergyMV());
+    out.field("doseRate", cp.doseRate());
+
+    out.key("jawX");
+    if(const auto x = cp.jawX()) writeArray(out, *x); else out.null();
+    out.key("jawY");
+    if(const auto y = cp.jawY()) writeArray(out, *y); else out.null();
+
+    out.key("mlcA");
+    if(cp.hasMLC()) writeArray(out, cp.mlcA()); else out.null();
+    out.key("mlcB");
+    if(cp.hasMLC()) writeArray(out, cp.mlcB()); else out.null();
+
+    out.endObject();
+    out.newline();
+}
+
+}
+
+size_t writePlanNdjson(const Plan& plan, JsonWriter& out, const ExportOptions& opts)
+{
+    writePlan(out, plan);
+    size_t records = 1;
+
+    if(opts.controlPoints)
+        plan.forEachControlPoint([&](const Beam& beam, const ControlPoint& cp){
+            writeControlPoint(out, plan, beam, cp);
+            ++records;
+            return true;
+        });
+    return records;
+}
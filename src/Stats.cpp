@@ -0,0 +1,211 @@
+#include "Stats.h"
+
+#ifdef DICOM_READER_STATS
+
+#include <algorithm>
+#include <array>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+namespace stats
+{
+
+namespace
+{
+
+constexpr size_t kPhases = static_cast<size_t>(Phase::Count);
+constexpr size_t kCounters = static_cast<size_t>(Counter::Count);
+
+const char* const kPhaseNames[kPhases] = {
+    "file", "scan", "loadFile", "patientInfo", "plan", "beam", "controlPoints",
+    "cacheLoad", "cacheStore", "report",
+};
+const char* const kCounterNames[kCounters] = {
+    "files", "bytes", "plans", "beams", "controlPoints",
+};
+
+// Values below 16 ns have a bucket each; above, every power of two is
+// split into 16 equal steps.
+struct Histogram
+{
+    static constexpr size_t kBuckets = 61 * 16;
+
+    std::array<uint64_t, kBuckets> counts{};
+    uint64_t n = 0;
+    uint64_t totalNs = 0;
+    uint64_t maxNs = 0;
+
+    static size_t bucket(uint64_t ns)
+    {
+        if(ns < 16) return static_cast<size_t>(ns);
+        const unsigned e = 63u - static_cast<unsigned>(__builtin_clzll(ns));
+        return (e - 3) * 16 + ((ns >> (e - 4)) & 15);
+    }
+    static uint64_t lowerBound(size_t b)
+    {
+        if(b < 16) return b;
+        const unsigned e = static_cast<unsigned>(b / 16 + 3);
+        return (16 + b % 16) << (e - 4);
+    }
+    static uint64_t width(size_t b)
+    {
+        return b < 16 ? 1 : uint64_t(1) << (b / 16 - 1);
+    }
+
+    void add(uint64_t ns)
+    {
+        ++counts[bucket(ns)];
+        ++n;
+        totalNs += ns;
+        maxNs = std::max(maxNs, ns);
+    }
+
+    void merge(const Histogram& o)
+    {
+        for(size_t i = 0; i < kBuckets; ++i)
+            counts[i] += o.counts[i];
+        n += o.n;
+        totalNs += o.totalNs;
+        maxNs = std::max(maxNs, o.maxNs);
+    }
+
+    // midpoint of the bucket holding the p-quantile, capped at the maximum
+    uint64_t percentile(double p) const
+    {
+        if(n == 0) return 0;
+        const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(p * double(n) + 0.5));
+        uint64_t seen = 0;
+        for(size_t i = 0; i < kBuckets; ++i)
+        {
+            seen += counts[i];
+            if(seen >= rank)
+                return std::min(maxNs, lowerBound(i) + width(i) / 2);
+        }
+        return maxNs;
+    }
+};
+
+struct ThreadData
+{
+    std::array<Histogram, kPhases> phases;
+    std::array<uint64_t, kCounters> counters{};
+};
+
+// Threads register once; the registry keeps their data past thread exit
+// (pool workers are gone by the time the report is written).
+std::mutex registryMutex;
+std::vector<std::shared_ptr<ThreadData>> registry;
+
+ThreadData& local()
+{
+    thread_local const std::shared_ptr<ThreadData> data = []{
+        auto d = std::make_shared<ThreadData>();
+        std::lock_guard<std::mutex> lock(registryMutex);
+        registry.push_back(d);
+        return d;
+    }();
+    return *data;
+}
+
+double ms(uint64_t ns)
+{
+    return double(ns) / 1e6;
+}
+
+}
+
+namespace detail
+{
+
+bool enabled = false;
+
+void record(Phase phase, uint64_t ns)
+{
+    local().phases[static_cast<size_t>(phase)].add(ns);
+}
+
+void add(Counter counter, uint64_t n)
+{
+    local().counters[static_cast<size_t>(counter)] += n;
+}
+
+}
+
+void enable()
+{
+    detail::enabled = true;
+}
+
+void report(std::ostream& os, Format format, double wallSeconds)
+{
+    const auto sum = std::make_unique<ThreadData>();   // ~80 KB: not on the stack
+    ThreadData& total = *sum;
+    size_t threads = 0;
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        threads = registry.size();
+        for(const auto& d : registry)
+        {
+            for(size_t i = 0; i < kPhases; ++i)
+                total.phases[i].merge(d->phases[i]);
+            for(size_t i = 0; i < kCounters; ++i)
+                total.counters[i] += d->counters[i];
+        }
+    }
+
+    auto count = [&](Counter c){ return total.counters[static_cast<size_t>(c)]; };
+    auto rate = [&](uint64_t n){ return wallSeconds > 0.0 ? double(n) / wallSeconds : 0.0; };
+
+    if(format == Format::Json)
+    {
+        os << "{\"wallSeconds\":" << wallSeconds << ",\"threads\":" << threads << ",\"counters\":{";
+        for(size_t i = 0; i < kCounters; ++i)
+            os << (i ? "," : "") << '"' << kCounterNames[i] << "\":" << total.counters[i];
+        os << "},\"filesPerSecond\":" << rate(count(Counter::Files))
+           << ",\"controlPointsPerSecond\":" << rate(count(Counter::ControlPoints))
+           << ",\"megabytesPerSecond\":" << rate(count(Counter::Bytes)) / 1e6 << ",\"phases\":{";
+        bool first = true;
+        for(size_t i = 0; i < kPhases; ++i)
+        {
+            const Histogram& h = total.phases[i];
+            if(h.n == 0) continue;
+            os << (first ? "" : ",") << '"' << kPhaseNames[i] << "\":{\"count\":" << h.n
+               << ",\"totalMs\":" << ms(h.totalNs) << ",\"p50Ms\":" << ms(h.percentile(0.50))
+               << ",\"p95Ms\":" << ms(h.percentile(0.95)) << ",\"p99Ms\":" << ms(h.percentile(0.99))
+               << ",\"maxMs\":" << ms(h.maxNs) << '}';
+            first = false;
+        }
+        os << "}}\n";
+        return;
+    }
+
+    const auto flags = os.flags();
+    const auto precision = os.precision();
+    os << "Stats           : " << count(Counter::Files) << " files, " << count(Counter::Bytes) / 1e6
+       << " MB in " << wallSeconds << " s on " << threads << " threads: "
+       << rate(count(Counter::Files)) << " files/s, " << rate(count(Counter::ControlPoints)) << " CPs/s, "
+       << rate(count(Counter::Bytes)) / 1e6 << " MB/s\n"
+       << "  " << count(Counter::Plans) << " plans, " << count(Counter::Beams) << " beams, "
+       << count(Counter::ControlPoints) << " control points\n";
+
+    os << std::fixed << std::setprecision(3);
+    os << "  phase               count    total ms     p50 ms     p95 ms     p99 ms     max ms\n";
+    for(size_t i = 0; i < kPhases; ++i)
+    {
+        const Histogram& h = total.phases[i];
+        if(h.n == 0) continue;
+        os << "  " << std::left << std::setw(14) << kPhaseNames[i] << std::right
+           << std::setw(11) << h.n << std::setw(12) << ms(h.totalNs)
+           << std::setw(11) << ms(h.percentile(0.50)) << std::setw(11) << ms(h.percentile(0.95))
+           << std::setw(11) << ms(h.percentile(0.99)) << std::setw(11) << ms(h.maxNs) << "\n";
+    }
+    os.flags(flags);
+    os.precision(precision);
+}
+
+}
+
+#endif
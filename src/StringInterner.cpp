@@ -0,0 +1,32 @@
+#include "StringInterner.h"
+
+#include <mutex>
+
+StringInterner& StringInterner::global()
+{
+    static StringInterner instance;
+    return instance;
+}
+
+const std::string* StringInterner::intern(std::string_view s)
+{
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        auto it = index.find(s);
+        if(it != index.end()) return it->second;
+    }
+
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    auto it = index.find(s);        // another thread may have won the race
+    if(it != index.end()) return it->second;
+
+    const std::string* p = &strings.emplace_back(s);
+    index.emplace(*p, p);
+    return p;
+}
+
+size_t StringInterner::size() const
+{
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    return strings.size();
+}
@@ -0,0 +1,465 @@
+#include "dicom/TagScanner.h"
+
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace dicom
+{
+
+// ---- MappedFile ----
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+MappedFile::MappedFile(MappedFile&& o) noexcept
+    : base(o.base), length(o.length)
+{
+    o.base = nullptr;
+    o.length = 0;
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& o) noexcept
+{
+    if(this != &o)
+    {
+        close();
+        base = o.base;
+        length = o.length;
+        o.base = nullptr;
+        o.length = 0;
+    }
+    return *this;
+}
+
+bool MappedFile::open(const std::string& path)
+{
+    close();
+
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return false;
+
+    struct stat st;
+    if(::fstat(fd, &st) != 0 || st.st_size <= 0)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    void* p = ::mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if(p == MAP_FAILED) return false;
+
+    base = static_cast<const unsigned char*>(p);
+    length = static_cast<size_t>(st.st_size);
+    return true;
+}
+
+void MappedFile::close()
+{
+    if(base)
+        ::munmap(const_cast<unsigned char*>(base), length);
+    base = nullptr;
+    length = 0;
+}
+
+// ---- scanner ----
+
+namespace
+{
+
+constexpr uint32_t kUndefinedLength = 0xFFFFFFFFu;
+constexpr int kMaxNesting = 32;
+
+constexpr uint32_t tagOf(uint16_t g, uint16_t e) { return (uint32_t(g) << 16) | e; }
+
+constexpr uint32_t kItem          = tagOf(0xFFFE, 0xE000);
+constexpr uint32_t kItemDelim     = tagOf(0xFFFE, 0xE00D);
+constexpr uint32_t kSeqDelim      = tagOf(0xFFFE, 0xE0DD);
+constexpr uint32_t kTransferSyntax = tagOf(0x0002, 0x0010);
+
+// DCMTK removes leading and trailing spaces for UI/CS/LO, trailing only for PN
+enum class Trim { Both, Trailing };
+
+struct Wanted
+{
+    uint32_t tag;
+    ScanTag slot;
+    Trim trim;
+};
+
+constexpr Wanted kWanted[] = {
+    { tagOf(0x0008, 0x0016), ScanTag::SOPClassUID,         Trim::Both },
+    { tagOf(0x0008, 0x0018), ScanTag::SOPInstanceUID,      Trim::Both },
+    { tagOf(0x0008, 0x0060), ScanTag::Modality,            Trim::Both },
+    { tagOf(0x0010, 0x0010), ScanTag::PatientName,         Trim::Trailing },
+    { tagOf(0x0010, 0x0020), ScanTag::PatientID,           Trim::Both },
+    { tagOf(0x0020, 0x000D), ScanTag::StudyInstanceUID,    Trim::Both },
+    { tagOf(0x0020, 0x000E), ScanTag::SeriesInstanceUID,   Trim::Both },
+    { tagOf(0x0020, 0x0052), ScanTag::FrameOfReferenceUID, Trim::Both },
+};
+constexpr size_t kWantedCount = sizeof(kWanted) / sizeof(kWanted[0]);
+constexpr uint32_t kLastWanted = kWanted[kWantedCount - 1].tag;
+
+inline uint16_t rd16(const unsigned char* p) { return uint16_t(p[0] | (p[1] << 8)); }
+inline uint32_t rd32(const unsigned char* p)
+{
+    return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+// Explicit VRs that use 2 reserved bytes + a 32-bit length
+bool hasLongLength(const unsigned char* vr)
+{
+    const char a = char(vr[0]), b = char(vr[1]);
+    switch(a)
+    {
+    case 'O': return b == 'B' || b == 'D' || b == 'F' || b == 'L' || b == 'V' || b == 'W';
+    case 'S': return b == 'Q' || b == 'V';
+    case 'U': return b == 'C' || b == 'N' || b == 'R' || b == 'T' || b == 'V';
+    default:  return false;
+    }
+}
+
+struct Cursor
+{
+    const unsigned char* p;
+    const unsigned char* end;
+
+    size_t left() const { return size_t(end - p); }
+};
+
+struct Element
+{
+    uint32_t tag = 0;
+    uint32_t length = 0;
+    bool explicitSQ = false;
+    bool explicitUN = false;
+};
+
+// Reads a tag/VR/length header and leaves the cursor at the value.
+bool readHeader(Cursor& c, bool explicitVr, Element& el)
+{
+    if(c.left() < 8) return false;
+
+    const uint16_t group = rd16(c.p);
+    el.tag = tagOf(group, rd16(c.p + 2));
+    el.explicitSQ = false;
+    el.explicitUN = false;
+
+    // item and delimitation tags never carry a VR
+    if(!explicitVr || group == 0xFFFE)
+    {
+        el.length = rd32(c.p + 4);
+        c.p += 8;
+        return true;
+    }
+
+    const unsigned char* vr = c.p + 4;
+    if(vr[0] < 'A' || vr[0] > 'Z' || vr[1] < 'A' || vr[1] > 'Z')
+        return false;
+
+    if(hasLongLength(vr))
+    {
+        if(c.left() < 12) return false;
+        el.length = rd32(c.p + 8);
+        c.p += 12;
+    }
+    else
+    {
+        el.length = rd16(c.p + 6);
+        c.p += 8;
+    }
+    el.explicitSQ = vr[0] == 'S' && vr[1] == 'Q';
+    el.explicitUN = vr[0] == 'U' && vr[1] == 'N';
+    return true;
+}
+
+bool skipValue(Cursor& c, const Element& el, bool explicitVr, int depth);
+
+// Skips the items of a sequence: up to its delimiter when `stop` is null
+// (undefined length), up to `stop` otherwise. Counts them into `items`.
+bool skipItems(Cursor& c, bool explicitVr, int depth, const unsigned char* stop = nullptr, size_t* items = nullptr)
+{
+    if(depth > kMaxNesting) return false;
+
+    while(!stop || c.p < stop)
+    {
+        Element item;
+        if(!readHeader(c, false, item)) return false;
+        if(item.tag == kSeqDelim && !stop) return true;
+        if(item.tag != kItem) return false;
+        if(items) ++*items;
+
+        if(item.length != kUndefinedLength)
+        {
+            if(item.length > c.left()) return false;
+            c.p += item.length;
+            continue;
+        }
+
+        for(;;)
+        {
+            Element el;
+            if(!readHeader(c, explicitVr, el)) return false;
+            if(el.tag == kItemDelim) break;
+            if(!skipValue(c, el, explicitVr, depth + 1)) return false;
+        }
+    }
+    return c.p == stop;
+}
+
+bool skipValue(Cursor& c, const Element& el, bool explicitVr, int depth)
+{
+    if(el.length == kUndefinedLength)
+    {
+        // content of an undefined-length UN is implicit VR little endian
+        return skipItems(c, explicitVr && !el.explicitUN, depth);
+    }
+    if(el.length > c.left()) return false;
+    c.p += el.length;
+    return true;
+}
+
+std::string_view firstValue(const unsigned char* p, size_t n, Trim trim)
+{
+    std::string_view v(reinterpret_cast<const char*>(p), n);
+
+    const size_t bs = v.find('\\');
+    if(bs != std::string_view::npos) v = v.substr(0, bs);
+
+    while(!v.empty() && (v.back() == ' ' || v.back() == '\0')) v.remove_suffix(1);
+    if(trim == Trim::Both)
+        while(!v.empty() && v.front() == ' ') v.remove_prefix(1);
+    return v;
+}
+
+// Leaves the cursor at the first dataset element, past the file meta
+// information. False for anything but a little endian, non-deflated file.
+bool openDataset(const MappedFile& file, Cursor& c, bool& explicitVr)
+{
+    if(file.size() < 132 || std::memcmp(file.data() + 128, "DICM", 4) != 0)
+        return false;
+
+    c = Cursor{ file.data() + 132, file.data() + file.size() };
+
+    // File meta information: always explicit VR little endian
+    std::string_view transferSyntax;
+    while(c.left() >= 8 && rd16(c.p) == 0x0002)
+    {
+        Element el;
+        if(!readHeader(c, true, el)) return false;
+        if(el.length == kUndefinedLength || el.length > c.left()) return false;
+
+        if(el.tag == kTransferSyntax)
+            transferSyntax = firstValue(c.p, el.length, Trim::Both);
+        c.p += el.length;
+    }
+
+    explicitVr = true;
+    if(transferSyntax == "1.2.840.10008.1.2")
+        explicitVr = false;
+    else if(transferSyntax.empty() ||
+            transferSyntax == "1.2.840.10008.1.2.2" ||      // big endian
+            transferSyntax == "1.2.840.10008.1.2.1.99")     // deflated
+        return false;
+    // everything else (explicit LE, encapsulated pixel syntaxes) has an explicit LE dataset
+    return true;
+}
+
+// Walks the elements from the cursor to its end; see locateSequence()
+bool findSequence(Cursor& c, const unsigned char* base, bool explicitVr, uint32_t tag, ElementRange& out)
+{
+    while(c.left() >= 8)
+    {
+        const unsigned char* begin = c.p;
+        Element el;
+        if(!readHeader(c, explicitVr, el)) return false;
+        if(el.tag > tag || el.tag == kItemDelim) return true;
+
+        if(el.tag < tag)
+        {
+            if(!skipValue(c, el, explicitVr, 0)) return false;
+            continue;
+        }
+
+        if(el.length != kUndefinedLength && el.length > c.left()) return false;
+        const unsigned char* first = c.p;
+        const unsigned char* stop = el.length == kUndefinedLength ? nullptr : c.p + el.length;
+        // content of a UN sequence is implicit VR little endian
+        const bool itemsExplicit = explicitVr && !el.explicitUN;
+        if(!skipItems(c, itemsExplicit, 0, stop, &out.items)) return false;
+
+        out.begin = size_t(begin - base);
+        out.first = size_t(first - base);
+        out.end = size_t(c.p - base);
+        out.explicitVr = itemsExplicit;
+        out.found = true;
+        return true;
+    }
+    return true;
+}
+
+}
+
+bool scanTags(const MappedFile& file, TagScan& out)
+{
+    out = TagScan{};
+
+    Cursor c{};
+    bool explicitVr = true;
+    if(!openDataset(file, c, explicitVr))
+        return false;
+
+    size_t next = 0;
+    while(c.left() >= 8)
+    {
+        Element el;
+        if(!readHeader(c, explicitVr, el)) return false;
+        if(el.tag > kLastWanted) return true;
+
+        while(next < kWantedCount && kWanted[next].tag < el.tag) ++next;
+
+        if(next < kWantedCount && kWanted[next].tag == el.tag)
+        {
+            if(el.length == kUndefinedLength || el.length > c.left()) return false;
+
+            const auto slot = static_cast<size_t>(kWanted[next].slot);
+            out.values[slot] = firstValue(c.p, el.length, kWanted[next].trim);
+            out.present[slot] = true;
+            c.p += el.length;
+            continue;
+        }
+
+        if(!skipValue(c, el, explicitVr, 0)) return false;
+    }
+    return true;
+}
+
+bool locateSequence(const MappedFile& file, uint32_t tag, ElementRange& out)
+{
+    out = ElementRange{};
+
+    Cursor c{};
+    bool explicitVr = true;
+    return openDataset(file, c, explicitVr) && findSequence(c, file.data(), explicitVr, tag, out);
+}
+
+bool locateSequence(const MappedFile& file, size_t begin, size_t end, bool explicitVr,
+                    uint32_t tag, ElementRange& out)
+{
+    out = ElementRange{};
+    if(begin > end || end > file.size()) return false;
+
+    Cursor c{ file.data() + begin, file.data() + end };
+    return findSequence(c, file.data(), explicitVr, tag, out);
+}
+
+bool forEachItem(const MappedFile& file, const ElementRange& seq,
+                 const std::function<bool(size_t begin, size_t end)>& visit)
+{
+    if(!seq.found || seq.end > file.size()) return false;
+
+    Cursor c{ file.data() + seq.first, file.data() + seq.end };
+    while(c.p < c.end)
+    {
+        Element item;
+        if(!readHeader(c, false, item)) return false;
+        if(item.tag == kSeqDelim) return true;
+        if(item.tag != kItem) return false;
+
+        const unsigned char* content = c.p;
+        const unsigned char* contentEnd = nullptr;
+        if(item.length != kUndefinedLength)
+        {
+            if(item.length > c.left()) return false;
+            c.p += item.length;
+            contentEnd = c.p;
+        }
+        else
+        {
+            for(;;)
+            {
+                const unsigned char* at = c.p;
+                Element el;
+                if(!readHeader(c, seq.explicitVr, el)) return false;
+                if(el.tag == kItemDelim) { contentEnd = at; break; }
+                if(!skipValue(c, el, seq.explicitVr, 1)) return false;
+            }
+        }
+
+        if(!visit(size_t(content - file.data()), size_t(contentEnd - file.data())))
+            return true;
+    }
+    return true;
+}
+
+bool itemValue(const MappedFile& file, size_t begin, size_t end, bool explicitVr, uint32_t tag,
+               std::string_view& out)
+{
+    if(begin > end || end > file.size()) return false;
+
+    Cursor c{ file.data() + begin, file.data() + end };
+    while(c.left() >= 8)
+    {
+        Element el;
+        if(!readHeader(c, explicitVr, el) || el.tag > tag) return false;
+        if(el.tag < tag)
+        {
+            if(!skipValue(c, el, explicitVr, 0)) return false;
+            continue;
+        }
+        if(el.length == kUndefinedLength || el.length > c.left()) return false;
+        out = firstValue(c.p, el.length, Trim::Both);
+        return true;
+    }
+    return false;
+}
+
+bool firstItemValue(const MappedFile& file, std::initializer_list<uint32_t> path, uint32_t tag,
+                    std::string_view& out)
+{
+    Cursor c{};
+    bool explicitVr = true;
+    if(!openDataset(file, c, explicitVr))
+        return false;
+
+    // elements are in tag order within a level: stop at the first one past
+    const unsigned char* stop = c.end;
+    auto find = [&](uint32_t wanted, Element& el){
+        while(c.p < stop)
+        {
+            if(!readHeader(c, explicitVr, el) || el.tag == kItemDelim || el.tag > wanted) return false;
+            if(el.tag == wanted) return true;
+            if(!skipValue(c, el, explicitVr, 0)) return false;
+        }
+        return false;
+    };
+
+    Element el;
+    for(uint32_t seq : path)
+    {
+        if(!find(seq, el)) return false;
+        if(el.explicitUN) explicitVr = false;
+
+        Element item;
+        if(!readHeader(c, false, item) || item.tag != kItem) return false;
+        if(item.length == kUndefinedLength)
+            stop = c.end;
+        else if(item.length <= c.left())
+            stop = c.p + item.length;
+        else
+            return false;
+    }
+
+    if(!find(tag, el) || el.length == kUndefinedLength || el.length > c.left())
+        return false;
+    out = std::string_view(reinterpret_cast<const char*>(c.p), el.length);
+    return true;
+}
+
+}
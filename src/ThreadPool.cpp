@@ -0,0 +1,143 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+namespace
+{
+thread_local const ThreadPool* tlsPool = nullptr;
+thread_local unsigned tlsIndex = 0;
+}
+
+ThreadPool::ThreadPool(unsigned threads)
+{
+    if(threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    queues.reserve(threads);
+    for(unsigned i = 0; i < threads; ++i)
+        queues.push_back(std::make_unique<WorkQueue>());
+
+    workers.reserve(threads);
+    for(unsigned i = 0; i < threads; ++i)
+        workers.emplace_back([this, i]{ workerLoop(i); });
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lk(m);
+        stopping = true;
+    }
+    workCv.notify_all();
+
+    for(auto& t : workers)
+        t.join();
+}
+
+void ThreadPool::setMaxQueued(size_t n)
+{
+    {
+        std::lock_guard<std::mutex> lk(m);
+        maxQueued = n;
+    }
+    spaceCv.notify_all();
+}
+
+void ThreadPool::submit(Task task)
+{
+    const bool fromWorker = (tlsPool == this);
+    const unsigned q = fromWorker
+        ? tlsIndex
+        : nextQueue.fetch_add(1, std::memory_order_relaxed) % queues.size();
+
+    // reserve the slot first so a bounded submit cannot overshoot;
+    // workers never block here, or a full pool could deadlock
+    {
+        std::unique_lock<std::mutex> lk(m);
+        if(!fromWorker)
+            spaceCv.wait(lk, [&]{ return maxQueued == 0 || queued < maxQueued; });
+        ++queued;
+        ++pending;
+    }
+    {
+        std::lock_guard<std::mutex> lk(queues[q]->m);
+        queues[q]->tasks.push_back(std::move(task));
+    }
+    workCv.notify_one();
+}
+
+void ThreadPool::wait()
+{
+    std::unique_lock<std::mutex> lk(m);
+    doneCv.wait(lk, [&]{ return pending == 0; });
+
+    if(firstError)
+    {
+        auto e = firstError;
+        firstError = nullptr;
+        std::rethrow_exception(e);
+    }
+}
+
+bool ThreadPool::tryPop(unsigned self, Task& out)
+{
+    // own deque: newest first
+    {
+        auto& q = *queues[self];
+        std::lock_guard<std::mutex> lk(q.m);
+        if(!q.tasks.empty())
+        {
+            out = std::move(q.tasks.back());
+            q.tasks.pop_back();
+            return true;
+        }
+    }
+
+    // steal: oldest first, starting at the neighbour
+    const size_t n = queues.size();
+    for(size_t k = 1; k < n; ++k)
+    {
+        auto& q = *queues[(self + k) % n];
+        std::lock_guard<std::mutex> lk(q.m);
+        if(!q.tasks.empty())
+        {
+            out = std::move(q.tasks.front());
+            q.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::workerLoop(unsigned self)
+{
+    tlsPool = this;
+    tlsIndex = self;
+
+    for(;;)
+    {
+        Task task;
+        if(tryPop(self, task))
+        {
+            {
+                std::lock_guard<std::mutex> lk(m);
+                --queued;
+            }
+            spaceCv.notify_one();
+
+            std::exception_ptr err;
+            try { task(); }
+            catch(...) { err = std::current_exception(); }
+
+            std::lock_guard<std::mutex> lk(m);
+            if(err && !firstError) firstError = err;
+            if(--pending == 0) doneCv.notify_all();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lk(m);
+        workCv.wait(lk, [&]{ return stopping || queued > 0; });
+        if(stopping && queued == 0)
+            return;
+    }
+}
@@ -0,0 +1,348 @@
+#include "UidIndex.h"
+
+#include <fstream>
+
+#include <dcmtk/dcmdata/dcuid.h>
+#include <unistd.h>
+
+#include "BinaryIO.h"
+#include "dicom/DicomUtils.h"
+#include "dicom/TagScanner.h"
+
+namespace fs = std::filesystem;
+
+namespace
+{
+
+constexpr uint32_t kMagic = 0x58444955;   // "UIDX" on disk for little endian hosts
+
+// Stop just past the reference sequences; both precede the bulk data
+// (StructureSetROISequence, ROIContourSequence, PixelData).
+const DcmTagKey kStructRefsEnd(0x3006, 0x0011);
+const DcmTagKey kDoseRefsEnd(0x300C, 0x0061);
+
+void referencedSops(DcmItem* it, const DcmTagKey& seqKey, std::vector<std::string>& out)
+{
+    DcmSequenceOfItems* seq = dicom::getSequence(it, seqKey);
+    if(!seq) return;
+
+    std::string uid;
+    for(unsigned long i = 0; i < seq->card(); ++i)
+        if(dicom::getString(seq->getItem(i), DCM_ReferencedSOPInstanceUID, uid) && !uid.empty())
+            out.push_back(uid);
+}
+
+// ReferencedFrameOfReferenceSequence > RTReferencedStudySequence >
+// RTReferencedSeriesSequence > SeriesInstanceUID
+void referencedSeries(DcmItem* ds, std::vector<std::string>& out)
+{
+    DcmSequenceOfItems* frames = dicom::getSequence(ds, DCM_ReferencedFrameOfReferenceSequence);
+    if(!frames) return;
+
+    std::string uid;
+    for(unsigned long f = 0; f < frames->card(); ++f)
+    {
+        DcmSequenceOfItems* studies = dicom::getSequence(frames->getItem(f), DCM_RTReferencedStudySequence);
+        for(unsigned long s = 0; studies && s < studies->card(); ++s)
+        {
+            DcmSequenceOfItems* series = dicom::getSequence(studies->getItem(s), DCM_RTReferencedSeriesSequence);
+            for(unsigned long i = 0; series && i < series->card(); ++i)
+                if(dicom::getString(series->getItem(i), DCM_SeriesInstanceUID, uid) && !uid.empty())
+                    out.push_back(uid);
+        }
+    }
+}
+
+}
+
+bool isImageModality(std::string_view modality)
+{
+    return !modality.empty() && modality.substr(0, 2) != "RT" &&
+           modality != "REG" && modality != "SEG" && modality != "SR" &&
+           modality != "KO" && modality != "PR";
+}
+
+void fillIndexRecord(DcmItem* ds, IndexedFile& f)
+{
+    dicom::getString(ds, DCM_SOPClassUID, f.sopClassUid);
+    dicom::getString(ds, DCM_SOPInstanceUID, f.sopInstanceUid);
+    dicom::getString(ds, DCM_Modality, f.modality);
+    dicom::getString(ds, DCM_PatientID, f.patientId);
+    dicom::getString(ds, DCM_StudyInstanceUID, f.studyInstanceUid);
+    dicom::getString(ds, DCM_SeriesInstanceUID, f.seriesInstanceUid);
+    dicom::getString(ds, DCM_FrameOfReferenceUID, f.frameOfReferenceUid);
+}
+
+bool readIndexReferences(const fs::path& path, IndexedFile& f)
+{
+    const bool structureSet = f.sopClassUid == UID_RTStructureSetStorage;
+    const bool dose = f.sopClassUid == UID_RTDoseStorage;
+    if(!structureSet && !dose) return true;
+
+    DcmFileFormat ff;
+    if(ff.loadFileUntilTag(path.string().c_str(), EXS_Unknown, EGL_noChange, DCM_MaxReadLength,
+                           ERM_autoDetect, structureSet ? kStructRefsEnd : kDoseRefsEnd).bad())
+        return false;
+
+    DcmDataset* ds = ff.getDataset();
+    if(structureSet)
+        referencedSeries(ds, f.referencedSeriesUids);
+    else
+    {
+        referencedSops(ds, DCM_ReferencedRTPlanSequence, f.referencedSopInstanceUids);
+        referencedSops(ds, DCM_ReferencedStructureSetSequence, f.referencedSopInstanceUids);
+    }
+    return true;
+}
+
+UidIndex::UidIndex()
+{
+    clear();
+}
+
+void UidIndex::clear()
+{
+    strings.clear();
+    ids.clear();
+    entries.clear();
+    refs.clear();
+    sopInstances.clear();
+    series.clear();
+    studies.clear();
+    frames.clear();
+    referencedBy.clear();
+
+    intern({});     // id 0: the empty string
+}
+
+uint32_t UidIndex::intern(std::string_view s)
+{
+    auto it = ids.find(s);
+    if(it != ids.end()) return it->second;
+
+    const uint32_t id = static_cast<uint32_t>(strings.size());
+    strings.emplace_back(s);
+    ids.emplace(strings.back(), id);
+    return id;
+}
+
+uint32_t UidIndex::find(std::string_view s) const
+{
+    auto it = ids.find(s);
+    return it == ids.end() ? kNoString : it->second;
+}
+
+bool UidIndex::add(const IndexedFile& f)
+{
+    if(f.sopInstanceUid.empty() || bySopInstance(f.sopInstanceUid) != kNone)
+        return false;
+
+    const fs::path p(f.path);
+
+    Entry e;
+    e.dir = intern(p.parent_path().string());
+    e.name = intern(p.filename().string());
+    e.sopClass = intern(f.sopClassUid);
+    e.sopInstance = intern(f.sopInstanceUid);
+    e.modality = intern(f.modality);
+    e.patientId = intern(f.patientId);
+    e.study = intern(f.studyInstanceUid);
+    e.series = intern(f.seriesInstanceUid);
+    e.frameOfReference = intern(f.frameOfReferenceUid);
+    e.refBegin = static_cast<uint32_t>(refs.size());
+    e.sopRefCount = static_cast<uint32_t>(f.referencedSopInstanceUids.size());
+    e.seriesRefCount = static_cast<uint32_t>(f.referencedSeriesUids.size());
+
+    for(const auto& uid : f.referencedSopInstanceUids)
+        refs.push_back(intern(uid));
+    for(const auto& uid : f.referencedSeriesUids)
+        refs.push_back(intern(uid));
+
+    entries.push_back(e);
+    link(static_cast<FileId>(entries.size() - 1));
+    return true;
+}
+
+void UidIndex::link(FileId id)
+{
+    const Entry& e = entries[id];
+    sopInstances.emplace(e.sopInstance, id);
+    if(e.series) series[e.series].push_back(id);
+    if(e.study) studies[e.study].push_back(id);
+    if(e.frameOfReference) frames[e.frameOfReference].push_back(id);
+
+    for(uint32_t i = 0; i < e.sopRefCount + e.seriesRefCount; ++i)
+        referencedBy[refs[e.refBegin + i]].push_back(id);
+}
+
+IndexedFile UidIndex::file(FileId id) const
+{
+    const Entry& e = entries[id];
+
+    IndexedFile f;
+    f.path = path(id);
+    f.sopClassUid = str(e.sopClass);
+    f.sopInstanceUid = str(e.sopInstance);
+    f.modality = str(e.modality);
+    f.patientId = str(e.patientId);
+    f.studyInstanceUid = str(e.study);
+    f.seriesInstanceUid = str(e.series);
+    f.frameOfReferenceUid = str(e.frameOfReference);
+    for(uint32_t i = 0; i < e.sopRefCount; ++i)
+        f.referencedSopInstanceUids.emplace_back(str(refs[e.refBegin + i]));
+    for(uint32_t i = 0; i < e.seriesRefCount; ++i)
+        f.referencedSeriesUids.emplace_back(str(refs[e.refBegin + e.sopRefCount + i]));
+    return f;
+}
+
+std::string UidIndex::path(FileId id) const
+{
+    const Entry& e = entries[id];
+    return (fs::path(str(e.dir)) / str(e.name)).string();
+}
+
+UidIndex::FileId UidIndex::bySopInstance(std::string_view uid) const
+{
+    const uint32_t s = find(uid);
+    if(s == kNoString) return kNone;
+
+    auto it = sopInstances.find(s);
+    return it == sopInstances.end() ? kNone : it->second;
+}
+
+const std::vector<UidIndex::FileId>& UidIndex::lookup(const MultiMap& m, std::string_view uid) const
+{
+    static const std::vector<FileId> kEmpty;
+
+    const uint32_t s = find(uid);
+    if(s == kNoString || s == 0) return kEmpty;
+
+    auto it = m.find(s);
+    return it == m.end() ? kEmpty : it->second;
+}
+
+UidIndex::PlanLinks UidIndex::resolvePlan(FileId plan) const
+{
+    PlanLinks l;
+    if(plan >= entries.size()) return l;
+    l.plan = plan;
+
+    const Entry& e = entries[plan];
+    for(uint32_t i = 0; i < e.sopRefCount && l.structureSet == kNone; ++i)
+    {
+        const FileId f = bySopInstance(str(refs[e.refBegin + i]));
+        if(f != kNone && sopClassUid(f) == UID_RTStructureSetStorage)
+            l.structureSet = f;
+    }
+
+    if(l.structureSet != kNone)
+    {
+        const Entry& s = entries[l.structureSet];
+        for(uint32_t i = 0; i < s.seriesRefCount; ++i)
+            for(FileId f : bySeries(str(refs[s.refBegin + s.sopRefCount + i])))
+                if(isImageModality(modality(f)))
+                    l.images.push_back(f);
+    }
+
+    // older or hand-made structure sets carry no series reference
+    if(l.images.empty() && e.frameOfReference)
+    {
+        for(FileId f : byFrameOfReference(str(e.frameOfReference)))
+            if(isImageModality(modality(f)))
+                l.images.push_back(f);
+        l.imagesByFrameOfReference = !l.images.empty();
+    }
+
+    for(FileId f : referencing(str(e.sopInstance)))
+        if(sopClassUid(f) == UID_RTDoseStorage)
+            l.doses.push_back(f);
+    return l;
+}
+
+bool UidIndex::save(const fs::path& file) const
+{
+    BinaryWriter w;
+    w.pod(kMagic);
+    w.pod(kFormatVersion);
+    w.pod(static_cast<uint64_t>(strings.size()));
+    for(const auto& s : strings)
+        w.str(s);
+    w.vec(entries);
+    w.vec(refs);
+
+    fs::path tmp = file;
+    tmp += ".tmp." + std::to_string(::getpid());
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        out.write(w.buffer().data(), static_cast<std::streamsize>(w.buffer().size()));
+        if(!out)
+        {
+            std::error_code ec;
+            fs::remove(tmp, ec);
+            return false;
+        }
+    }
+
+    std::error_code ec;
+    fs::rename(tmp, file, ec);
+    if(ec)
+    {
+        fs::remove(tmp, ec);
+        return false;
+    }
+    return true;
+}
+
+bool UidIndex::load(const fs::path& file)
+{
+    clear();
+
+    dicom::MappedFile mf;
+    if(!mf.open(file.string())) return false;
+
+    BinaryReader r(mf.data(), mf.size());
+
+    uint32_t magic = 0, version = 0;
+    uint64_t count = 0;
+    if(!r.pod(magic) || magic != kMagic ||
+       !r.pod(version) || version != kFormatVersion ||
+       !r.pod(count) || count == 0 || count > r.remaining())
+        return false;
+
+    // entry 0 is the empty string, already interned by clear()
+    std::string_view s;
+    if(!r.view(s) || !s.empty()) return false;
+    for(uint64_t i = 1; i < count; ++i)
+    {
+        if(!r.view(s)) { clear(); return false; }
+        strings.emplace_back(s);
+        ids.emplace(strings.back(), static_cast<uint32_t>(i));
+    }
+
+    if(!r.vec(entries) || !r.vec(refs) || ids.size() != count)
+    {
+        clear();
+        return false;
+    }
+
+    // every id must resolve before anything is linked
+    auto valid = [&](uint32_t id){ return id < count; };
+    for(const Entry& e : entries)
+    {
+        const uint64_t refEnd = uint64_t(e.refBegin) + e.sopRefCount + e.seriesRefCount;
+        if(!valid(e.dir) || !valid(e.name) || !valid(e.sopClass) || !valid(e.sopInstance) ||
+           !valid(e.modality) || !valid(e.patientId) || !valid(e.study) || !valid(e.series) ||
+           !valid(e.frameOfReference) || refEnd > refs.size())
+        {
+            clear();
+            return false;
+        }
+    }
+    for(uint32_t id : refs)
+        if(!valid(id)) { clear(); return false; }
+
+    sopInstances.reserve(entries.size());
+    for(FileId id = 0; id < entries.size(); ++id)
+        link(id);
+    return true;
+}
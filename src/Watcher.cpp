@@ -0,0 +1,222 @@
+#include "Watcher.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+
+constexpr uint32_t kDirMask = IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO |
+                              IN_MOVED_FROM | IN_DELETE | IN_DELETE_SELF | IN_ONLYDIR;
+
+}
+
+Watcher::Watcher(fs::path root, CrawlOptions crawl, WatchOptions opts)
+    : root(std::move(root)), crawl(std::move(crawl)), opts(opts)
+{
+    fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(fd < 0)
+    {
+        err = std::strerror(errno);
+        return;
+    }
+
+    std::error_code ec;
+    if(!fs::is_directory(this->root, ec))
+    {
+        err = "not a directory";
+        ::close(fd);
+        fd = -1;
+        return;
+    }
+    addTree(this->root, 0, false);
+}
+
+Watcher::~Watcher()
+{
+    if(fd >= 0)
+        ::close(fd);
+}
+
+// Files are only reported for directories that appeared after the start:
+// they may have been filled before their watch existed.
+void Watcher::addTree(const fs::path& dir, int depth, bool reportFiles)
+{
+    const int wd = ::inotify_add_watch(fd, dir.c_str(), kDirMask);
+    if(wd < 0)
+    {
+        if(errno == ENOSPC)
+            err = "inotify watch limit reached (fs.inotify.max_user_watches)";
+        return;
+    }
+    // an existing wd means this inode is already watched (a directory
+    // link cycle): do not descend twice
+    if(!dirs.emplace(wd, std::make_pair(dir, depth)).second)
+        return;
+
+    std::error_code ec;
+    fs::directory_iterator it(dir, fs::directory_options::skip_permission_denied, ec);
+    for(const fs::directory_iterator end; !ec && it != end; it.increment(ec))
+    {
+        std::error_code sec;
+        const fs::directory_entry& entry = *it;
+        const bool isLink = entry.is_symlink(sec);
+        if(isLink && crawl.symlinks == SymlinkPolicy::None) continue;
+
+        if(entry.is_directory(sec))
+        {
+            if(isLink && crawl.symlinks != SymlinkPolicy::All) continue;
+            if(crawl.maxDepth >= 0 && depth >= crawl.maxDepth) continue;
+            if(crawlExcluded(crawl, entry.path().filename().string())) continue;
+            addTree(entry.path(), depth + 1, reportFiles);
+        }
+        else if(reportFiles && entry.is_regular_file(sec))
+        {
+            pending[entry.path()] = Clock::now();
+        }
+    }
+}
+
+// A directory moved away keeps its watches under the old path; drop the
+// whole subtree so a move back in is watched afresh.
+void Watcher::forget(const fs::path& dir)
+{
+    const std::string prefix = dir.string() + "/";
+    for(auto it = dirs.begin(); it != dirs.end(); )
+    {
+        const std::string p = it->second.first.string();
+        if(p == dir.string() || p.compare(0, prefix.size(), prefix) == 0)
+        {
+            ::inotify_rm_watch(fd, it->first);
+            it = dirs.erase(it);
+        }
+        else
+            ++it;
+    }
+
+    for(auto it = pending.lower_bound(dir); it != pending.end(); )
+    {
+        if(it->first.string().compare(0, prefix.size(), prefix) != 0) break;
+        it = pending.erase(it);
+    }
+}
+
+void Watcher::drain()
+{
+    alignas(inotify_event) char buf[64 * 1024];
+
+    for(;;)
+    {
+        const ssize_t n = ::read(fd, buf, sizeof(buf));
+        if(n <= 0) return;   // EAGAIN: drained
+
+        const auto now = Clock::now();
+        for(const char* p = buf; p < buf + n; )
+        {
+            const auto* ev = reinterpret_cast<const inotify_event*>(p);
+            p += sizeof(inotify_event) + ev->len;
+
+            if(ev->mask & IN_Q_OVERFLOW)
+            {
+                // events were lost: rebuild the map, treat every file as changed
+                dirs.clear();
+                addTree(root, 0, true);
+                continue;
+            }
+
+            auto dir = dirs.find(ev->wd);
+            if(dir == dirs.end()) continue;
+
+            if(ev->mask & (IN_DELETE_SELF | IN_IGNORED))
+            {
+                dirs.erase(dir);
+                continue;
+            }
+            if(ev->len == 0) continue;
+
+            const fs::path path = dir->second.first / ev->name;
+            const int depth = dir->second.second;
+
+            if(ev->mask & IN_ISDIR)
+            {
+                const bool descend = crawl.maxDepth < 0 || depth < crawl.maxDepth;
+                if(ev->mask & (IN_MOVED_FROM | IN_DELETE))
+                {
+                    forget(path);
+                    removed.push_back(path);
+                }
+                else if(descend && !crawlExcluded(crawl, path.filename().string()))
+                    addTree(path, depth + 1, true);
+                continue;
+            }
+
+            if(ev->mask & (IN_DELETE | IN_MOVED_FROM))
+            {
+                pending.erase(path);
+                removed.push_back(path);
+                continue;
+            }
+
+            // create, every write, close and rename-into all restart the window
+            pending[path] = now;
+        }
+    }
+}
+
+std::vector<WatchEvent> Watcher::poll(std::chrono::milliseconds timeout)
+{
+    std::vector<WatchEvent> out;
+    if(fd < 0) return out;
+
+    // wake up early if a pending file settles before the timeout
+    auto wait = timeout;
+    if(!pending.empty())
+    {
+        auto first = Clock::time_point::max();
+        for(const auto& [path, last] : pending)
+            first = std::min(first, last);
+        const auto settle = std::chrono::duration_cast<std::chrono::milliseconds>(
+            first + opts.debounce - Clock::now());
+        wait = std::clamp(settle, std::chrono::milliseconds(0), timeout);
+    }
+
+    pollfd pfd{ fd, POLLIN, 0 };
+    if(::poll(&pfd, 1, static_cast<int>(wait.count())) > 0)
+        drain();
+
+    for(auto& p : removed)
+        out.push_back({ std::move(p), true });
+    removed.clear();
+
+    std::vector<fs::path> settled;
+    const auto now = Clock::now();
+    for(auto it = pending.begin(); it != pending.end(); )
+    {
+        if(now - it->second < opts.debounce) { ++it; continue; }
+
+        std::error_code ec;
+        if(crawlWanted(crawl, it->first) && fs::is_regular_file(it->first, ec))
+            settled.push_back(it->first);
+        it = pending.erase(it);
+    }
+
+    for(size_t i = 0; i < settled.size(); i += CrawlOptions::kAcceptBatch)
+    {
+        const size_t end = std::min(settled.size(), i + CrawlOptions::kAcceptBatch);
+        std::vector<fs::path> batch(settled.begin() + i, settled.begin() + end);
+        std::vector<bool> keep(batch.size(), true);
+        if(crawl.accept)
+            crawl.accept(batch, keep);
+
+        for(size_t k = 0; k < batch.size(); ++k)
+            if(keep[k]) out.push_back({ std::move(batch[k]), false });
+    }
+    return out;
+}
@@ -1,12 +1,37 @@
 #include <dcmtk/dcmdata/dctk.h>
 #include <dcmtk/dcmdata/dcuid.h>
 
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <deque>
 #include <filesystem>
 #include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <new>
 #include <optional>
 #include <string>
+#include <vector>
 
+#include "BoundedQueue.h"
+#include "ColumnExport.h"
+#include "Crawler.h"
+#include "Fluence.h"
+#include "Metrics.h"
 #include "Plan.h"
+#include "PlanCache.h"
+#include "PlanDiff.h"
+#include "PatientBatch.h"
+#include "PlanExport.h"
+#include "Stats.h"
+#include "ThreadPool.h"
+#include "UidIndex.h"
+#include "Watcher.h"
+#include "dicom/FileSniffer.h"
+#include "dicom/TagScanner.h"
 
 namespace fs = std::filesystem;
 
@@ -18,6 +43,7 @@ struct PatientInfo
 
 static std::optional<PatientInfo> extractPatientInfo(DcmDataset* ds)
 {
+    stats::Scope scope(stats::Phase::PatientInfo);
     OFString name, id;
 
     if (ds->findAndGetOFString(DCM_PatientName, name).bad())
@@ -29,20 +55,280 @@ static std::optional<PatientInfo> extractPatientInfo(DcmDataset* ds)
     return PatientInfo{ name.c_str(), id.c_str() };
 }
 
-static void readDicomFile(
-    const fs::path& path,
-    std::optional<PatientInfo>& referencePatient)
+// Everything the serial post-pass needs to know about one file.
+// Filled by loadDicomFile, possibly on a worker thread.
+struct FileResult
+{
+    fs::path path;
+    std::string loadError;               // non-empty: loadFile failed
+    std::optional<PatientInfo> patient;  // nullopt: patient tags missing
+    std::string sopClassUid;
+    // owns the memory of `plan`: declared first so it is destroyed last
+    std::unique_ptr<std::pmr::monotonic_buffer_resource> arena;
+    std::optional<Plan> plan;            // RTPLAN only
+    std::optional<IndexedFile> indexed;  // with LoadOptions::index
+
+    FileResult() = default;
+    FileResult(FileResult&&) = default;
+
+    // member-wise assignment would free the old arena before the old plan:
+    // drop the plan first, then take the arena and the plan living in it
+    FileResult& operator=(FileResult&& o) noexcept
+    {
+        if(this != &o)
+        {
+            plan.reset();
+            arena = std::move(o.arena);
+            plan = std::move(o.plan);
+            path = std::move(o.path);
+            loadError = std::move(o.loadError);
+            patient = std::move(o.patient);
+            sopClassUid = std::move(o.sopClassUid);
+            indexed = std::move(o.indexed);
+        }
+        return *this;
+    }
+};
+
+static std::optional<PatientInfo> extractPatientInfo(const dicom::TagScan& scan)
+{
+    using dicom::ScanTag;
+    stats::Scope scope(stats::Phase::PatientInfo);
+
+    if (!scan.has(ScanTag::PatientName) || !scan.has(ScanTag::PatientID))
+        return std::nullopt;
+
+    return PatientInfo{ std::string(scan.get(ScanTag::PatientName)),
+                        std::string(scan.get(ScanTag::PatientID)) };
+}
+
+// Triage only needs SOPClassUID (0008,0016), SOPInstanceUID (0008,0018),
+// PatientName (0010,0010) and PatientID (0010,0020); stop parsing at the
+// first tag after them so bulk data (PixelData, dose grids, contour
+// sequences) is never read.
+static const DcmTagKey kTriageStopTag(0x0010, 0x0021);
+// The UID index also needs Study/Series/FrameOfReference UIDs
+static const DcmTagKey kIndexStopTag(0x0020, 0x0053);
+
+struct LoadOptions
+{
+    bool triage = true;
+    bool index = false;             // fill FileResult::indexed
+    bool arena = true;              // parse each plan into its own monotonic arena
+    bool lazy = false;              // Plan::openLazy: beams decoded on first use
+    bool keepPlans = true;          // false: drop each plan (and its arena) once parsed
+    PlanCache* cache = nullptr;     // optional
+};
+
+static IndexedFile indexRecord(const fs::path& path, const dicom::TagScan& scan)
+{
+    using dicom::ScanTag;
+
+    IndexedFile f;
+    f.path = path.string();
+    f.sopClassUid = scan.get(ScanTag::SOPClassUID);
+    f.sopInstanceUid = scan.get(ScanTag::SOPInstanceUID);
+    f.modality = scan.get(ScanTag::Modality);
+    f.patientId = scan.get(ScanTag::PatientID);
+    f.studyInstanceUid = scan.get(ScanTag::StudyInstanceUID);
+    f.seriesInstanceUid = scan.get(ScanTag::SeriesInstanceUID);
+    f.frameOfReferenceUid = scan.get(ScanTag::FrameOfReferenceUID);
+    return f;
+}
+
+// The whole object model of one plan comes from one arena and goes back
+// in one free; the initial block is sized from the file so most plans
+// need a single upstream allocation.
+static std::pmr::memory_resource* planResource(const fs::path& path, FileResult& r, const LoadOptions& opts)
+{
+    if(!opts.arena)
+        return std::pmr::get_default_resource();
+
+    if(!r.arena)
+    {
+        std::error_code ec;
+        const auto bytes = fs::file_size(path, ec);
+        r.arena = std::make_unique<std::pmr::monotonic_buffer_resource>(
+            ec ? size_t(64 * 1024) : std::max<size_t>(4096, static_cast<size_t>(bytes / 2)));
+    }
+    return r.arena.get();
+}
+
+static void parsePlan(const fs::path& path, DcmDataset* ds, FileResult& r, const LoadOptions& opts)
+{
+    r.plan.emplace(ds, planResource(path, r, opts));
+    r.plan->filePath = path.string();
+
+    if(opts.cache)
+        opts.cache->store(path, *r.plan);
+}
+
+// `sopInstanceUid` as triage read it, to check a cache entry against
+// The plan goes first: it lives in the arena
+static void releasePlan(FileResult& r)
+{
+    r.plan.reset();
+    r.arena.reset();
+}
+
+static void loadPlan(const fs::path& path, const std::string& sopInstanceUid, FileResult& r,
+                     const LoadOptions& opts)
+{
+    // nothing to gain from the cache when the beams may never be read
+    if(opts.lazy)
+    {
+        r.plan = Plan::openLazy(path.string(), r.loadError, planResource(path, r, opts));
+        return;
+    }
+
+    if(opts.cache)
     {
-        DcmFileFormat ff;
-        OFCondition st = ff.loadFile(path.string().c_str());
-        if (!st.good()) {
-            std::cerr << "Failed to read: " << path << " (" << st.text() << ")\n";
+        if(auto cached = opts.cache->load(path, sopInstanceUid, planResource(path, r, opts)))
+        {
+            r.plan = std::move(cached);
             return;
+        }
+    }
+
+    DcmFileFormat ff;
+    OFCondition st;
+    {
+        stats::Scope scope(stats::Phase::LoadFile);
+        st = ff.loadFile(path.string().c_str());
+    }
+    if (!st.good()) {
+        r.loadError = st.text();
+        return;
+    }
+    parsePlan(path, ff.getDataset(), r, opts);
+}
+
+// Header triage without DCMTK: the mmap scanner reads the handful of
+// top-level tags in place. Returns false if the file needs DCMTK.
+static bool scanDicomFile(const fs::path& path, FileResult& r, const LoadOptions& opts)
+{
+    dicom::MappedFile mf;
+    dicom::TagScan scan;
+    {
+        stats::Scope scope(stats::Phase::Scan);
+        if(!mf.open(path.string()) || !dicom::scanTags(mf, scan))
+            return false;
+    }
+
+    if(opts.index)
+        r.indexed = indexRecord(path, scan);
+
+    r.patient = extractPatientInfo(scan);
+    if (!r.patient)
+        return true;
+
+    r.sopClassUid = std::string(scan.get(dicom::ScanTag::SOPClassUID));
+    const std::string sopInstanceUid(scan.get(dicom::ScanTag::SOPInstanceUID));
+    mf.close();
+
+    if(r.sopClassUid == UID_RTPlanStorage)
+        loadPlan(path, sopInstanceUid, r, opts);
+    return true;
+}
+
+static void readDicomFile(const fs::path& path, FileResult& r, const LoadOptions& opts)
+{
+    if(opts.triage && scanDicomFile(path, r, opts))
+        return;
+
+    DcmFileFormat ff;
+    OFCondition st;
+    {
+        stats::Scope scope(stats::Phase::LoadFile);
+        st = opts.triage
+            ? ff.loadFileUntilTag(path.string().c_str(), EXS_Unknown, EGL_noChange,
+                                  DCM_MaxReadLength, ERM_autoDetect,
+                                  opts.index ? kIndexStopTag : kTriageStopTag)
+            : ff.loadFile(path.string().c_str());
+    }
+    if (!st.good()) {
+        r.loadError = st.text();
+        return;
     }
 
     DcmDataset* ds = ff.getDataset();
 
-    auto patientOpt = extractPatientInfo(ds);
+    if(opts.index)
+    {
+        r.indexed.emplace();
+        r.indexed->path = path.string();
+        fillIndexRecord(ds, *r.indexed);
+    }
+
+    r.patient = extractPatientInfo(ds);
+    if (!r.patient)
+        return;
+
+    OFString sopClass;
+    ds->findAndGetOFString(DCM_SOPClassUID, sopClass);
+    r.sopClassUid = sopClass.c_str();
+
+    if(sopClass == UID_RTPlanStorage)
+    {
+        // with triage the plan content lives past the stop tag: reload in full
+        if(opts.triage)
+        {
+            OFString sopInstance;
+            ds->findAndGetOFString(DCM_SOPInstanceUID, sopInstance);
+            loadPlan(path, sopInstance.c_str(), r, opts);
+        }
+        else
+            parsePlan(path, ds, r, opts);
+    }
+}
+
+// Files and Bytes for --stats: every mode reads its inputs through this
+static void countInputFile(const fs::path& path)
+{
+    if(!stats::enabled())
+        return;
+    std::error_code ec;
+    const auto bytes = fs::file_size(path, ec);
+    stats::add(stats::Counter::Files);
+    stats::add(stats::Counter::Bytes, ec ? 0 : bytes);
+}
+
+static FileResult loadDicomFile(const fs::path& path, const LoadOptions& opts)
+{
+    stats::Scope scope(stats::Phase::File);
+    countInputFile(path);
+
+    FileResult r;
+    r.path = path;
+    readDicomFile(path, r, opts);
+
+    if(r.indexed)
+    {
+        if(r.plan && r.plan->referencedStructSetSOPInstanceUid)
+            r.indexed->referencedSopInstanceUids.push_back(*r.plan->referencedStructSetSOPInstanceUid);
+        else
+            readIndexReferences(path, *r.indexed);
+    }
+
+    // the post-pass only needs patient and sopClassUid
+    if(!opts.keepPlans)
+        releasePlan(r);
+    return r;
+}
+
+// Serial, in input order, so the warnings do not depend on scheduling.
+static void checkPatientConsistency(
+    const FileResult& r,
+    std::optional<PatientInfo>& referencePatient)
+{
+    const fs::path& path = r.path;
+
+    if (!r.loadError.empty()) {
+        std::cerr << "Failed to read: " << path << " (" << r.loadError << ")\n";
+        return;
+    }
+
+    const auto& patientOpt = r.patient;
     if (!patientOpt) {
         std::cerr << "WARNING: Missing patient info in " << path.filename() << "\n";
         return;
@@ -65,90 +351,929 @@ static void readDicomFile(
         }
     }
 
-    // Print basic identifiers (same as before)
-    OFString sopClass;
-    ds->findAndGetOFString(DCM_SOPClassUID, sopClass);
-
-    const char* sopName = dcmFindNameOfUID(sopClass.c_str());
-
     /*
+    const char* sopName = dcmFindNameOfUID(r.sopClassUid.c_str());
     std::cout << "File: " << path.filename() << "\n"
               << "  SOPClass: " << (sopName ? sopName : "unknown") << "\n"
               << "  PatientID: " << patientOpt->id << "\n"
               << "  PatientName: " << patientOpt->name << "\n"
               << "--------------------------------------------------\n";
               */
-    if(sopClass == UID_RTPlanStorage)
+}
+
+// Content check instead of the file name: PACS exports are often
+// extensionless or use .IMA. Reads one small block per file.
+static void keepDicomFiles(const std::vector<fs::path>& files, std::vector<bool>& keep)
+{
+    std::vector<std::string> paths;
+    paths.reserve(files.size());
+    for(const auto& f : files)
+        paths.push_back(f.string());
+
+    std::vector<dicom::FileKind> kinds;
+    dicom::sniffFiles(paths, kinds);
+    for(size_t i = 0; i < kinds.size(); ++i)
+        keep[i] = kinds[i] != dicom::FileKind::NotDicom;
+}
+
+// Two files are compared directly; two directories file by file, pairing
+// files by their path relative to each root (non-plan files are skipped).
+// Returns 0 when every pair matches, 3 when any differs, 2 on load errors.
+static int runDiff(const fs::path& a, const fs::path& b, unsigned jobs,
+                   const LoadOptions& opts, const CrawlOptions& crawlOpts,
+                   const DiffTolerances& tol, DiffMode mode)
+{
+    std::vector<std::pair<fs::path, fs::path>> pairs;
+    size_t unmatched = 0;
+
+    std::error_code ec;
+    if(fs::is_directory(a, ec) && fs::is_directory(b, ec))
+    {
+        BoundedQueue<fs::path> found(4096);
+        Crawler crawler(a, crawlOpts, found);
+        while(auto p = found.pop())
+        {
+            fs::path other = b / p->lexically_relative(a);
+            if(fs::exists(other, ec))
+                pairs.emplace_back(std::move(*p), std::move(other));
+            else
+                ++unmatched;
+        }
+        crawler.join();
+        std::sort(pairs.begin(), pairs.end());
+    }
+    else
+    {
+        pairs.emplace_back(a, b);
+    }
+
+    struct Outcome
+    {
+        bool compared = false;
+        std::string error;
+        PlanDiff diff;
+    };
+    std::vector<Outcome> outcomes(pairs.size());
+
+    auto compare = [&](size_t i){
+        const FileResult ra = loadDicomFile(pairs[i].first, opts);
+        const FileResult rb = loadDicomFile(pairs[i].second, opts);
+        Outcome& o = outcomes[i];
+
+        if(!ra.loadError.empty() || !rb.loadError.empty())
+            o.error = !ra.loadError.empty() ? ra.loadError : rb.loadError;
+        else if(ra.plan && rb.plan)
+        {
+            o.diff = diffPlans(*ra.plan, *rb.plan, tol, mode);
+            o.compared = true;
+        }
+        else if(ra.plan || rb.plan)
+            o.error = "only one side is an RTPLAN";
+    };
+
+    if(jobs == 1)
+    {
+        for(size_t i = 0; i < pairs.size(); ++i)
+            compare(i);
+    }
+    else
     {
-        Plan plan(ds);
+        ThreadPool pool(jobs);
+        for(size_t i = 0; i < pairs.size(); ++i)
+            pool.submit([&compare, i]{ compare(i); });
+        pool.wait();
     }
+
+    size_t compared = 0, differ = 0, errors = 0;
+    for(size_t i = 0; i < pairs.size(); ++i)
+    {
+        const Outcome& o = outcomes[i];
+        if(!o.error.empty())
+        {
+            ++errors;
+            std::cerr << "ERROR " << pairs[i].first.string() << " <-> " << pairs[i].second.string()
+                      << ": " << o.error << "\n";
+            continue;
+        }
+        if(!o.compared) continue;
+
+        ++compared;
+        if(o.diff.identical()) continue;
+
+        ++differ;
+        std::cout << "DIFF " << pairs[i].first.string() << " <-> " << pairs[i].second.string();
+        if(mode == DiffMode::Full)
+            std::cout << ": " << o.diff.differences.size() << " differences";
+        std::cout << "\n";
+        o.diff.print(std::cout);
+    }
+
+    std::cerr << "Diff            : " << compared << " plan pairs compared, " << differ << " differ";
+    if(errors) std::cerr << ", " << errors << " errors";
+    if(unmatched) std::cerr << ", " << unmatched << " files without counterpart";
+    std::cerr << "\n";
+
+    if(errors) return 2;
+    return differ ? 3 : 0;
 }
 
-#include <filesystem>
-#include <iostream>
-#include <vector>
-#include <algorithm>
+// --batch: every file is reduced to its header tags and folded into its
+// patient's totals, so the archive is never held in memory; one line per
+// patient on stdout.
+static int runBatch(const std::vector<fs::path>& roots, unsigned jobs, const CrawlOptions& crawlOpts)
+{
+    const auto t0 = std::chrono::steady_clock::now();
 
-namespace fs = std::filesystem;
+    PatientBatch batch;
+    std::optional<ThreadPool> pool;
+    if(jobs != 1)
+    {
+        pool.emplace(jobs);
+        pool->setMaxQueued(4 * pool->size());
+    }
 
-static bool isDicomFileByExtension(const fs::path& p)
+    auto readOne = [&batch](const fs::path& path){
+        stats::Scope scope(stats::Phase::File);
+        countInputFile(path);
+
+        PatientRecord r;
+        std::string error;
+        if(readPatientRecord(path, r, error))
+            batch.add(r);
+        else
+            batch.addFailure(path, error);
+    };
+
+    size_t files = 0;
+    for(const fs::path& root : roots)
+    {
+        BoundedQueue<fs::path> discovered(4096);
+        Crawler crawler(root, crawlOpts, discovered);
+        while(auto path = discovered.pop())
+        {
+            ++files;
+            if(pool)
+                pool->submit([&readOne, p = std::move(*path)]{ readOne(p); });
+            else
+                readOne(*path);
+        }
+        crawler.join();
+    }
+    if(pool)
+        pool->wait();
+
+    if(files == 0)
+    {
+        std::cerr << "No DICOM files found\n";
+        return 2;
+    }
+
+    const std::vector<PatientBatch::Summary> patients = batch.summarize(pool ? &*pool : nullptr);
+
+    size_t withIssues = 0;
+    std::cout << "PatientID\tPatientName\tFiles\tStudies\tFramesOfReference\tPlans\tStatus\n";
+    for(const auto& p : patients)
+    {
+        std::cout << p.patientId << '\t' << p.patientName << '\t' << p.files << '\t'
+                  << p.studies << '\t' << p.framesOfReference << '\t' << p.plans << '\t';
+        if(p.issues.empty())
+            std::cout << "OK";
+        for(size_t i = 0; i < p.issues.size(); ++i)
+            std::cout << (i ? "; " : "") << p.issues[i];
+        std::cout << '\n';
+        withIssues += !p.issues.empty();
+    }
+
+    const auto failures = batch.failureSamples();
+    for(const auto& f : failures)
+        std::cerr << "Failed to read: " << f << "\n";
+    if(batch.failures() > failures.size())
+        std::cerr << "  ... and " << batch.failures() - failures.size() << " more\n";
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::cerr << "Batch           : " << patients.size() << " patients from " << files << " files in "
+              << seconds << " s, " << withIssues << " with issues, "
+              << batch.filesWithoutPatientId() << " files without PatientID, "
+              << batch.failures() << " unreadable\n";
+    return 0;
+}
+
+static void printFiles(const UidIndex& index, const char* label, const std::vector<UidIndex::FileId>& ids)
 {
-    if(!p.has_extension()) return false;
-    std::string ext = p.extension().string();
-    std::transform(ext.begin(), ext.end(), ext.begin(),
-                   [](unsigned char c){ return (char)std::tolower(c); });
-    return ext == ".dcm";
+    if(ids.empty()) return;
+    std::cout << label << ids.size() << " files\n";
+    for(auto id : ids)
+        std::cout << "  " << index.modality(id) << "  " << index.path(id) << "\n";
 }
 
-static std::vector<fs::path> collectDicomFiles(const fs::path& input)
+// Looks a UID up as SOP Instance, Series, Study and Frame of Reference UID;
+// plans are followed to their structure set, images and doses.
+// Returns 0 when anything matched, 2 otherwise.
+static int runQuery(const UidIndex& index, const std::string& uid)
 {
-    std::vector<fs::path> files;
+    bool found = false;
+
+    const UidIndex::FileId sop = index.bySopInstance(uid);
+    if(sop != UidIndex::kNone)
+    {
+        found = true;
+        std::cout << "SOP Instance    : " << index.modality(sop) << "  " << index.path(sop) << "\n";
 
-    if(!fs::exists(input))
-        return files;
+        if(index.sopClassUid(sop) == UID_RTPlanStorage)
+        {
+            const UidIndex::PlanLinks links = index.resolvePlan(sop);
+            if(links.structureSet != UidIndex::kNone)
+                std::cout << "Structure set   : " << index.path(links.structureSet) << "\n";
+            printFiles(index, links.imagesByFrameOfReference ? "Images (by FoR) : " : "Images          : ",
+                       links.images);
+            printFiles(index, "Doses           : ", links.doses);
+        }
+        printFiles(index, "Referenced by   : ", index.referencing(uid));
+    }
 
-    if(fs::is_regular_file(input))
+    for(const auto& [label, ids] : { std::make_pair("Series          : ", &index.bySeries(uid)),
+                                     std::make_pair("Study           : ", &index.byStudy(uid)),
+                                     std::make_pair("Frame of ref.   : ", &index.byFrameOfReference(uid)) })
     {
-        if(isDicomFileByExtension(input))
-            files.push_back(input);
-        return files;
+        found = found || !ids->empty();
+        printFiles(index, label, *ids);
     }
 
-    if(fs::is_directory(input))
+    if(!found)
+        std::cerr << "UID not found in index: " << uid << "\n";
+    return found ? 0 : 2;
+}
+
+// --list: one line per plan, from the fields a lazy load decodes up front
+static void listPlans(const std::vector<const Plan*>& plans)
+{
+    if(plans.empty()) return;
+
+    std::cout << "File\tPatientID\tPlanLabel\tPlanName\tPlanDate\tApproval\tBeams\tTotalMU\n";
+    for(const Plan* plan : plans)
+    {
+        std::cout << plan->filePath << '\t' << plan->patientId << '\t'
+                  << plan->rtPlanLabel << '\t' << plan->rtPlanName << '\t'
+                  << plan->rtPlanDate.value_or("") << '\t' << plan->approvalStatus.value_or("") << '\t'
+                  << plan->beamCount() << '\t';
+        if(plan->totalPlannedMetersetMU)
+            std::cout << *plan->totalPlannedMetersetMU;
+        std::cout << '\n';
+    }
+}
+
+// What to do with the plans of a run (or of one --watch batch)
+struct ReportOptions
+{
+    unsigned jobs = 1;
+    bool list = false;
+    bool metrics = false;
+    std::optional<fs::path> fluenceDir;
+    FluenceOptions fluenceOpts;
+    JsonWriter* ndjson = nullptr;   // --format ndjson
+    ExportOptions exportOpts;
+    ColumnWriter* columns = nullptr;
+};
+
+static void exportPlans(const std::vector<const Plan*>& plans, JsonWriter& out, const ExportOptions& opts)
+{
+    // text already written to stdout must come first
+    std::cout.flush();
+
+    const auto t0 = std::chrono::steady_clock::now();
+    const uint64_t start = out.bytes();
+    size_t records = 0;
+    for(const Plan* plan : plans)
+        records += writePlanNdjson(*plan, out, opts);
+    out.flush();
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    const double mb = (out.bytes() - start) / 1e6;
+    std::cerr << "Export          : " << records << " records, " << mb << " MB in " << seconds << " s, "
+              << (seconds > 0.0 ? mb / seconds : 0.0) << " MB/s";
+    if(!out.ok())
+        std::cerr << ", write error: " << out.error();
+    std::cerr << "\n";
+}
+
+static void exportColumns(const std::vector<const Plan*>& plans, ColumnWriter& out)
+{
+    const auto t0 = std::chrono::steady_clock::now();
+    const uint64_t rows = out.rows(), bytes = out.bytes();
+    const size_t skipped = out.skippedBeams();
+    bool ok = true;
+    for(const Plan* plan : plans)
+        if(!(ok = out.append(*plan))) break;
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    const double mb = (out.bytes() - bytes) / 1e6;
+    std::cerr << "Columns         : " << out.rows() - rows << " control points, " << mb << " MB in "
+              << seconds << " s, " << (seconds > 0.0 ? mb / seconds : 0.0) << " MB/s";
+    if(out.skippedBeams() != skipped)
+        std::cerr << ", " << out.skippedBeams() - skipped << " beams wider than the leaf width skipped";
+    if(!ok)
+        std::cerr << ", write error: " << out.error();
+    std::cerr << "\n";
+}
+
+static void reportPlans(const std::vector<const Plan*>& plans, const ReportOptions& ro)
+{
+    if(plans.empty()) return;
+    stats::Scope scope(stats::Phase::Report);
+
+    if(ro.list)
+        listPlans(plans);
+
+    if(ro.ndjson)
+        exportPlans(plans, *ro.ndjson, ro.exportOpts);
+
+    if(ro.columns)
+        exportColumns(plans, *ro.columns);
+
+    // lazy plans decode on first access, which must not happen on the workers
+    if(ro.jobs != 1 && (ro.metrics || ro.fluenceDir))
+        for(const Plan* plan : plans)
+            for(const Beam& beam : plan->beams())
+                beam.controlPoints();
+
+    if(ro.metrics)
+    {
+        const auto t0 = std::chrono::steady_clock::now();
+        std::vector<PlanMetrics> report;
+        if(ro.jobs == 1)
+            report = computeMetrics(plans, nullptr);
+        else
+        {
+            ThreadPool pool(ro.jobs);
+            report = computeMetrics(plans, &pool);
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+        size_t cps = 0;
+        for(const auto& pm : report)
+        {
+            pm.print();
+            cps += pm.controlPoints;
+        }
+        std::cerr << "Metrics         : " << cps << " control points in " << seconds << " s, "
+                  << (seconds > 0.0 ? cps / seconds : 0.0) << " CPs/s\n";
+    }
+
+    if(ro.fluenceDir)
+    {
+        std::error_code ec;
+        fs::create_directories(*ro.fluenceDir, ec);
+
+        std::optional<ThreadPool> pool;
+        if(ro.jobs != 1) pool.emplace(ro.jobs);
+
+        const auto t0 = std::chrono::steady_clock::now();
+        size_t beams = 0, failed = 0;
+        for(const Plan* plan : plans)
+        {
+            const std::string stem = plan->sopInstanceUid.empty() ? fs::path(plan->filePath).stem().string()
+                                                                  : plan->sopInstanceUid;
+            for(const auto& beam : plan->beams())
+            {
+                const FluenceMap map = computeFluence(beam, ro.fluenceOpts, pool ? &*pool : nullptr);
+                if(!writeFluence(map, *ro.fluenceDir / (stem + "_beam" + std::to_string(beam.beamNumber))))
+                    ++failed;
+                ++beams;
+            }
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+        std::cerr << "Fluence         : " << beams << " beams written to " << *ro.fluenceDir
+                  << " in " << seconds << " s";
+        if(failed)
+            std::cerr << ", " << failed << " write errors";
+        std::cerr << "\n";
+    }
+}
+
+static void saveIndex(const std::vector<const FileResult*>& results, const fs::path& file)
+{
+    UidIndex index;
+    size_t duplicates = 0, plans = 0, withStructureSet = 0, withImages = 0, withDose = 0;
+    for(const FileResult* r : results)
+        if(r->indexed && !index.add(*r->indexed))
+            ++duplicates;
+
+    for(UidIndex::FileId id = 0; id < index.size(); ++id)
     {
-        for(const auto& entry : fs::directory_iterator(input))
+        if(index.sopClassUid(id) != UID_RTPlanStorage) continue;
+        const UidIndex::PlanLinks links = index.resolvePlan(id);
+        ++plans;
+        withStructureSet += links.structureSet != UidIndex::kNone;
+        withImages += !links.images.empty();
+        withDose += !links.doses.empty();
+    }
+
+    const bool saved = index.save(file);
+    std::cerr << "Index           : " << index.size() << " files";
+    if(duplicates)
+        std::cerr << " (" << duplicates << " without SOP Instance UID or duplicate)";
+    std::cerr << ", " << plans << " plans: " << withStructureSet << " with structure set, "
+              << withImages << " with images, " << withDose << " with dose; "
+              << (saved ? "written to " : "NOT written to ") << file << "\n";
+}
+
+static volatile std::sig_atomic_t gStop = 0;
+
+static void onStopSignal(int)
+{
+    gStop = 1;
+}
+
+// --watch: parse files as they settle and keep the per-file results and
+// the reference patient across batches, until SIGINT/SIGTERM.
+static void watchLoop(Watcher& watcher, std::map<fs::path, FileResult>& state,
+                      std::optional<PatientInfo>& referencePatient,
+                      const LoadOptions& opts, const ReportOptions& ro)
+{
+    std::signal(SIGINT, onStopSignal);
+    std::signal(SIGTERM, onStopSignal);
+    std::cerr << "Watching        : " << watcher.directories() << " directories, "
+              << state.size() << " files known (Ctrl-C to stop)\n";
+
+    while(!gStop)
+    {
+        std::vector<fs::path> changed;
+        size_t removed = 0;
+        for(auto& ev : watcher.poll(std::chrono::milliseconds(250)))
         {
-            if(entry.is_regular_file() && isDicomFileByExtension(entry.path()))
-                files.push_back(entry.path());
+            if(!ev.removed)
+            {
+                changed.push_back(std::move(ev.path));
+                continue;
+            }
+            // a removed directory takes every file below it along
+            const std::string prefix = ev.path.string() + "/";
+            for(auto it = state.lower_bound(ev.path); it != state.end(); )
+            {
+                const std::string p = it->first.string();
+                if(p != ev.path.string() && p.compare(0, prefix.size(), prefix) != 0) break;
+                it = state.erase(it);
+                ++removed;
+            }
         }
-        return files;
+        if(changed.empty())
+        {
+            if(removed)
+                std::cerr << "Watch           : " << removed << " removed, " << state.size() << " files known\n";
+            continue;
+        }
+
+        std::vector<FileResult> batch(changed.size());
+        if(ro.jobs == 1 || changed.size() == 1)
+        {
+            for(size_t i = 0; i < changed.size(); ++i)
+                batch[i] = loadDicomFile(changed[i], opts);
+        }
+        else
+        {
+            ThreadPool pool(ro.jobs);
+            for(size_t i = 0; i < changed.size(); ++i)
+                pool.submit([&batch, &changed, &opts, i]{ batch[i] = loadDicomFile(changed[i], opts); });
+            pool.wait();
+        }
+
+        size_t added = 0;
+        std::vector<const Plan*> plans;
+        for(auto& r : batch)
+        {
+            checkPatientConsistency(r, referencePatient);
+            fs::path key = r.path;
+            auto [it, fresh] = state.insert_or_assign(std::move(key), std::move(r));
+            added += fresh;
+            if(it->second.plan) plans.push_back(&*it->second.plan);
+        }
+
+        std::cerr << "Watch           : " << batch.size() << " parsed (" << added << " new, "
+                  << batch.size() - added << " modified), " << removed << " removed, "
+                  << state.size() << " files known\n";
+        reportPlans(plans, ro);
+
+        // reported once; the state only has to remember the files
+        for(const fs::path& path : changed)
+            if(auto it = state.find(path); it != state.end())
+                releasePlan(it->second);
     }
+}
 
-    return files; // e.g. symlink, socket, etc.
+static void printUsage()
+{
+    std::cerr << "Usage: dicom_reader [options] <dicom_folder_or_file>\n"
+              << "       dicom_reader [options] --diff <plan_or_folder_a> <plan_or_folder_b>\n"
+              << "       dicom_reader --index FILE --query UID\n"
+              << "       dicom_reader [options] --batch <folder>...\n"
+              << "  --jobs N            load and parse N files concurrently (0 = all cores, default 1)\n"
+              << "  --no-triage         load every file in full instead of stopping after the\n"
+              << "                      patient/SOP class tags (only RTPLANs are fully loaded)\n"
+              << "  --cache DIR         reuse parsed plans from DIR when the file is unchanged\n"
+              << "  --cache-invalidate  ignore existing cache entries and rewrite them\n"
+              << "  --no-arena          allocate plans from the heap instead of one arena per file\n"
+              << "  --list              print one line per plan; beams and control points are only\n"
+              << "                      decoded if another option needs them\n"
+              << "  --max-depth N       descend at most N directory levels (default unlimited)\n"
+              << "  --follow-symlinks   also follow symlinks to directories\n"
+              << "  --no-symlinks       skip symlinks entirely\n"
+              << "  --include GLOB      only files whose name matches GLOB (repeatable);\n"
+              << "                      without it every file is checked for DICOM content\n"
+              << "  --exclude GLOB      skip files and directories matching GLOB (repeatable)\n"
+              << "  --crawl-stats       report files/sec for discovery and parsing\n"
+              << "  --stats FMT         at exit, time per phase (p50/p95/p99), files/s and CPs/s\n"
+              << "                      on stderr; FMT is text or json\n"
+              << "  --format FMT        text (default) or ndjson: one JSON record per plan\n"
+              << "  --ndjson-cps        with --format ndjson: also one record per control point\n"
+              << "  --output FILE       write the ndjson export to FILE instead of stdout\n"
+              << "  --columns DIR       append every control point to the column store in DIR\n"
+              << "  --columns-leaves N  MLC leaf pairs per row (default: DIR's own, 80 for a new DIR)\n"
+              << "  --metrics           print modulation complexity metrics for every plan\n"
+              << "  --fluence DIR       write the planned fluence of every beam to DIR (MetaImage)\n"
+              << "  --fluence-res MM    fluence pixel size (default 1 mm)\n"
+              << "  --diff A B          compare two plans, or two folders plan by plan;\n"
+              << "                      exit status 0 = identical, 3 = differences, 2 = errors\n"
+              << "  --brief             with --diff: stop at the first difference per plan\n"
+              << "  --diff-tol-mm MM    position and leaf tolerance (default 0.01)\n"
+              << "  --diff-tol-deg DEG  angle tolerance (default 0.01)\n"
+              << "  --batch             group files of any number of folders by PatientID, check\n"
+              << "                      each patient's names and Study/FoR UIDs, one line each\n"
+              << "  --index FILE        index SOP/Series/Study/FoR UIDs of every file and save to FILE\n"
+              << "  --query UID         with --index and no input: look UID up in the saved index\n"
+              << "  --watch             after the initial scan, keep parsing files created or\n"
+              << "                      modified in the folder (inotify) until Ctrl-C\n"
+              << "  --watch-debounce MS parse a file once it has been quiet this long (default 500)\n";
 }
 
 int main(int argc, char** argv)
 {
-    if(argc < 2)
+    const auto runStart = std::chrono::steady_clock::now();
+    unsigned jobs = 1;
+    LoadOptions opts;
+    std::optional<fs::path> cacheDir;
+    bool invalidateCache = false;
+    CrawlOptions crawlOpts;
+    bool crawlStats = false;
+    std::optional<stats::Format> statsFormat;
+    ReportOptions report;
+    bool ndjson = false;
+    std::optional<std::string> outputFile;
+    std::optional<fs::path> columnsDir;
+    int columnsLeaves = 0;              // 0: the store's own width
+    bool watch = false;
+    WatchOptions watchOpts;
+    std::optional<std::pair<fs::path, fs::path>> diffArgs;
+    DiffTolerances diffTol;
+    DiffMode diffMode = DiffMode::Full;
+    std::optional<fs::path> indexFile;
+    std::optional<std::string> queryUid;
+    std::optional<fs::path> inputArg;
+    bool batch = false;
+    std::vector<fs::path> batchInputs;      // inputs after the first, --batch only
+
+    for(int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if(arg == "--jobs" || arg == "-j")
+        {
+            if(i + 1 >= argc) { printUsage(); return 1; }
+            try { jobs = static_cast<unsigned>(std::stoul(argv[++i])); }
+            catch(const std::exception&) { printUsage(); return 1; }
+        }
+        else if(arg == "--no-triage")
+            opts.triage = false;
+        else if(arg == "--no-arena")
+            opts.arena = false;
+        else if(arg == "--list")
+            report.list = true;
+        else if(arg == "--cache")
+        {
+            if(i + 1 >= argc) { printUsage(); return 1; }
+            cacheDir = argv[++i];
+        }
+        else if(arg == "--cache-invalidate")
+            invalidateCache = true;
+        else if(arg == "--max-depth")
+        {
+            if(i + 1 >= argc) { printUsage(); return 1; }
+            try { crawlOpts.maxDepth = std::stoi(argv[++i]); }
+            catch(const std::exception&) { printUsage(); return 1; }
+        }
+        else if(arg == "--follow-symlinks")
+            crawlOpts.symlinks = SymlinkPolicy::All;
+        else if(arg == "--no-symlinks")
+            crawlOpts.symlinks = SymlinkPolicy::None;
+        else if(arg == "--include" || arg == "--exclude")
+        {
+            if(i + 1 >= argc) { printUsage(); return 1; }
+            (arg == "--include" ? crawlOpts.include : crawlOpts.exclude).push_back(argv[++i]);
+        }
+        else if(arg == "--crawl-stats")
+            crawlStats = true;
+        else if(arg == "--stats")
+        {
+            if(i + 1 >= argc) { printUsage(); return 1; }
+            const std::string fmt = argv[++i];
+            if(fmt == "text")
+                statsFormat = stats::Format::Text;
+            else if(fmt == "json")
+                statsFormat = stats::Format::Json;
+            else { printUsage(); return 1; }
+        }
+        else if(arg == "--format")
+        {
+            if(i + 1 >= argc) { printUsage(); return 1; }
+            const std::string fmt = argv[++i];
+            if(fmt == "ndjson")
+                ndjson = true;
+            else if(fmt != "text") { printUsage(); return 1; }
+        }
+        else if(arg == "--ndjson-cps")
+            report.exportOpts.controlPoints = true;
+        else if(arg == "--output")
+        {
+            if(i + 1 >= argc) { printUsage(); return 1; }
+            outputFile = argv[++i];
+        }
+        else if(arg == "--columns")
+        {
+            if(i + 1 >= argc) { printUsage(); return 1; }
+            columnsDir = argv[++i];
+        }
+        else if(arg == "--columns-leaves")
+        {
+            if(i + 1 >= argc) { printUsage(); return 1; }
+            try { columnsLeaves = std::stoi(argv[++i]); }
+            catch(const std::exception&) { printUsage(); return 1; }
+            if(columnsLeaves <= 0) { printUsage(); return 1; }
+        }
+        else if(arg == "--metrics")
+            report.metrics = true;
+        else if(arg == "--fluence")
+        {
+            if(i + 1 >= argc) { printUsage(); return 1; }
+            report.fluenceDir = argv[++i];
+        }
+        else if(arg == "--fluence-res")
+        {
+            if(i + 1 >= argc) { printUsage(); return 1; }
+            try { report.fluenceOpts.pixelMm = std::stod(argv[++i]); }
+            catch(const std::exception&) { printUsage(); return 1; }
+        }
+        else if(arg == "--diff")
+        {
+            if(i + 2 >= argc) { printUsage(); return 1; }
+            diffArgs.emplace(argv[i + 1], argv[i + 2]);
+            i += 2;
+        }
+        else if(arg == "--brief")
+            diffMode = DiffMode::FirstDifference;
+        else if(arg == "--diff-tol-mm" || arg == "--diff-tol-deg")
+        {
+            if(i + 1 >= argc) { printUsage(); return 1; }
+            double v = 0.0;
+            try { v = std::stod(argv[++i]); }
+            catch(const std::exception&) { printUsage(); return 1; }
+            if(arg == "--diff-tol-deg")
+                diffTol.angleDeg = v;
+            else
+                diffTol.positionMm = diffTol.leafMm = v;
+        }
+        else if(arg == "--index")
+        {
+            if(i + 1 >= argc) { printUsage(); return 1; }
+            indexFile = argv[++i];
+        }
+        else if(arg == "--query")
+        {
+            if(i + 1 >= argc) { printUsage(); return 1; }
+            queryUid = argv[++i];
+        }
+        else if(arg == "--watch")
+            watch = true;
+        else if(arg == "--watch-debounce")
+        {
+            if(i + 1 >= argc) { printUsage(); return 1; }
+            try { watchOpts.debounce = std::chrono::milliseconds(std::stol(argv[++i])); }
+            catch(const std::exception&) { printUsage(); return 1; }
+        }
+        else if(arg == "--batch")
+            batch = true;
+        else if(!inputArg)
+            inputArg = arg;
+        else
+            batchInputs.push_back(arg);
+    }
+
+    if(!batch && !batchInputs.empty())
     {
-        std::cerr << "Usage: dicom_reader <dicom_folder_or_file>\n";
+        printUsage();
         return 1;
     }
 
-    fs::path input(argv[1]);
-    auto dicomFiles = collectDicomFiles(input);
+    if(statsFormat)
+    {
+        if(!stats::kCompiled)
+            std::cerr << "--stats: built without DICOM_READER_STATS, nothing is recorded\n";
+        stats::enable();
+    }
+    auto printStats = [&]{
+        if(statsFormat)
+            stats::report(std::cerr, *statsFormat,
+                          std::chrono::duration<double>(std::chrono::steady_clock::now() - runStart).count());
+    };
+
+    if(queryUid)
+    {
+        if(!indexFile || inputArg || diffArgs) { printUsage(); return 1; }
+
+        const auto t0 = std::chrono::steady_clock::now();
+        UidIndex index;
+        if(!index.load(*indexFile))
+        {
+            std::cerr << "Cannot read index: " << *indexFile << "\n";
+            return 2;
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        std::cerr << "Index           : " << index.size() << " files loaded in " << seconds << " s\n";
+        return runQuery(index, *queryUid);
+    }
+
+    if(!inputArg && !diffArgs)
+    {
+        printUsage();
+        return 1;
+    }
+
+    std::optional<PlanCache> cache;
+    if(cacheDir)
+    {
+        cache.emplace(*cacheDir, invalidateCache);
+        opts.cache = &*cache;
+    }
+
+    crawlOpts.accept = keepDicomFiles;
+
+    if(batch)
+    {
+        if(!inputArg || diffArgs || watch) { printUsage(); return 1; }
+        batchInputs.insert(batchInputs.begin(), *inputArg);
+        const int rc = runBatch(batchInputs, jobs, crawlOpts);
+        printStats();
+        return rc;
+    }
+
+    if(diffArgs)
+    {
+        if(inputArg) { printUsage(); return 1; }
+        const int rc = runDiff(diffArgs->first, diffArgs->second, jobs, opts, crawlOpts, diffTol, diffMode);
+        if(cache)
+            cache->printCounters(std::cerr);
+        printStats();
+        return rc;
+    }
+
+    fs::path input(*inputArg);
+    opts.index = indexFile.has_value();
+    opts.lazy = report.list;
+    // without a report, plans are parsed (and checked) and dropped at once
+    opts.keepPlans = report.list || report.metrics || report.fluenceDir || ndjson || columnsDir;
+    report.jobs = jobs;
+
+    std::optional<JsonWriter> ndjsonOut;
+    if(ndjson)
+    {
+        ndjsonOut.emplace();
+        if(outputFile && !ndjsonOut->open(*outputFile))
+        {
+            std::cerr << "Cannot write " << ndjsonOut->error() << "\n";
+            return 2;
+        }
+        report.ndjson = &*ndjsonOut;
+    }
+
+    ColumnWriter columnsOut;
+    if(columnsDir)
+    {
+        if(!columnsOut.open(*columnsDir, columnsLeaves))
+        {
+            std::cerr << "Cannot write " << columnsOut.error() << "\n";
+            return 2;
+        }
+        report.columns = &columnsOut;
+    }
+
+    // watches go in before the crawl so nothing written meanwhile is missed;
+    // a file seen by both is simply parsed twice
+    std::optional<Watcher> watcher;
+    if(watch)
+    {
+        watcher.emplace(input, crawlOpts, watchOpts);
+        if(!watcher->ok())
+        {
+            std::cerr << "Cannot watch " << input << ": " << watcher->error() << "\n";
+            return 2;
+        }
+    }
+
+    // Discovery runs on its own thread and streams paths to the parser
+    BoundedQueue<fs::path> discovered(4096);
+    Crawler crawler(input, crawlOpts, discovered);
 
-    if(dicomFiles.empty())
+    // deque: slots keep their address while workers fill them
+    std::deque<FileResult> slots;
+    const auto parseStart = std::chrono::steady_clock::now();
+
+    if(jobs == 1)
+    {
+        while(auto path = discovered.pop())
+            slots.push_back(loadDicomFile(*path, opts));
+    }
+    else
     {
-        std::cerr << "No .dcm files found at: " << input << "\n";
+        ThreadPool pool(jobs);
+        pool.setMaxQueued(4 * pool.size());
+        while(auto path = discovered.pop())
+        {
+            FileResult& slot = slots.emplace_back();
+            pool.submit([&slot, &opts, p = std::move(*path)]{ slot = loadDicomFile(p, opts); });
+        }
+        pool.wait();
+    }
+
+    crawler.join();
+    const double parseSeconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - parseStart).count();
+
+    if(crawlStats)
+    {
+        const auto& cs = crawler.stats();
+        auto rate = [](size_t n, double s){ return s > 0.0 ? n / s : 0.0; };
+        std::cerr << "Crawl           : " << cs.filesQueued << " files queued ("
+                  << cs.filesSeen << " seen, " << cs.directories << " dirs) in "
+                  << cs.seconds << " s, " << rate(cs.filesQueued, cs.seconds) << " files/s\n"
+                  << "Parse           : " << slots.size() << " files in "
+                  << parseSeconds << " s, " << rate(slots.size(), parseSeconds) << " files/s\n";
+    }
+
+    if(slots.empty() && !watcher)
+    {
+        std::cerr << "No DICOM files found at: " << input << "\n";
         return 2;
     }
 
+    // discovery order depends on the file system; keep output diffable
+    std::vector<FileResult> results(std::make_move_iterator(slots.begin()),
+                                    std::make_move_iterator(slots.end()));
+    slots.clear();
+    std::sort(results.begin(), results.end(),
+              [](const FileResult& a, const FileResult& b){ return a.path < b.path; });
+
     std::optional<PatientInfo> referencePatient;
 
-    for(const auto& f : dicomFiles)
-        readDicomFile(f, referencePatient);
+    for(const auto& r : results)
+        checkPatientConsistency(r, referencePatient);
+
+    {
+        std::vector<const Plan*> plans;
+        std::vector<const FileResult*> all;
+        for(const auto& r : results)
+        {
+            all.push_back(&r);
+            if(r.plan) plans.push_back(&*r.plan);
+        }
+        reportPlans(plans, report);
+        if(indexFile)
+            saveIndex(all, *indexFile);
+    }
+    for(auto& r : results)
+        releasePlan(r);
+
+    if(watcher)
+    {
+        std::map<fs::path, FileResult> state;
+        for(auto& r : results)
+        {
+            fs::path key = r.path;
+            state.emplace(std::move(key), std::move(r));
+        }
+        results.clear();
+
+        watchLoop(*watcher, state, referencePatient, opts, report);
+
+        if(indexFile)
+        {
+            std::vector<const FileResult*> all;
+            for(const auto& [path, r] : state)
+                all.push_back(&r);
+            saveIndex(all, *indexFile);
+        }
+    }
+
+    if(cache)
+        cache->printCounters(std::cerr);
+    printStats();
 
     return 0;
 }
-